@@ -7,6 +7,9 @@
  *
  */
 
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,12 +19,26 @@
 #include <sys/stat.h>
 
 #include "block.h"
+#include "crc32c.h"
 
 //Disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
 int diskfile = -1;
 
+// Write tracking, see bio_track()
+static uint32_t *track_gens;
+static uint32_t track_nblks;
+static uint32_t track_gen;
+
+// Block checksums, see bio_checksum()
+static uint32_t *sum_table;
+static uint32_t sum_nblks;
+static unsigned long sum_seq;		/* bumped after every change to sum_table */
+
+// Reads of a block that keep racing writes to it before it is taken as unchecked
+#define SUM_RETRIES 8
+
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
     if (diskfile >= 0) {
@@ -54,29 +71,272 @@ int dev_open(const char* diskfile_path) {
 void dev_close() {
     if (diskfile >= 0) {
 		close(diskfile);
+		diskfile = -1;
+    }
+}
+
+//Descriptor of the open disk file, for callers that move data without block_buf
+int dev_fd() {
+    return diskfile;
+}
+
+//Flush written blocks to stable storage
+int dev_sync() {
+    int retstat = fdatasync(diskfile);
+    if (retstat < 0) {
+		perror("disk_sync failed");
+    }
+    return retstat;
+}
+
+//Checksum of a block's contents; never 0, which stands for none
+static uint32_t block_sum(const void *buf) {
+    uint32_t sum = crc32c(0, buf, BLOCK_SIZE);
+    return sum ? sum : 1;
+}
+
+static uint32_t sum_get(off_t blk) {
+    return sum_table != NULL && blk < sum_nblks ? __atomic_load_n(&sum_table[blk], __ATOMIC_SEQ_CST) : 0;
+}
+
+static unsigned long sum_seq_get() {
+    return __atomic_load_n(&sum_seq, __ATOMIC_SEQ_CST);
+}
+
+static void sum_put(off_t blk, uint32_t sum) {
+    if (sum_table != NULL && blk < sum_nblks) {
+        __atomic_store_n(&sum_table[blk], sum, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&sum_seq, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+//Read len bytes at byte offset pos, spanning blocks; anything past the end of the disk file reads as zeros
+static int read_full(off_t pos, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t retstat = pread(diskfile, (char *)buf + done, len - done, pos + done);
+        if (retstat < 0) {
+			return -1;
+        }
+        if (retstat == 0) {
+			memset((char *)buf + done, 0, len - done);
+			break;
+        }
+        done += retstat;
+    }
+    return 0;
+}
+
+/*
+ * Check block blk, read with sum its checksum and seq the sum_seq taken
+ * before it. A write clears the sum before it starts and sets it once
+ * done, each time bumping sum_seq, so a mismatch with sum_seq unchanged
+ * is damage, while one with sum_seq moved may be a read that raced
+ * writes, even ones that put the block back as it was; that is read
+ * again (1), up to tries SUM_RETRIES, and then let through unchecked.
+ */
+static int sum_check(off_t blk, const void *buf, uint32_t sum, unsigned long seq, int tries) {
+    if (sum == 0 || block_sum(buf) == sum) {
+		return 0;
+    }
+    if (sum_seq_get() != seq) {
+		return tries < SUM_RETRIES ? 1 : 0;
     }
+    fprintf(stderr, "block_read: checksum mismatch in block %lld\n", (long long)blk);
+    errno = EIO;
+    return -1;
 }
 
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
     int retstat = 0;
-    retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
-    if (retstat <= 0) {
-		memset (buf, 0, BLOCK_SIZE);
-		if (retstat < 0)
-			perror("block_read failed");
+    for (int tries = 0; ; tries++) {
+        unsigned long seq = sum_seq_get();
+        uint32_t sum = sum_get(block_num);
+        retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
+        if (retstat <= 0) {
+			memset (buf, 0, BLOCK_SIZE);
+			if (retstat < 0) {
+				perror("block_read failed");
+				return retstat;
+			}
+        }
+        int check = sum_check(block_num, buf, sum, seq, tries);
+        if (check < 0) {
+			return -1;
+        }
+        if (check == 0) {
+			break;
+        }
+    }
+
+    return retstat;
+}
+
+//Read len bytes at byte offset pos, spanning blocks; anything past the end of the disk file reads as zeros
+int bio_read_range(off_t pos, void *buf, size_t len) {
+    if (read_full(pos, buf, len) < 0) {
+		perror("block_read_range failed");
+		return -1;
     }
 
+    // A block that fails, or is only partly in buf, is checked on a read of its own
+    for (off_t blk = pos / BLOCK_SIZE; sum_table != NULL && len > 0 && blk <= (off_t)(pos + len - 1) / BLOCK_SIZE; blk++) {
+        off_t start = blk * BLOCK_SIZE;
+        uint32_t sum = sum_get(blk);
+        if (sum == 0) {
+			continue;
+        }
+        if (start >= pos && start + BLOCK_SIZE <= pos + (off_t)len && block_sum((char *)buf + (start - pos)) == sum) {
+			continue;
+        }
+
+        char block[BLOCK_SIZE];
+        for (int tries = 0; ; tries++) {
+            unsigned long seq = sum_seq_get();
+            sum = sum_get(blk);
+            if (read_full(start, block, BLOCK_SIZE) < 0) {
+				perror("block_read_range failed");
+				return -1;
+            }
+            int check = sum_check(blk, block, sum, seq, tries);
+            if (check < 0) {
+				return -1;
+            }
+            if (check == 0) {
+				break;
+            }
+        }
+        off_t lo = start > pos ? start : pos;
+        off_t hi = start + BLOCK_SIZE < pos + (off_t)len ? start + BLOCK_SIZE : pos + (off_t)len;
+        memcpy((char *)buf + (lo - pos), block + (lo - start), hi - lo);
+    }
+    return len;
+}
+
+//Start reading a byte range into the page cache without waiting for it
+int bio_prefetch(off_t pos, size_t len) {
+    int retstat = posix_fadvise(diskfile, pos, len, POSIX_FADV_WILLNEED);
+    if (retstat != 0) {
+		fprintf(stderr, "block_prefetch failed: %s\n", strerror(retstat));
+		return -1;
+    }
+    return 0;
+}
+
+//Stamp every block written from now on with gen in gens, which covers nblks blocks; NULL stops it
+void bio_track(uint32_t *gens, uint32_t nblks, uint32_t gen) {
+    track_gens = gens;
+    track_nblks = nblks;
+    track_gen = gen;
+}
+
+/*
+ * Keep a CRC-32C of every block below nblks in sums, 0 where none is
+ * known, and fail reads of a block that no longer matches its sum with
+ * EIO. A write through bio_* sets the sums of the whole blocks it covers;
+ * any other write leaves its blocks without one. NULL stops it.
+ */
+void bio_checksum(uint32_t *sums, uint32_t nblks) {
+    sum_table = sums;
+    sum_nblks = nblks;
+}
+
+//Stamp the blocks a byte range overlaps as written and drop their sums, before the write starts
+void bio_mark(off_t pos, size_t len) {
+    if (len == 0) {
+		return;
+    }
+    for (off_t blk = pos / BLOCK_SIZE; blk <= (off_t)(pos + len - 1) / BLOCK_SIZE; blk++) {
+        if (track_gens != NULL && blk < track_nblks) {
+			track_gens[blk] = track_gen;
+        }
+        sum_put(blk, 0);
+    }
+}
+
+//Set the sums of the whole blocks in a byte range just written from buf
+static void sum_range(off_t pos, const void *buf, size_t len) {
+    if (sum_table == NULL) {
+		return;
+    }
+    for (off_t start = (pos + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE; start + BLOCK_SIZE <= pos + (off_t)len;
+         start += BLOCK_SIZE) {
+        sum_put(start / BLOCK_SIZE, block_sum((const char *)buf + (start - pos)));
+    }
+}
+
+//Return a byte range of the disk file to the host; it reads as zeros afterwards
+int bio_discard(off_t pos, size_t len) {
+    bio_mark(pos, len);
+    int retstat = fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, len);
+    if (retstat < 0 && errno != EOPNOTSUPP) {
+		perror("block_discard failed");
+    }
     return retstat;
 }
 
+//Write len bytes at byte offset pos, spanning blocks
+int bio_write_range(off_t pos, const void *buf, size_t len) {
+    size_t done = 0;
+    bio_mark(pos, len);
+    while (done < len) {
+        ssize_t retstat = pwrite(diskfile, (const char *)buf + done, len - done, pos + done);
+        if (retstat < 0) {
+			perror("block_write_range failed");
+			return -1;
+        }
+        done += retstat;
+    }
+    sum_range(pos, buf, len);
+    return len;
+}
+
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
     int retstat = 0;
+    bio_mark((off_t)block_num*BLOCK_SIZE, BLOCK_SIZE);
     retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
     if (retstat < 0) {
 		    perror("block_write failed");
+    } else if (retstat == BLOCK_SIZE) {
+		    sum_put(block_num, block_sum(buf));
     }
     return retstat;
 }
 
+//Write consecutive blocks starting at block_num from a list of buffers
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt) {
+    int retstat = 0;
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    bio_mark((off_t)block_num*BLOCK_SIZE, len);
+    retstat = pwritev(diskfile, iov, iovcnt, (off_t)block_num*BLOCK_SIZE);
+    if (retstat < 0) {
+		    perror("block_writev failed");
+		    return retstat;
+    }
+
+    // The buffers need not line up with blocks, so each sum is carried across them
+    uint32_t crc = 0;
+    size_t fill = 0, done = 0;
+    for (int i = 0; sum_table != NULL && i < iovcnt; i++) {
+        const char *p = iov[i].iov_base;
+        for (size_t left = iov[i].iov_len; left > 0 && done < (size_t)retstat; ) {
+            size_t n = BLOCK_SIZE - fill < left ? BLOCK_SIZE - fill : left;
+            crc = crc32c(crc, p, n);
+            p += n;
+            left -= n;
+            done += n;
+            fill += n;
+            if (fill == BLOCK_SIZE && done <= (size_t)retstat) {
+                sum_put(block_num + done / BLOCK_SIZE - 1, crc ? crc : 1);
+                crc = 0;
+                fill = 0;
+            }
+        }
+    }
+    return retstat;
+}
@@ -8,12 +8,26 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+int dev_fd();
+int dev_sync();
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_read_range(off_t pos, void *buf, size_t len);
+int bio_prefetch(off_t pos, size_t len);
+int bio_discard(off_t pos, size_t len);
+void bio_track(uint32_t *gens, uint32_t nblks, uint32_t gen);
+void bio_checksum(uint32_t *sums, uint32_t nblks);
+void bio_mark(off_t pos, size_t len);
+int bio_write_range(off_t pos, const void *buf, size_t len);
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt);
 
 #endif
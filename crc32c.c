@@ -0,0 +1,131 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	crc32c.c
+ *
+ *	CRC-32C (Castagnoli) for block checksums. On x86-64 with SSE4.2 and
+ *	PCLMULQDQ, long buffers are run through the crc32 instruction as three
+ *	interleaved lanes, whose results are joined with a carry-less multiply;
+ *	elsewhere a slicing-by-8 table does the work.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_HW 1
+#endif
+
+#define POLY 0x82F63B78				/* reflected Castagnoli polynomial */
+#define LANE 1360					/* bytes per lane; three lanes of a 4096-byte block leave 16 */
+
+static uint32_t table[8][256];
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+static int use_hw;
+static uint64_t lane_k;				/* x^(8 * LANE - 33) mod P, see shift_lane() */
+
+// Multiply a reflected polynomial by x, mod P
+static uint32_t mulx(uint32_t r) {
+    return (r >> 1) ^ (r & 1 ? POLY : 0);
+}
+
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++) {
+            c = mulx(c);
+        }
+        table[0][n] = c;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        for (int k = 1; k < 8; k++) {
+            table[k][n] = (table[k - 1][n] >> 8) ^ table[0][table[k - 1][n] & 0xFF];
+        }
+    }
+
+    uint32_t k = 0x80000000;		/* x^0 */
+    for (int i = 0; i < 8 * LANE - 33; i++) {
+        k = mulx(k);
+    }
+    lane_k = k;
+
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    use_hw = __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = table[7][lo & 0xFF] ^ table[6][(lo >> 8) & 0xFF] ^ table[5][(lo >> 16) & 0xFF] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xFF] ^ table[2][(hi >> 8) & 0xFF] ^ table[1][(hi >> 16) & 0xFF] ^ table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xFF];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HW
+/*
+ * Move a crc over LANE zero bytes. The product of two reflected 32-bit
+ * values is their product times x as a reflected 64-bit value, and crc32
+ * of that multiplies by x^32 mod P, so a factor of x^(8 * LANE - 33)
+ * comes out as x^(8 * LANE).
+ */
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift_lane(uint32_t crc) {
+    __m128i prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc), _mm_cvtsi64_si128(lane_k), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    uint64_t c0 = crc, c1, c2, w0, w1, w2;
+
+    // Three independent chains keep the crc32 unit busy despite its latency
+    for (; len >= 3 * LANE; len -= 3 * LANE, p += 3 * LANE) {
+        c1 = c2 = 0;
+        for (size_t i = 0; i < LANE; i += 8) {
+            memcpy(&w0, p + i, 8);
+            memcpy(&w1, p + LANE + i, 8);
+            memcpy(&w2, p + 2 * LANE + i, 8);
+            c0 = _mm_crc32_u64(c0, w0);
+            c1 = _mm_crc32_u64(c1, w1);
+            c2 = _mm_crc32_u64(c2, w2);
+        }
+        c0 = shift_lane(shift_lane(c0) ^ c1) ^ c2;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w0, p, 8);
+        c0 = _mm_crc32_u64(c0, w0);
+    }
+    for (; len > 0; len--) {
+        c0 = _mm_crc32_u8(c0, *p++);
+    }
+    return c0;
+}
+#endif
+
+// Extend crc, 0 to start, over len bytes of buf
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&init_once, crc32c_init);
+    crc = ~crc;
+#ifdef CRC32C_HW
+    if (use_hw) {
+        return ~crc32c_hw(crc, buf, len);
+    }
+#endif
+    return ~crc32c_sw(crc, buf, len);
+}
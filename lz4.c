@@ -0,0 +1,189 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	lz4.c
+ *
+ *	LZ4 block format codec for compressed file clusters. A block is a
+ *	series of sequences, each a token byte (literal count in the high
+ *	nibble, match length - 4 in the low one, 15 meaning more bytes of 255
+ *	follow), the literals, and a 2-byte little-endian match offset. The
+ *	last sequence has literals only, and the last 5 bytes are always
+ *	literals.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5				/* bytes at the end that are never matched */
+#define MF_LIMIT 12					/* no match starts this close to the end */
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write a length's extension bytes after a nibble of 15
+static uint8_t *put_len(uint8_t *op, uint32_t n) {
+    for (; n >= 255; n -= 255) {
+        *op++ = 255;
+    }
+    *op++ = n;
+    return op;
+}
+
+// Emit literals [anchor, ip) and, if mlen is set, a match of mlen bytes at offset; NULL if it would not fit
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *anchor, const uint8_t *ip,
+                        uint32_t offset, uint32_t mlen) {
+    uint32_t lit = ip - anchor;
+
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + (mlen ? 2 + mlen / 255 + 1 : 0)) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) {
+        op = put_len(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    if (mlen) {
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        mlen -= MIN_MATCH;
+        *token |= mlen >= 15 ? 15 : mlen;
+        if (mlen >= 15) {
+            op = put_len(op, mlen - 15);
+        }
+    }
+    return op;
+}
+
+/*
+ * Compress len bytes of src into dst. Returns the compressed length, or
+ * 0 if it does not fit in cap bytes. Positions are found with one hash
+ * table entry per 4-byte prefix; a run of misses makes the scan skip
+ * ahead faster, so data that does not compress costs little.
+ */
+int lz4_compress(const void *src, int len, void *dst, int cap) {
+    const uint8_t *in = src, *end = in + len;
+    const uint8_t *ip = in, *anchor = in;
+    uint8_t *op = dst, *oend = op + cap;
+    uint32_t table[1 << HASH_BITS];
+
+    if (len > MF_LIMIT) {
+        memset(table, 0, sizeof(table));
+        const uint8_t *mflimit = end - MF_LIMIT, *matchlimit = end - LAST_LITERALS;
+
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = ip - in;
+            if (ref >= ip || ip - ref > MAX_OFFSET || read32(ref) != seq) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            // Extend the match back into the literals, then forwards
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            op = put_seq(op, oend, anchor, ip, ip - ref, mp - ip);
+            if (op == NULL) {
+                return 0;
+            }
+            ip = anchor = mp;
+        }
+    }
+
+    op = put_seq(op, oend, anchor, end, 0, 0);
+    return op == NULL ? 0 : op - (uint8_t *)dst;
+}
+
+/*
+ * Decompress clen bytes of src into dst, which holds cap bytes. Returns
+ * the decompressed length, or -1 if src is not a valid block or would
+ * overrun dst.
+ */
+int lz4_decompress(const void *src, int clen, void *dst, int cap) {
+    const uint8_t *ip = src, *iend = ip + clen;
+    uint8_t *op = dst, *oend = op + cap;
+
+    while (ip < iend) {
+        uint32_t token = *ip++, b;
+
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst)) {
+            return -1;
+        }
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) {
+                    return -1;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) {
+            return -1;
+        }
+
+        // An overlapping match repeats its own output, so copy it bytewise
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - (uint8_t *)dst;
+}
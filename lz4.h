@@ -0,0 +1,14 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	lz4.h
+ *
+ */
+
+#ifndef _LZ4_H_
+#define _LZ4_H_
+
+int lz4_compress(const void *src, int len, void *dst, int cap);
+int lz4_decompress(const void *src, int clen, void *dst, int cap);
+
+#endif
@@ -13,6 +13,8 @@
 #define NAME_LEN 255
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,10 +23,13 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <sys/time.h>
+#include <time.h>
 #include <libgen.h>
 #include <limits.h>
+#include <pthread.h>
 
 #include "block.h"
+#include "lz4.h"
 #include "rufs.h"
 
 char diskfile_path[PATH_MAX];
@@ -32,6 +37,257 @@ char diskfile_path[PATH_MAX];
 // Declare your in-memory data structures here
 struct superblock sb;
 
+/*
+ * Mount options, given with -o. "highlevel" serves the path-based rufs_ope
+ * instead of the low-level frontend. entry_timeout and attr_timeout are how
+ * long the kernel may cache names and attributes, and keep_cache lets it
+ * keep a file's pages across opens; rufs invalidates them itself when it
+ * changes something behind the kernel's back. "writeback" asks for the
+ * kernel's writeback cache where libfuse supports it. "log" writes file
+ * data log-structured (see log_alloc()). "snapshot=<id>" mounts that
+ * snapshot read-only instead of the live tree. "compress" stores every
+ * file created on the mount compressed (see cluster_store()). "dedup"
+ * shares written blocks with identical ones already on disk (see
+ * dedup_write()). "datasum" keeps file data off the splice paths so that
+ * all of it is checksummed and checked, and "scrub=<n>" checks up to n
+ * blocks a second in the background (see scrub_run()).
+ */
+struct rufs_options {
+    int highlevel;
+    double entry_timeout;
+    double attr_timeout;
+    int keep_cache;
+    int writeback;
+    int log;
+    unsigned int snapshot;
+    int compress;
+    int dedup;
+    int datasum;
+    unsigned int scrub;
+};
+
+static struct rufs_options rufs_options = { 0, 1.0, 1.0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+/*
+ * Set when the kernel runs a writeback cache for this mount. It then owns
+ * mtime and ctime and sends them with setattr, so writes leave them alone.
+ */
+static int writeback_cache;
+
+// Set when a snapshot is mounted; nothing is written to the image then
+static int read_only;
+
+// Channel of the low-level session, for cache invalidation notices
+static struct fuse_chan *ll_chan;
+
+static void cache_invalidate(uint16_t ino) {
+    if (ll_chan != NULL) {
+        fuse_lowlevel_notify_inval_inode(ll_chan, (fuse_ino_t)ino + 1, 0, 0);
+    }
+}
+
+/*
+ * In-memory bitmaps. They are loaded at mount and are the authoritative
+ * copy while mounted; every change is written through to disk. Each one
+ * has its own lock.
+ */
+unsigned char inode_bitmap[BLOCK_SIZE];
+unsigned char data_bitmap[BLOCK_SIZE];
+static pthread_mutex_t ibitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t dbitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Orphans: inodes whose last name is gone but whose blocks are not freed
+ * yet. Unlink only sets the bit; the background worker frees the inode
+ * once nothing holds it. The bitmap is on disk at sb.o_bitmap_blk so a
+ * crash leaves nothing behind, and it shares ibitmap_lock.
+ */
+static unsigned char orphan_bitmap[BLOCK_SIZE];
+
+/*
+ * Reference counts of data blocks shared between files by a copy range
+ * or deduplication: how many pointers a block has beyond the first, so 0
+ * for a block only one file uses. A shared block is copied before it is
+ * written and only freed with its last pointer. On disk from
+ * sb.r_start_blk; they share dbitmap_lock.
+ */
+#define REFS_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+#define REF_BLKS (MAX_DNUM / REFS_PER_BLOCK)
+
+static uint16_t blk_refs[MAX_DNUM];
+
+/*
+ * Pointers dropped by transactions on their way to disk. The data bitmap
+ * and reference counts only change once the transaction that dropped the
+ * pointer is durable, so a block is never handed out again while a
+ * committed inode may still name it. Until then the block is marked here,
+ * and the copies that go to disk leave it out. Under dbitmap_lock.
+ */
+static unsigned char free_pending[BLOCK_SIZE];
+static uint16_t ref_pending[MAX_DNUM];
+
+/*
+ * Deduplication index, in memory only: the fingerprint of each indexed
+ * data block, 0 if it is not indexed, and a table from fingerprint to
+ * block in which a newer block replaces an older one in the same slot.
+ * A block leaves the index when it is freed or about to be written in
+ * place. Under dbitmap_lock, like the reference counts it feeds.
+ */
+#define DEDUP_SLOTS (2 * MAX_DNUM)
+
+static uint64_t dedup_fps[MAX_DNUM];
+static int dedup_table[DEDUP_SLOTS];		/* data block index + 1, 0 if empty */
+
+/*
+ * Generation stamp of every image block (see rufs.h), kept up to date by
+ * block.c as blocks are written. The table goes back to disk at unmount;
+ * after a crash it is stale, so the next mount stamps every block.
+ */
+static uint32_t blk_gen[GEN_BLKS * GENS_PER_BLOCK];
+
+/*
+ * Checksum of every image block (see rufs.h), kept up to date by block.c
+ * like the generation stamps and written back at unmount. After a crash
+ * the table is stale, so the next mount starts it empty.
+ */
+static uint32_t blk_sum[SUM_BLKS * SUMS_PER_BLOCK];
+
+/*
+ * Background worker. One thread does the work requests should not wait
+ * for: reclaiming orphans, cleaning segments in log mode, returning
+ * freed blocks to the host and scrubbing.
+ */
+#define WORK_RECLAIM 1
+#define WORK_CLEAN 2
+#define WORK_DISCARD 4
+#define WORK_SCRUB 8
+
+static pthread_t worker;
+static int worker_running;
+static int work_pending;			/* WORK_* bits, under work_lock, as is work_stop */
+static int work_stop;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+
+static void worker_wake(int work) {
+    pthread_mutex_lock(&work_lock);
+    work_pending |= work;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+}
+
+/*
+ * In-memory copy of the inode table. It mirrors the on-disk layout, so a
+ * cached inode block can be written back without reading it first.
+ */
+#define INODES_PER_BLOCK (BLOCK_SIZE / sizeof(struct inode))
+#define INODE_TABLE_BLKS ((MAX_INUM * sizeof(struct inode)) / BLOCK_SIZE)
+#define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(struct dirent))
+
+// Largest read or write request we ask FUSE for
+#define RUFS_MAX_IO (1 << 20)
+
+static struct inode inode_table[MAX_INUM];
+static uint8_t inode_blk_cached[INODE_TABLE_BLKS];
+static uint64_t inode_pins[MAX_INUM];		/* takes the kernel's lookup counts, which are 64 bit */
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The inode table as commits write it out. Inode table blocks are staged
+ * from here rather than from inode_table, whose other inodes may be half
+ * way through a change under their own locks. Each inode gets here only
+ * as batch_put_inode() took it, when its batch is queued, under
+ * itable_lock.
+ */
+static struct inode inode_image[MAX_INUM];
+static pthread_mutex_t itable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Locking: every inode has a reader-writer lock covering the inode and its
+ * data or directory blocks. A directory is locked before anything inside
+ * it, and inode locks are always taken before the bitmap locks (inode
+ * bitmap first). icache_lock only guards loading the cache and the pins.
+ */
+/*
+ * Per-inode write state, under the inode lock: which inode changes are not
+ * on disk yet, and whether the file has changed since its last fsync.
+ */
+#define INODE_DIRTY_TIMES 1			/* only timestamps changed */
+#define INODE_DIRTY_META 2			/* size or block pointers changed */
+
+struct inode_wstate {
+    uint8_t dirty;
+    uint8_t unsynced;
+};
+
+static struct inode_wstate inode_wstate[MAX_INUM];
+
+static pthread_rwlock_t inode_locks[MAX_INUM];
+static pthread_once_t inode_locks_once = PTHREAD_ONCE_INIT;
+
+static void inode_locks_init() {
+    for (int i = 0; i < MAX_INUM; i++) {
+        pthread_rwlock_init(&inode_locks[i], NULL);
+    }
+}
+
+static void ilock_rd(uint16_t ino) {
+    pthread_rwlock_rdlock(&inode_locks[ino]);
+}
+
+static void ilock_wr(uint16_t ino) {
+    pthread_rwlock_wrlock(&inode_locks[ino]);
+}
+
+static void iunlock(uint16_t ino) {
+    pthread_rwlock_unlock(&inode_locks[ino]);
+}
+
+static void inode_cache_reset() {
+    pthread_once(&inode_locks_once, inode_locks_init);
+
+    pthread_mutex_lock(&icache_lock);
+    memset(inode_blk_cached, 0, sizeof(inode_blk_cached));
+    memset(inode_wstate, 0, sizeof(inode_wstate));
+    pthread_mutex_unlock(&icache_lock);
+}
+
+static int inode_cache_load(uint16_t ino) {
+    int idx = ino / INODES_PER_BLOCK;
+
+    pthread_mutex_lock(&icache_lock);
+    if (!inode_blk_cached[idx]) {
+        if (bio_read(sb.i_start_blk + idx, &inode_table[idx * INODES_PER_BLOCK]) < 0) {
+            pthread_mutex_unlock(&icache_lock);
+            return -1;
+        }
+        pthread_mutex_lock(&itable_lock);
+        memcpy(&inode_image[idx * INODES_PER_BLOCK], &inode_table[idx * INODES_PER_BLOCK], BLOCK_SIZE);
+        pthread_mutex_unlock(&itable_lock);
+        inode_blk_cached[idx] = 1;
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return idx;
+}
+
+// Write one metadata block, or one inode, through the journal; defined with the batches
+static int meta_write(uint32_t blk_num, void *buf);
+static int meta_write_inode(struct inode *inode);
+static void seg_own(const struct inode *inode, int blk);
+
+/*
+ * Find and set the first clear bit of an in-memory bitmap
+ */
+static int bitmap_alloc(bitmap_t bitmap, int max) {
+    for (int i = 0; i < max; i++) {
+        if (!get_bitmap(bitmap, i)) {
+            set_bitmap(bitmap, i);
+            return i;
+        }
+    }
+    return -1;
+}
+
 /* 
  * Get available inode number from bitmap
  */
@@ -39,30 +295,20 @@ int get_avail_ino() {
 
     //Inode 0 is reserved, so bitmap should reflect it as used 
 
-	// Step 1: Read inode bitmap from disk
+	// Step 1: Take the inode bitmap lock
 	
 	// Step 2: Traverse inode bitmap to find an available slot
 
 	// Step 3: Update inode bitmap and write to disk 
 
-	char buf[BLOCK_SIZE];
-    if (bio_read(sb.i_bitmap_blk, buf) < 0) {
-        return -1;
-    }
-
-    for (int i = 0; i < MAX_INUM; i++) {
-        if (!get_bitmap((bitmap_t)buf, i)) { 
-            set_bitmap((bitmap_t)buf, i);
-
-            if (bio_write(sb.i_bitmap_blk, buf) < 0) {
-                return -1;
-            }
+    pthread_mutex_lock(&ibitmap_lock);
+    int i = bitmap_alloc(inode_bitmap, MAX_INUM);
+    pthread_mutex_unlock(&ibitmap_lock);
 
-            return i; 
-        }
+    if (i >= 0 && meta_write(sb.i_bitmap_blk, inode_bitmap) < 0) {
+        i = -1;
     }
-
-    return -1; 
+    return i; 
 }
 
 /* 
@@ -70,727 +316,5645 @@ int get_avail_ino() {
  */
 int get_avail_blkno() {
 
-	// Step 1: Read data block bitmap from disk
+	// Step 1: Take the data block bitmap lock
 	
 	// Step 2: Traverse data block bitmap to find an available slot
 
 	// Step 3: Update data block bitmap and write to disk 
 
-	char buf[BLOCK_SIZE];
-    if (bio_read(sb.d_bitmap_blk, buf) < 0) {
-        return -1; 
-    }
-
-    for (int i = 0; i < MAX_DNUM; i++) {
-        if (!get_bitmap((bitmap_t)buf, i)) {
-            set_bitmap((bitmap_t)buf, i);
-
-            if (bio_write(sb.d_bitmap_blk, buf) < 0) {
-                return -1;
-            }
+    pthread_mutex_lock(&dbitmap_lock);
+    int i = bitmap_alloc(data_bitmap, MAX_DNUM);
+    pthread_mutex_unlock(&dbitmap_lock);
 
-            return i;
-        }
+    if (i >= 0 && meta_write(sb.d_bitmap_blk, data_bitmap) < 0) {
+        i = -1;
     }
-    return -1;
+    return i;
 }
 
+
 /* 
  * inode operations
+ *
+ * readi() and writei() copy from and to the inode cache; the caller holds
+ * the inode's lock.
  */
 int readi(uint16_t ino, struct inode *inode) {
-    if (ino >= sb.max_inum) {
+    if (ino >= sb.max_inum || ino >= MAX_INUM) {
         return -1;
     }
 
-    uint32_t blk_num = sb.i_start_blk + (ino * sizeof(struct inode)) / BLOCK_SIZE;
-    uint32_t offset = (ino * sizeof(struct inode)) % BLOCK_SIZE;
-
-    char buf[BLOCK_SIZE];
-    if (bio_read(blk_num, buf) < 0) {
+    if (inode_cache_load(ino) < 0) {
         return -1;
     }
 
-    memcpy(inode, buf + offset, sizeof(struct inode));
+    memcpy(inode, &inode_table[ino], sizeof(struct inode));
     return 0;
 }
 
 int writei(uint16_t ino, struct inode *inode) {
-    if (ino >= sb.max_inum) {
+    if (ino >= sb.max_inum || ino >= MAX_INUM) {
         return -1;
     }
-
-    uint32_t blk_num = sb.i_start_blk + (ino * sizeof(struct inode)) / BLOCK_SIZE;
-    uint32_t offset = (ino * sizeof(struct inode)) % BLOCK_SIZE;
-
-    char buf[BLOCK_SIZE];
-    if (bio_read(blk_num, buf) < 0) {
+    if (inode_cache_load(ino) < 0) {
         return -1; 
     }
 
-    memcpy(buf + offset, inode, sizeof(struct inode));
+    if (inode != &inode_table[ino]) {
+        memcpy(&inode_table[ino], inode, sizeof(struct inode));
+    }
+    inode_table[ino].ino = ino;
 
-    if (bio_write(blk_num, buf) < 0) {
+    if (meta_write_inode(&inode_table[ino]) < 0) {
         return -1; 
     }
-
     return 0; 
 }
 
-
-/* 
- * directory operations
+/*
+ * Fill a stat buffer from an inode
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-
-  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
-
-  // Step 2: Get data block of current directory from inode
+static void inode_to_stat(const struct inode *inode, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode->ino;
+    stbuf->st_mode = inode->type;
+    stbuf->st_nlink = inode->link;
+    stbuf->st_size = inode->size;
+    stbuf->st_uid = getuid();
+    stbuf->st_gid = getgid();
+    stbuf->st_blksize = BLOCK_SIZE;
+    if (inode->type & S_IFREG) {
+        stbuf->st_blocks = inode->vstat.st_blocks;
+    } else {
+        stbuf->st_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    stbuf->st_atim = inode->vstat.st_atim;
+    stbuf->st_mtim = inode->vstat.st_mtim;
+    stbuf->st_ctim = inode->vstat.st_ctim;
+}
 
-  // Step 3: Read directory's data block and check each directory entry.
-  //If the name matches, then copy directory entry to dirent structure
-    
-	struct inode dir_inode;
-    
-    if (readi(ino, &dir_inode) < 0) {
-        return -1; 
+// A regular file's vstat.st_blocks counts the 512-byte units it has allocated
+static void inode_add_blocks(struct inode *inode, int nblks) {
+    inode->vstat.st_blocks += (blkcnt_t)nblks * (BLOCK_SIZE / 512);
+    if (inode->vstat.st_blocks < 0) {
+        inode->vstat.st_blocks = 0;
     }
+}
 
-    for (int i = 0; i < 16 && dir_inode.direct_ptr[i] != 0; i++) {
-        char buf[BLOCK_SIZE];
-        if (bio_read(dir_inode.direct_ptr[i], buf) < 0) {
-            return -1; 
-        }
+/*
+ * Timestamps live in inode->vstat and are written back with the inode
+ */
+#define RUFS_ATIME 1
+#define RUFS_MTIME 2
+#define RUFS_CTIME 4
 
-        struct dirent *entry = (struct dirent *)buf;
-        for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
-            if (entry[j].valid && strncmp(entry[j].name, fname, name_len) == 0) {
-                memcpy(dirent, &entry[j], sizeof(struct dirent));
-                return 0; 
-            }
-        }
-    }
+static void inode_touch(struct inode *inode, int which) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
 
-    return -1;
+    if (which & RUFS_ATIME) {
+        inode->vstat.st_atim = now;
+    }
+    if (which & RUFS_MTIME) {
+        inode->vstat.st_mtim = now;
+    }
+    if (which & RUFS_CTIME) {
+        inode->vstat.st_ctim = now;
+    }
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-
-	// Step 1: Read dir_inode's data block and check each directory entry of dir_inode
-	
-	// Step 2: Check if fname (directory name) is already used in other entries
+static int ts_after(const struct timespec *a, const struct timespec *b) {
+    return a->tv_sec > b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec > b->tv_nsec);
+}
 
-	// Step 3: Add directory entry in dir_inode's data block and write to disk
+// relatime: record an access only if it is the first since the last change, or a day old
+static int atime_due(const struct inode *inode) {
+    const struct stat *st = &inode->vstat;
 
-    struct dirent existing_entry;
-    if (dir_find(dir_inode.ino, fname, name_len, &existing_entry) == 0) {
-        return -1;
+    if (!ts_after(&st->st_atim, &st->st_mtim) || !ts_after(&st->st_atim, &st->st_ctim)) {
+        return 1;
     }
+    return time(NULL) - st->st_atim.tv_sec >= 24 * 60 * 60;
+}
 
-	struct dirent new_dirent = {0};
-    new_dirent.ino = f_ino;
-    new_dirent.valid = 1;
-    strncpy(new_dirent.name, fname, NAME_LEN - 1);
-    new_dirent.name[NAME_LEN - 1] = '\0';        
-    new_dirent.len = (uint16_t)name_len;
-
-    char buf[BLOCK_SIZE];
-    int entries_per_block = BLOCK_SIZE / sizeof(struct dirent);
 
-    for (int i = 0; i < 16; i++) {
-        if (dir_inode.direct_ptr[i] == 0) {
-            break;
-        }
+/*
+ * Pin an inode in the cache and return the cached copy. Changes made
+ * through the pointer are seen by readi() right away and reach disk on
+ * the next writei().
+ */
+static struct inode *iget(uint16_t ino) {
+    if (ino >= sb.max_inum || ino >= MAX_INUM) {
+        return NULL;
+    }
+    if (inode_cache_load(ino) < 0) {
+        return NULL;
+    }
 
-        if (bio_read(dir_inode.direct_ptr[i], buf) < 0) {
-            return -1;
-        }
+    pthread_mutex_lock(&icache_lock);
+    inode_pins[ino]++;
+    pthread_mutex_unlock(&icache_lock);
+    return &inode_table[ino];
+}
 
-        struct dirent *entry = (struct dirent *)buf;
-        for (int j = 0; j < entries_per_block; j++) {
-            if (!entry[j].valid) { 
-                memset(&entry[j], 0, sizeof(struct dirent));
-                memcpy(&entry[j], &new_dirent, sizeof(struct dirent));
-                if (bio_write(dir_inode.direct_ptr[i], buf) < 0) {
-                    return -1;
-                }
-                if (writei(dir_inode.ino, &dir_inode) < 0) {
-                    return -1;
-                }
-                return 0;
-            }
+// An orphan is freed once its last pin is dropped
+static void iput_n(uint16_t ino, uint64_t n) {
+    pthread_mutex_lock(&icache_lock);
+    if (n > inode_pins[ino]) {
+        fprintf(stderr, "rufs: inode %u dropped %llu pins, holds %llu\n", ino,
+                (unsigned long long)n, (unsigned long long)inode_pins[ino]);
+        n = inode_pins[ino];
+    }
+    inode_pins[ino] -= n;
+    int unused = inode_pins[ino] == 0;
+    pthread_mutex_unlock(&icache_lock);
+
+    if (unused) {
+        pthread_mutex_lock(&ibitmap_lock);
+        int orphan = get_bitmap(orphan_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+        if (orphan) {
+            worker_wake(WORK_RECLAIM);
         }
     }
+}
 
-    for (int i = 0; i < 16; i++) {
-        if (dir_inode.direct_ptr[i] == 0) {
-            if (i == 15) {
-                return -1;
-            }
+static void iput(struct inode *inode) {
+    iput_n(inode->ino, 1);
+}
 
-            int new_block = get_avail_blkno();
-            if (new_block < 0) {
-                return -1;
-            }
+/* 
+ * metadata batches
+ *
+ * An operation stages every metadata block it changes in a batch and
+ * writes them all at once with batch_commit(). Bitmap and reference
+ * count blocks are staged straight from their in-memory copies, and inode
+ * table blocks from inode_image; other blocks get a private copy. A
+ * committed batch is one journal transaction, so an operation must fit in
+ * one batch: nothing is committed halfway through. Pointers it drops are
+ * only applied to the bitmap and reference counts once it is durable.
+ */
+#define BATCH_MAX_BLKS JOURNAL_MAX_BLKS
+#define BATCH_MAX_COPIES 12				/* every pointer block of a file, and some */
+#define BATCH_MAX_ALLOCS 32
+#define BATCH_MAX_DISCARDS 64
+#define BATCH_MAX_INODES (BATCH_MAX_ALLOCS + 2)
+
+struct meta_batch {
+    int nblks;
+    uint32_t blk_num[BATCH_MAX_BLKS];
+    char *blk_buf[BATCH_MAX_BLKS];
+    int npool;
+    char pool[BATCH_MAX_COPIES][BLOCK_SIZE];
+    int nallocs;					/* bits set by batch_alloc, undone on abort */
+    uint32_t alloc_blk[BATCH_MAX_ALLOCS];
+    int alloc_bit[BATCH_MAX_ALLOCS];
+    int ndallocs;					/* data blocks taken by alloc_data_blk, malloc'd and grown as needed */
+    int dallocs_cap;
+    uint32_t *dallocs;
+    int revoke;						/* frees blocks that may be in the journal */
+    int ndiscards;					/* runs of blocks its commit freed, for discard_queue() */
+    uint32_t discard_blk[BATCH_MAX_DISCARDS];
+    uint32_t discard_len[BATCH_MAX_DISCARDS];
+    int ninodes;					/* inodes saved, each as cached before and, once put, as put */
+    uint16_t inode_ino[BATCH_MAX_INODES];
+    uint8_t inode_put[BATCH_MAX_INODES];
+    struct inode inode_new[BATCH_MAX_INODES];
+    struct inode inode_old[BATCH_MAX_INODES];
+    int ndrops;						/* data block pointers dropped, malloc'd and grown as needed */
+    int drops_cap;
+    uint32_t *drops;				/* data block index, with DROP_FREED once that frees it */
+    int ntakes;						/* references taken by batch_take_ref, given back on abort */
+    int takes_cap;
+    uint32_t *takes;
+};
 
-            int abs_block = sb.d_start_blk + new_block;
-            dir_inode.direct_ptr[i] = abs_block;
-            dir_inode.size += BLOCK_SIZE;
-            memset(buf, 0, BLOCK_SIZE);
-            if (bio_write(abs_block, buf) < 0) {
-                return -1;
-            }
+#define DROP_FREED 0x80000000u
+
+static void batch_init(struct meta_batch *b) {
+    b->nblks = 0;
+    b->npool = 0;
+    b->nallocs = 0;
+    b->ndallocs = 0;
+    b->dallocs_cap = 0;
+    b->dallocs = NULL;
+    b->revoke = 0;
+    b->ndiscards = 0;
+    b->ninodes = 0;
+    b->ndrops = 0;
+    b->drops_cap = 0;
+    b->drops = NULL;
+    b->ntakes = 0;
+    b->takes_cap = 0;
+    b->takes = NULL;
+}
 
-            if (writei(dir_inode.ino, &dir_inode) < 0) {
-                return -1;
-            }
+static char *batch_lookup(struct meta_batch *b, uint32_t blk_num) {
+    for (int i = 0; i < b->nblks; i++) {
+        if (b->blk_num[i] == blk_num) {
+            return b->blk_buf[i];
+        }
+    }
+    return NULL;
+}
 
-            if (bio_read(abs_block, buf) < 0) {
-                return -1;
-            }
+/*
+ * Stage a block for writing and return its buffer. If read is set and the
+ * block is not staged yet, its current contents are read from disk.
+ */
+static char *batch_get(struct meta_batch *b, uint32_t blk_num, int read) {
+    char *buf = batch_lookup(b, blk_num);
+    if (buf != NULL) {
+        return buf;
+    }
+    if (b->nblks == BATCH_MAX_BLKS || b->npool == BATCH_MAX_COPIES) {
+        return NULL;
+    }
 
-            struct dirent *entry = (struct dirent *)buf;
-            memset(&entry[0], 0, sizeof(struct dirent));
-            memcpy(&entry[0], &new_dirent, sizeof(struct dirent));
-            if (bio_write(abs_block, buf) < 0) {
-                return -1;
-            }
-            if (writei(dir_inode.ino, &dir_inode) < 0) {
-                return -1;
-            }
-            return 0;
+    buf = b->pool[b->npool];
+    if (read) {
+        if (bio_read(blk_num, buf) < 0) {
+            return NULL;
         }
+    } else {
+        memset(buf, 0, BLOCK_SIZE);
     }
+    b->npool++;
 
-    return -1;
+    b->blk_num[b->nblks] = blk_num;
+    b->blk_buf[b->nblks] = buf;
+    b->nblks++;
+    return buf;
 }
 
-//skip
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {return 0;}
+// Stage a block whose contents live in memory elsewhere
+static int batch_stage(struct meta_batch *b, uint32_t blk_num, void *buf) {
+    if (batch_lookup(b, blk_num) != NULL) {
+        return 0;
+    }
+    if (b->nblks == BATCH_MAX_BLKS) {
+        return -1;
+    }
+    b->blk_num[b->nblks] = blk_num;
+    b->blk_buf[b->nblks] = buf;
+    b->nblks++;
+    return 0;
+}
 
-/* 
- * namei operation
+/*
+ * Remember an inode as cached before the batch changes it, for
+ * batch_abort() to put back; called before the first change, under the
+ * caller's lock. Returns its slot in the batch.
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-	
-	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
-	// Note: You could either implement it in a iterative way or recursive way
-
-    //debug:
-    printf("Resolving path: %s\n", path);
-    
-	if (strcmp(path, "/") == 0) {
-        return readi(ino, inode);
+static int batch_save_inode(struct meta_batch *b, struct inode *inode) {
+    if (inode->ino >= sb.max_inum || inode->ino >= MAX_INUM || inode_cache_load(inode->ino) < 0) {
+        return -1;
     }
 
-    char path_copy[PATH_MAX];
-    strncpy(path_copy, path, PATH_MAX);
+    int i = 0;
+    while (i < b->ninodes && b->inode_ino[i] != inode->ino) {
+        i++;
+    }
+    if (i == b->ninodes) {
+        if (i == BATCH_MAX_INODES) {
+            return -1;
+        }
+        b->inode_ino[i] = inode->ino;
+        b->inode_put[i] = 0;
+        memcpy(&b->inode_old[i], &inode_table[inode->ino], sizeof(struct inode));
+        b->ninodes++;
+    }
+    return i;
+}
 
-    char *token = strtok(path_copy, "/");
-    struct inode current_inode;
-    if (readi(ino, &current_inode) < 0) {
-       
+/*
+ * Update an inode in the cache and stage its inode table block. The batch
+ * keeps its own copy of the inode, taken here under the caller's lock;
+ * the block goes out from inode_image with that copy applied.
+ */
+static int batch_put_inode(struct meta_batch *b, struct inode *inode) {
+    int i = batch_save_inode(b, inode);
+    if (i < 0) {
         return -1;
     }
-
-    while (token != NULL) {
-        struct dirent dir_entry;
-        if (dir_find(current_inode.ino, token, strlen(token), &dir_entry) < 0) {
-            printf("Error: '%s' not found.\n", token);
+    if (!b->inode_put[i]) {
+        int idx = inode->ino / INODES_PER_BLOCK;
+        if (batch_stage(b, sb.i_start_blk + idx, &inode_image[idx * INODES_PER_BLOCK]) < 0) {
             return -1;
         }
+        b->inode_put[i] = 1;
+    }
+    if (inode != &inode_table[inode->ino]) {
+        memcpy(&inode_table[inode->ino], inode, sizeof(struct inode));
+    }
+    memcpy(&b->inode_new[i], inode, sizeof(struct inode));
+    return 0;
+}
 
-        if (readi(dir_entry.ino, &current_inode) < 0) {
-            printf("Error: Failed to read inode %d for '%s'.\n", dir_entry.ino, token);
-            return -1; 
+// Apply the inodes a batch put to inode_image; caller holds itable_lock
+static void batch_image_inodes(struct meta_batch *b) {
+    for (int i = 0; i < b->ninodes; i++) {
+        if (b->inode_put[i]) {
+            memcpy(&inode_image[b->inode_ino[i]], &b->inode_new[i], sizeof(struct inode));
         }
-
-        token = strtok(NULL, "/");
     }
-
-    memcpy(inode, &current_inode, sizeof(struct inode));
-    return 0;
 }
 
-/* 
- * Make file system
+// Allocate from the inode or data bitmap and stage the bitmap block
+static int batch_alloc(struct meta_batch *b, uint32_t bitmap_blk, int max) {
+    bitmap_t bitmap = bitmap_blk == sb.i_bitmap_blk ? inode_bitmap : data_bitmap;
+    pthread_mutex_t *lock = bitmap_blk == sb.i_bitmap_blk ? &ibitmap_lock : &dbitmap_lock;
+
+    if ((batch_lookup(b, bitmap_blk) == NULL && b->nblks == BATCH_MAX_BLKS) ||
+        b->nallocs == BATCH_MAX_ALLOCS) {
+        return -1;
+    }
+
+    pthread_mutex_lock(lock);
+    int i = bitmap_alloc(bitmap, max);
+    pthread_mutex_unlock(lock);
+
+    if (i >= 0) {
+        batch_stage(b, bitmap_blk, bitmap);
+        b->alloc_blk[b->nallocs] = bitmap_blk;
+        b->alloc_bit[b->nallocs] = i;
+        b->nallocs++;
+    }
+    return i;
+}
+
+static void batch_return_refs(struct meta_batch *b);
+
+// Drop a batch that will not be committed, releasing what it allocated and restoring the inodes it put
+static void batch_abort(struct meta_batch *b) {
+    for (int i = 0; i < b->ninodes; i++) {
+        memcpy(&inode_table[b->inode_ino[i]], &b->inode_old[i], sizeof(struct inode));
+    }
+    for (int i = 0; i < b->nallocs; i++) {
+        int is_inode = b->alloc_blk[i] == sb.i_bitmap_blk;
+        pthread_mutex_t *lock = is_inode ? &ibitmap_lock : &dbitmap_lock;
+
+        pthread_mutex_lock(lock);
+        unset_bitmap(is_inode ? inode_bitmap : data_bitmap, b->alloc_bit[i]);
+        pthread_mutex_unlock(lock);
+    }
+    if (b->ndallocs > 0 || b->ntakes > 0) {
+        pthread_mutex_lock(&dbitmap_lock);
+        for (int i = 0; i < b->ndallocs; i++) {
+            unset_bitmap(data_bitmap, b->dallocs[i]);
+        }
+        batch_return_refs(b);
+        pthread_mutex_unlock(&dbitmap_lock);
+    }
+    free(b->dallocs);
+    free(b->drops);
+    free(b->takes);
+    batch_init(b);
+}
+
+/*
+ * Take a reference to data block index idx for a pointer the batch adds.
+ * The caller stages the count with ref_stage() first, so it goes out no
+ * later than the pointer, and holds dbitmap_lock. 0 if the count is
+ * saturated, -1 if the batch cannot record it.
  */
-int rufs_mkfs() {
-	// Call dev_init() to initialize (Create) Diskfile
-    dev_init(diskfile_path);
+static int batch_take_ref(struct meta_batch *b, int idx) {
+    if (blk_refs[idx] == UINT16_MAX) {
+        return 0;
+    }
+    if (b->ntakes == b->takes_cap) {
+        int cap = b->takes_cap ? 2 * b->takes_cap : 64;
+        uint32_t *takes = realloc(b->takes, cap * sizeof(uint32_t));
+        if (takes == NULL) {
+            return -1;
+        }
+        b->takes = takes;
+        b->takes_cap = cap;
+    }
+    blk_refs[idx]++;
+    b->takes[b->ntakes++] = idx;
+    return 1;
+}
 
-	// write superblock information
-    sb.magic_num = MAGIC_NUM;
-    sb.max_inum = MAX_INUM;
-    sb.max_dnum = MAX_DNUM;
-    sb.i_bitmap_blk = 1;
-    sb.d_bitmap_blk = 2;
-    sb.i_start_blk = 3;
-    sb.d_start_blk = sb.i_start_blk + (MAX_INUM * sizeof(struct inode)) / BLOCK_SIZE;
+/*
+ * Give back the references an aborted batch took, as its pointers never
+ * reach disk. A failed commit keeps them: its transaction may still be
+ * replayed, and the cached inodes keep the pointers. One that a
+ * committing batch has already counted on to drop a pointer of its own
+ * is kept too; the block then leaks. Caller holds dbitmap_lock.
+ */
+static void batch_return_refs(struct meta_batch *b) {
+    for (int i = 0; i < b->ntakes; i++) {
+        uint32_t idx = b->takes[i];
+        if (blk_refs[idx] > ref_pending[idx]) {
+            blk_refs[idx]--;
+        }
+    }
+    b->ntakes = 0;
+}
 
-    char buffer[BLOCK_SIZE] = {0};
-    memcpy(buffer, &sb, sizeof(sb));
-    bio_write(0, buffer);
+// Record a dropped pointer to data block index idx
+static int batch_drop(struct meta_batch *b, int idx) {
+    if (b->ndrops == b->drops_cap) {
+        int cap = b->drops_cap ? 2 * b->drops_cap : 64;
+        uint32_t *drops = realloc(b->drops, cap * sizeof(uint32_t));
+        if (drops == NULL) {
+            return -1;
+        }
+        b->drops = drops;
+        b->drops_cap = cap;
+    }
+    b->drops[b->ndrops++] = idx;
+    return 0;
+}
 
-    bitmap_t inode_bitmap = calloc(1, BLOCK_SIZE);
-    bitmap_t data_bitmap = calloc(1, BLOCK_SIZE);
-    bio_write(sb.i_bitmap_blk, inode_bitmap);
-    bio_write(sb.d_bitmap_blk, data_bitmap);
+/*
+ * Decide what each dropped pointer does as the batch goes to disk: take
+ * a reference off a block others still point at, or free it. Deciding
+ * this late keeps two batches that drop the last two pointers to a block
+ * from both just taking a reference off. Caller holds dbitmap_lock.
+ */
+static void batch_drops_decide(struct meta_batch *b) {
+    for (int i = 0; i < b->ndrops; i++) {
+        uint32_t idx = b->drops[i];
+        if (blk_refs[idx] > ref_pending[idx]) {
+            ref_pending[idx]++;
+        } else {
+            set_bitmap(free_pending, idx);
+            dedup_fps[idx] = 0;
+            b->drops[i] |= DROP_FREED;
+        }
+    }
+}
 
-    //initializing root directory inode
-    struct inode root_inode;
-    root_inode.ino = 0;
-    root_inode.valid = 1;
-    root_inode.size = 0;
-    root_inode.type = S_IFDIR;
-    root_inode.link = 2;
-    memset(root_inode.direct_ptr, 0, sizeof(root_inode.direct_ptr));
-    memset(root_inode.indirect_ptr, 0, sizeof(root_inode.indirect_ptr));
+/*
+ * Remember a freed block for discard_queue(); past BATCH_MAX_DISCARDS runs
+ * the rest keep their space in the image
+ */
+static void batch_discard(struct meta_batch *b, uint32_t blk) {
+    int n = b->ndiscards;
+    if (n > 0 && b->discard_blk[n - 1] + b->discard_len[n - 1] == blk) {
+        b->discard_len[n - 1]++;
+    } else if (n < BATCH_MAX_DISCARDS) {
+        b->discard_blk[n] = blk;
+        b->discard_len[n] = 1;
+        b->ndiscards++;
+    }
+}
 
-    //mark inode 0
-    set_bitmap(inode_bitmap, 0);
-    bio_write(sb.i_bitmap_blk, inode_bitmap); // Update inode bitmap on disk
-    writei(0, &root_inode); // Write root inode to disk
+/*
+ * Apply the decided drops once the batch is durable, or with ok unset
+ * forget them: the blocks stay allocated, which at worst leaks them.
+ * Caller holds dbitmap_lock.
+ */
+static void batch_drops_apply(struct meta_batch *b, int ok) {
+    for (int i = 0; i < b->ndrops; i++) {
+        uint32_t idx = b->drops[i] & ~DROP_FREED;
+        if (b->drops[i] & DROP_FREED) {
+            if (ok) {
+                unset_bitmap(data_bitmap, idx);
+                batch_discard(b, sb.d_start_blk + idx);
+            }
+            unset_bitmap(free_pending, idx);
+        } else {
+            if (ok) {
+                blk_refs[idx]--;
+            }
+            ref_pending[idx]--;
+        }
+    }
+}
 
-    free(inode_bitmap);
-    free(data_bitmap);
+/*
+ * Copy a staged block, leaving out the drops still on their way to disk
+ * if it is the data bitmap or a reference count block. Caller holds
+ * dbitmap_lock for those.
+ */
+static void batch_copy_block(uint32_t blk_num, char *dst, const char *src) {
+    memcpy(dst, src, BLOCK_SIZE);
+    if (blk_num == sb.d_bitmap_blk) {
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            dst[i] &= ~free_pending[i];
+        }
+    } else if (sb.r_start_blk && blk_num >= sb.r_start_blk && blk_num < sb.r_start_blk + REF_BLKS) {
+        uint16_t *refs = (uint16_t *)dst;
+        const uint16_t *pending = &ref_pending[(blk_num - sb.r_start_blk) * REFS_PER_BLOCK];
+        for (int i = 0; i < (int)REFS_PER_BLOCK; i++) {
+            refs[i] -= pending[i];
+        }
+    }
+}
 
-	return 0;
+/*
+ * Bitmap and reference count blocks are staged from the live copy, so
+ * writing them out needs the lock that guards it
+ */
+static int batch_has_ibitmap(struct meta_batch *b) {
+    return batch_lookup(b, sb.i_bitmap_blk) != NULL || (sb.o_bitmap_blk && batch_lookup(b, sb.o_bitmap_blk) != NULL);
 }
 
+static int batch_has_dbitmap(struct meta_batch *b) {
+    if (b->ndrops > 0 || batch_lookup(b, sb.d_bitmap_blk) != NULL) {
+        return 1;
+    }
+    for (int i = 0; sb.r_start_blk && i < b->nblks; i++) {
+        if (b->blk_num[i] >= sb.r_start_blk && b->blk_num[i] < sb.r_start_blk + REF_BLKS) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-/* 
- * FUSE file operations
+// Write all staged blocks in block order, one write per run of consecutive blocks
+static int batch_write_home(struct meta_batch *b) {
+    // Insertion sort; a batch only holds a handful of blocks
+    for (int i = 1; i < b->nblks; i++) {
+        uint32_t num = b->blk_num[i];
+        char *buf = b->blk_buf[i];
+        int j = i - 1;
+        while (j >= 0 && b->blk_num[j] > num) {
+            b->blk_num[j + 1] = b->blk_num[j];
+            b->blk_buf[j + 1] = b->blk_buf[j];
+            j--;
+        }
+        b->blk_num[j + 1] = num;
+        b->blk_buf[j + 1] = buf;
+    }
+
+    int has_ibitmap = batch_has_ibitmap(b);
+    int has_dbitmap = batch_has_dbitmap(b);
+    if (has_ibitmap) {
+        pthread_mutex_lock(&ibitmap_lock);
+    }
+    if (has_dbitmap) {
+        // Nothing is allocated until the lock goes, so the drops can go straight to the live copies
+        pthread_mutex_lock(&dbitmap_lock);
+        batch_drops_decide(b);
+        batch_drops_apply(b, 1);
+    }
+    if (b->ninodes > 0) {
+        pthread_mutex_lock(&itable_lock);
+        batch_image_inodes(b);
+    }
+
+    struct iovec iov[BATCH_MAX_BLKS];
+    int i = 0, ret = 0;
+    while (i < b->nblks) {
+        int run = 0;
+        do {
+            iov[run].iov_base = b->blk_buf[i + run];
+            iov[run].iov_len = BLOCK_SIZE;
+            run++;
+        } while (i + run < b->nblks && b->blk_num[i + run] == b->blk_num[i] + run);
+
+        if (bio_writev(b->blk_num[i], iov, run) < 0) {
+            ret = -1;
+            break;
+        }
+        i += run;
+    }
+
+    if (b->ninodes > 0) {
+        pthread_mutex_unlock(&itable_lock);
+    }
+    if (has_dbitmap) {
+        // The old pointers may still be on disk, so what they named stays allocated
+        for (int k = 0; ret < 0 && k < b->ndrops; k++) {
+            uint32_t idx = b->drops[k] & ~DROP_FREED;
+            if (b->drops[k] & DROP_FREED) {
+                set_bitmap(data_bitmap, idx);
+            } else {
+                blk_refs[idx]++;
+            }
+        }
+        b->ndrops = 0;
+        pthread_mutex_unlock(&dbitmap_lock);
+    }
+    if (has_ibitmap) {
+        pthread_mutex_unlock(&ibitmap_lock);
+    }
+
+    return ret;
+}
+
+/*
+ * Write-ahead metadata journal
+ *
+ * The journal is a circular region of sb.j_blks blocks. batch_commit()
+ * appends the batch to an in-memory queue as one transaction and waits.
+ * Whichever committer finds no commit running becomes the leader: it takes
+ * the whole queue, writes it to the journal with one sequential write and
+ * one fdatasync, then writes the blocks home and wakes everyone it
+ * covered (group commit). New transactions queue up behind it meanwhile.
+ *
+ * Home writes are not synced per commit. When the region fills up, or a
+ * transaction frees blocks that may still be logged, the leader syncs the
+ * image and moves sb.j_tail up to the head (checkpoint). Mount replays
+ * every committed transaction from sb.j_tail.
+ *
+ * A group that fails to write fails its own transactions and sets
+ * j_error, which every later commit reports too, until a leader manages
+ * a checkpoint; while j_error is set each leader tries one after its
+ * group.
  */
-static void *rufs_init(struct fuse_conn_info *conn) {
+#define JOURNAL_BLKS 256
+#define JQUEUE_BLKS 64
+#define JQUEUE_TXS (JQUEUE_BLKS / 2)
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journal_cond = PTHREAD_COND_INITIALIZER;
+static char jqueue[2][JQUEUE_BLKS][BLOCK_SIZE];
+static int jq_cur;					/* queue being filled */
+static int jq_used;					/* blocks queued in it */
+static int jq_txs[2];				/* transactions queued in each */
+static int *jq_result[2][JQUEUE_TXS];	/* where their committers wait for the outcome */
+static int j_committing;			/* a leader is writing the other queue */
+static int j_error;					/* I/O error from a commit, until the next checkpoint */
+static uint32_t j_head;				/* journal offset for the next write */
+static uint32_t j_next_seq;			/* sequence number for the next transaction */
+
+static uint32_t journal_sum(const void *buf, size_t len, uint32_t sum) {
+    const unsigned char *p = buf;
+
+    // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        sum = (sum ^ p[i]) * 16777619u;
+    }
+    return sum;
+}
 
-	// Step 1a: If disk file is not found, call mkfs
+static int sb_write() {
+    char buffer[BLOCK_SIZE] = {0};
+    memcpy(buffer, &sb, sizeof(struct superblock));
+    return bio_write(0, buffer) < 0 ? -1 : 0;
+}
 
-  // Step 1b: If disk file is found, just initialize in-memory data structures
-  // and read superblock from disk
+// Take the in-memory journal state from the superblock
+static void journal_reset() {
+    j_head = sb.j_tail;
+    j_next_seq = sb.j_seq;
+    jq_used = 0;
+    jq_txs[0] = jq_txs[1] = 0;
+    j_error = 0;
+}
 
-    // Attempt to open the disk file
-    if (dev_open(diskfile_path) < 0) {
-        if (rufs_mkfs() < 0) {
-            return NULL;
+// Everything written home so far is made durable; the journal restarts at offset tail
+static int journal_checkpoint(uint32_t tail, uint32_t seq) {
+    if (dev_sync() < 0) {
+        return -1;
+    }
+    sb.j_tail = tail;
+    sb.j_seq = seq;
+    if (sb_write() < 0 || dev_sync() < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Write home the blocks of the n queued journal blocks in buf
+static int journal_write_home(char (*buf)[BLOCK_SIZE], int n, int *revoke) {
+    for (int i = 0; i < n; ) {
+        struct journal_header *desc = (struct journal_header *)buf[i];
+        for (uint32_t k = 0; k < desc->nblks; k++) {
+            if (bio_write(desc->blk_num[k], buf[i + 1 + k]) < 0) {
+                return -1;
+            }
+        }
+        *revoke |= desc->revoke;
+        i += desc->nblks + 2;
+    }
+    return 0;
+}
+
+/*
+ * Leader side: log n queued blocks, make them durable, then write them
+ * home. With checkpoint set the journal is checkpointed after them even
+ * if nothing revokes. Returns 1 if it was, 0 if not, -1 on error.
+ */
+static int journal_write(char (*buf)[BLOCK_SIZE], int n, int checkpoint) {
+    struct journal_header *first = (struct journal_header *)buf[0];
+    int revoke = 0;
+
+    if (j_head + n > sb.j_blks) {
+        if (journal_checkpoint(0, first->seq) < 0) {
+            return -1;
+        }
+        j_head = 0;
+    }
+
+    if (bio_write_range((off_t)(sb.j_start_blk + j_head) * BLOCK_SIZE, buf, (size_t)n * BLOCK_SIZE) < 0 ||
+        dev_sync() < 0) {
+        return -1;
+    }
+    j_head += n;
+
+    if (journal_write_home(buf, n, &revoke) < 0) {
+        return -1;
+    }
+
+    // Freed blocks may be reused for file data, which replay must not overwrite
+    if (revoke || checkpoint) {
+        struct journal_header *last = first;
+        for (int i = 0; i < n; i += last->nblks + 2) {
+            last = (struct journal_header *)buf[i];
+        }
+        if (journal_checkpoint(j_head, last->seq + 1) < 0) {
+            return -1;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static int journal_commit(struct meta_batch *b) {
+    int n = b->nblks + 2;
+    int result = 1;					/* set by the leader that writes this transaction */
+
+    pthread_mutex_lock(&journal_lock);
+    while (jq_used + n > JQUEUE_BLKS) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+
+    // Copy the batch into the queue; bitmaps and inode table blocks are copied under their locks
+    char (*q)[BLOCK_SIZE] = jqueue[jq_cur] + jq_used;
+    struct journal_header *desc = (struct journal_header *)q[0];
+    uint32_t seq = j_next_seq++;
+
+    memset(q[0], 0, BLOCK_SIZE);
+    desc->magic = JOURNAL_MAGIC;
+    desc->type = JOURNAL_DESC;
+    desc->seq = seq;
+    desc->nblks = b->nblks;
+    desc->revoke = b->revoke;
+
+    int has_ibitmap = batch_has_ibitmap(b);
+    int has_dbitmap = batch_has_dbitmap(b);
+    if (has_ibitmap) {
+        pthread_mutex_lock(&ibitmap_lock);
+    }
+    if (has_dbitmap) {
+        pthread_mutex_lock(&dbitmap_lock);
+        batch_drops_decide(b);
+    }
+    if (b->ninodes > 0) {
+        pthread_mutex_lock(&itable_lock);
+        batch_image_inodes(b);
+    }
+    for (int i = 0; i < b->nblks; i++) {
+        desc->blk_num[i] = b->blk_num[i];
+        batch_copy_block(b->blk_num[i], q[1 + i], b->blk_buf[i]);
+    }
+    if (b->ninodes > 0) {
+        pthread_mutex_unlock(&itable_lock);
+    }
+    if (has_dbitmap) {
+        pthread_mutex_unlock(&dbitmap_lock);
+    }
+    if (has_ibitmap) {
+        pthread_mutex_unlock(&ibitmap_lock);
+    }
+
+    struct journal_header *commit = (struct journal_header *)q[n - 1];
+    memset(q[n - 1], 0, BLOCK_SIZE);
+    commit->magic = JOURNAL_MAGIC;
+    commit->type = JOURNAL_COMMIT;
+    commit->seq = seq;
+    commit->nblks = b->nblks;
+    commit->sum = journal_sum(q, (size_t)(n - 1) * BLOCK_SIZE, 2166136261u);
+    jq_used += n;
+    jq_result[jq_cur][jq_txs[jq_cur]++] = &result;
+
+    if (!j_committing) {
+        // Lead: keep committing until the queue stays empty
+        j_committing = 1;
+        while (jq_used > 0) {
+            int full = jq_cur, used = jq_used, recover = j_error != 0;
+
+            jq_cur ^= 1;
+            jq_used = 0;
+            jq_txs[jq_cur] = 0;
+            pthread_cond_broadcast(&journal_cond);
+            pthread_mutex_unlock(&journal_lock);
+
+            int ret = journal_write(jqueue[full], used, recover);
+
+            pthread_mutex_lock(&journal_lock);
+            if (ret < 0) {
+                j_error = -EIO;
+            } else if (ret > 0) {
+                j_error = 0;
+            }
+            for (int i = 0; i < jq_txs[full]; i++) {
+                *jq_result[full][i] = ret < 0 ? -EIO : j_error;
+            }
+            pthread_cond_broadcast(&journal_cond);
         }
+        j_committing = 0;
     } else {
-        char buffer[BLOCK_SIZE];
-        if (bio_read(0, buffer) < 0) {
-            return NULL;
+        while (result > 0) {
+            pthread_cond_wait(&journal_cond, &journal_lock);
         }
-        memcpy(&sb, buffer, sizeof(struct superblock));
+    }
 
-        if (sb.magic_num != MAGIC_NUM) {
-            return NULL;
+    pthread_mutex_unlock(&journal_lock);
+    return result;
+}
+
+/*
+ * Apply every committed transaction from sb.j_tail to its home location.
+ * Runs at mount, before anything is cached.
+ */
+static int journal_replay() {
+    if (sb.j_blks == 0) {
+        return 0;
+    }
+
+    char (*tx)[BLOCK_SIZE] = malloc((JOURNAL_MAX_BLKS + 2) * BLOCK_SIZE);
+    if (tx == NULL) {
+        return -1;
+    }
+
+    uint32_t off = sb.j_tail, seq = sb.j_seq;
+    int replayed = 0;
+    while (off + 2 <= sb.j_blks) {
+        struct journal_header *desc = (struct journal_header *)tx[0];
+        if (bio_read(sb.j_start_blk + off, tx[0]) < 0 || desc->magic != JOURNAL_MAGIC ||
+            desc->type != JOURNAL_DESC || desc->seq != seq || desc->nblks > JOURNAL_MAX_BLKS ||
+            off + desc->nblks + 2 > sb.j_blks) {
+            break;
         }
 
-        char bitmap_buf[BLOCK_SIZE];
-        if (bio_read(sb.d_bitmap_blk, bitmap_buf) < 0) {
-            return NULL;
+        uint32_t n = desc->nblks + 2;
+        if (bio_read_range((off_t)(sb.j_start_blk + off + 1) * BLOCK_SIZE, tx[1], (size_t)(n - 1) * BLOCK_SIZE) < 0) {
+            break;
+        }
+        struct journal_header *commit = (struct journal_header *)tx[n - 1];
+        if (commit->magic != JOURNAL_MAGIC || commit->type != JOURNAL_COMMIT || commit->seq != seq ||
+            commit->sum != journal_sum(tx, (size_t)(n - 1) * BLOCK_SIZE, 2166136261u)) {
+            break;
+        }
+
+        for (uint32_t k = 0; k < desc->nblks; k++) {
+            if (bio_write(desc->blk_num[k], tx[1 + k]) < 0) {
+                free(tx);
+                return -1;
+            }
+        }
+        replayed++;
+        off += n;
+        seq++;
+    }
+    free(tx);
+
+    if (replayed > 0) {
+        fprintf(stderr, "rufs: replayed %d journal transactions\n", replayed);
+    }
+    if (journal_checkpoint(0, seq) < 0) {
+        return -1;
+    }
+    journal_reset();
+    return 0;
+}
+
+/*
+ * Freed data blocks are punched out of the image so the host gets the
+ * space back. A punch costs about as much as a journal commit on the
+ * host, so committed batches only queue their runs here, and the worker
+ * sorts, merges and punches them once DISCARD_BATCH blocks are waiting
+ * (and at unmount). Past DISCARD_MAX runs the rest keep their space.
+ */
+#define DISCARD_MAX 1024
+#define DISCARD_BATCH 1024			/* queued blocks that wake the worker */
+
+struct discard_extent {
+    uint32_t blk;
+    uint32_t len;
+};
+
+static struct discard_extent discards[DISCARD_MAX];
+static int ndiscards;				/* under discard_lock, as is discard_blks */
+static int discard_blks;
+static pthread_mutex_t discard_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void discard_queue(struct meta_batch *b) {
+    pthread_mutex_lock(&discard_lock);
+    for (int i = 0; i < b->ndiscards && ndiscards < DISCARD_MAX; i++) {
+        discards[ndiscards].blk = b->discard_blk[i];
+        discards[ndiscards].len = b->discard_len[i];
+        ndiscards++;
+        discard_blks += b->discard_len[i];
+    }
+    int full = discard_blks >= DISCARD_BATCH || ndiscards == DISCARD_MAX;
+    pthread_mutex_unlock(&discard_lock);
+
+    if (full) {
+        worker_wake(WORK_DISCARD);
+    }
+}
+
+static int discard_cmp(const void *a, const void *b) {
+    uint32_t x = ((const struct discard_extent *)a)->blk;
+    uint32_t y = ((const struct discard_extent *)b)->blk;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Punch every queued run, sorted and merged first. Each stretch still
+ * free is claimed under dbitmap_lock, so it is not handed out while it is
+ * punched with the lock let go, and given back after; any reallocated
+ * since they were freed are skipped. A claimed block counts as free_pending
+ * too, so the bitmap copies that go to disk meanwhile still show it free.
+ */
+static void discard_run() {
+    static struct discard_extent run[DISCARD_MAX];
+
+    pthread_mutex_lock(&discard_lock);
+    int n = ndiscards;
+    memcpy(run, discards, n * sizeof(struct discard_extent));
+    ndiscards = 0;
+    discard_blks = 0;
+    pthread_mutex_unlock(&discard_lock);
+
+    qsort(run, n, sizeof(struct discard_extent), discard_cmp);
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (m > 0 && run[m - 1].blk + run[m - 1].len >= run[i].blk) {
+            uint32_t end = run[i].blk + run[i].len;
+            if (end > run[m - 1].blk + run[m - 1].len) {
+                run[m - 1].len = end - run[m - 1].blk;
+            }
+        } else {
+            run[m++] = run[i];
+        }
+    }
+
+    for (int i = 0; i < m; i++) {
+        uint32_t lo = run[i].blk;
+        uint32_t end = lo + run[i].len;
+        while (lo < end) {
+            pthread_mutex_lock(&dbitmap_lock);
+            while (lo < end && get_bitmap(data_bitmap, lo - sb.d_start_blk)) {
+                lo++;
+            }
+            uint32_t hi = lo;
+            while (hi < end && !get_bitmap(data_bitmap, hi - sb.d_start_blk)) {
+                set_bitmap(data_bitmap, hi - sb.d_start_blk);
+                set_bitmap(free_pending, hi - sb.d_start_blk);
+                hi++;
+            }
+            pthread_mutex_unlock(&dbitmap_lock);
+            if (hi == lo) {
+                break;
+            }
+
+            bio_discard((off_t)lo * BLOCK_SIZE, (size_t)(hi - lo) * BLOCK_SIZE);
+
+            pthread_mutex_lock(&dbitmap_lock);
+            for (uint32_t k = lo; k < hi; k++) {
+                unset_bitmap(data_bitmap, k - sb.d_start_blk);
+                unset_bitmap(free_pending, k - sb.d_start_blk);
+            }
+            pthread_mutex_unlock(&dbitmap_lock);
+            lo = hi;
+        }
+    }
+}
+
+static int batch_commit(struct meta_batch *b) {
+    int ret = 0;
+
+    if (read_only) {
+        batch_abort(b);
+        return -EROFS;
+    }
+    if (b->nblks > 0 || b->ndrops > 0) {
+        ret = sb.j_blks ? journal_commit(b) : batch_write_home(b);
+    }
+    if (b->ndrops > 0) {
+        pthread_mutex_lock(&dbitmap_lock);
+        batch_drops_apply(b, ret == 0);
+        pthread_mutex_unlock(&dbitmap_lock);
+    }
+    if (ret == 0 && b->ndiscards > 0) {
+        discard_queue(b);
+    }
+    free(b->dallocs);
+    free(b->drops);
+    free(b->takes);
+    batch_init(b);
+    return ret;
+}
+
+static int meta_write(uint32_t blk_num, void *buf) {
+    struct meta_batch b;
+
+    batch_init(&b);
+    batch_stage(&b, blk_num, buf);
+    return batch_commit(&b);
+}
+
+static int meta_write_inode(struct inode *inode) {
+    struct meta_batch b;
+
+    batch_init(&b);
+    if (batch_put_inode(&b, inode) < 0) {
+        return -1;
+    }
+    return batch_commit(&b);
+}
+
+// Make everything written so far durable, sharing the flush with concurrent commits
+static int journal_sync() {
+    struct meta_batch b;
+
+    if (sb.j_blks == 0) {
+        return dev_sync();
+    }
+    batch_init(&b);
+    return journal_commit(&b);
+}
+
+/*
+ * Record the image state in the superblock once everything before it is
+ * durable. Marking it clean also empties the journal, so the next mount
+ * has nothing to replay.
+ */
+static int sb_set_state(uint32_t state) {
+    sb.state = state;
+    if (sb.j_blks) {
+        return journal_checkpoint(j_head, j_next_seq);
+    }
+    return dev_sync() < 0 || sb_write() < 0 || dev_sync() < 0 ? -1 : 0;
+}
+
+/*
+ * Write out a changed superblock field while mounted. The journal is
+ * checkpointed at its head, so it waits for the commit in flight and
+ * holds journal_lock to keep new ones from starting meanwhile.
+ */
+static int sb_update() {
+    if (sb.j_blks == 0) {
+        return dev_sync() < 0 || sb_write() < 0 || dev_sync() < 0 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    while (j_committing) {
+        pthread_cond_wait(&journal_cond, &journal_lock);
+    }
+    int ret = journal_checkpoint(j_head, j_next_seq);
+    if (ret == 0) {
+        j_error = 0;
+    }
+    pthread_mutex_unlock(&journal_lock);
+    return ret;
+}
+
+/* 
+ * directory operations
+ */
+int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+
+  // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+
+  // Step 2: Get data block of current directory from inode
+
+  // Step 3: Read directory's data block and check each directory entry.
+  //If the name matches, then copy directory entry to dirent structure
+    
+	struct inode dir_inode;
+    
+    if (readi(ino, &dir_inode) < 0) {
+        return -1; 
+    }
+
+    for (int i = 0; i < 16 && dir_inode.direct_ptr[i] != 0; i++) {
+        char buf[BLOCK_SIZE];
+        if (bio_read(dir_inode.direct_ptr[i], buf) < 0) {
+            return -1; 
+        }
+
+        struct dirent *entry = (struct dirent *)buf;
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
+            if (entry[j].valid && entry[j].len == name_len &&
+                strncmp(entry[j].name, fname, name_len) == 0) {
+                memcpy(dirent, &entry[j], sizeof(struct dirent));
+                return 0; 
+            }
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Add an entry to a directory in a single scan: the same pass checks that
+ * fname is not taken and remembers the first free slot. The dirent block,
+ * and the directory inode and data bitmap if the directory had to grow,
+ * are staged in the batch.
+ */
+static int dir_insert(struct meta_batch *b, struct inode *dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+    struct dirent new_dirent = {0};
+
+    if (name_len >= sizeof(new_dirent.name)) {
+        return -ENAMETOOLONG;
+    }
+    new_dirent.ino = f_ino;
+    new_dirent.valid = 1;
+    memcpy(new_dirent.name, fname, name_len);
+    new_dirent.len = (uint16_t)name_len;
+
+    char buf[BLOCK_SIZE];
+    int free_blk = -1, free_slot = -1;
+    int i;
+
+    for (i = 0; i < 16 && dir_inode->direct_ptr[i] != 0; i++) {
+        if (bio_read(dir_inode->direct_ptr[i], buf) < 0) {
+            return -EIO;
+        }
+
+        struct dirent *entry = (struct dirent *)buf;
+        for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+            if (!entry[j].valid) {
+                if (free_blk < 0) {
+                    char *staged = batch_get(b, dir_inode->direct_ptr[i], 0);
+                    if (staged == NULL) {
+                        return -EIO;
+                    }
+                    memcpy(staged, buf, BLOCK_SIZE);
+                    free_blk = dir_inode->direct_ptr[i];
+                    free_slot = j;
+                }
+            } else if (entry[j].len == name_len && strncmp(entry[j].name, fname, name_len) == 0) {
+                return -EEXIST;
+            }
+        }
+    }
+
+    if (free_blk < 0) {
+        // Every block is full, so grow the directory by one block
+        if (i == 16) {
+            return -ENOSPC;
+        }
+
+        int new_block = batch_alloc(b, sb.d_bitmap_blk, sb.max_dnum);
+        if (new_block < 0) {
+            return -ENOSPC;
+        }
+
+        free_blk = sb.d_start_blk + new_block;
+        free_slot = 0;
+        if (batch_get(b, free_blk, 0) == NULL) {
+            return -EIO;
+        }
+        dir_inode->direct_ptr[i] = free_blk;
+        dir_inode->size += BLOCK_SIZE;
+        seg_own(dir_inode, free_blk);
+    }
+
+    inode_touch(dir_inode, RUFS_MTIME | RUFS_CTIME);
+    if (batch_put_inode(b, dir_inode) < 0) {
+        return -EIO;
+    }
+
+    struct dirent *entry = (struct dirent *)batch_lookup(b, free_blk);
+    memcpy(&entry[free_slot], &new_dirent, sizeof(struct dirent));
+    return 0;
+}
+
+// Add an entry to a directory; dir_inode only names it, the cached inode is what gets updated
+int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
+    struct meta_batch b;
+    batch_init(&b);
+
+    ilock_wr(dir_inode.ino);
+    int ret = readi(dir_inode.ino, &dir_inode);
+    if (ret == 0) {
+        ret = dir_insert(&b, &dir_inode, f_ino, fname, name_len);
+    }
+    if (ret < 0) {
+        batch_abort(&b);
+    } else {
+        ret = batch_commit(&b);
+    }
+    iunlock(dir_inode.ino);
+
+    return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Remove the entry for fname from a directory, staging the dirent block
+ * and the directory inode in the batch. Returns the inode number the
+ * entry named.
+ */
+static int dir_delete(struct meta_batch *b, struct inode *dir_inode, const char *fname, size_t name_len) {
+    char buf[BLOCK_SIZE];
+
+    for (int i = 0; i < 16 && dir_inode->direct_ptr[i] != 0; i++) {
+        if (bio_read(dir_inode->direct_ptr[i], buf) < 0) {
+            return -EIO;
+        }
+
+        struct dirent *entry = (struct dirent *)buf;
+        for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+            if (!entry[j].valid || entry[j].len != name_len || strncmp(entry[j].name, fname, name_len) != 0) {
+                continue;
+            }
+
+            char *staged = batch_get(b, dir_inode->direct_ptr[i], 0);
+            if (staged == NULL) {
+                return -EIO;
+            }
+            entry[j].valid = 0;
+            memcpy(staged, buf, BLOCK_SIZE);
+
+            inode_touch(dir_inode, RUFS_MTIME | RUFS_CTIME);
+            if (batch_put_inode(b, dir_inode) < 0) {
+                return -EIO;
+            }
+            return entry[j].ino;
+        }
+    }
+    return -ENOENT;
+}
+
+// 1 if a directory has no entries, 0 if it has some
+static int dir_empty(struct inode *dir_inode) {
+    char buf[BLOCK_SIZE];
+
+    for (int i = 0; i < 16 && dir_inode->direct_ptr[i] != 0; i++) {
+        if (bio_read(dir_inode->direct_ptr[i], buf) < 0) {
+            return -EIO;
+        }
+
+        struct dirent *entry = (struct dirent *)buf;
+        for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+            if (entry[j].valid) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+/* 
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
+	
+	// Step 1: Resolve the path name, walk through path, and finally, find its inode.
+	// Note: You could either implement it in a iterative way or recursive way
+
+    //debug:
+    printf("Resolving path: %s\n", path);
+    
+    char path_copy[PATH_MAX];
+    strncpy(path_copy, path, PATH_MAX - 1);
+    path_copy[PATH_MAX - 1] = '\0';
+
+    // Each directory is read-locked only while it is searched
+    char *save;
+    char *token = strtok_r(path_copy, "/", &save);
+    while (token != NULL) {
+        struct dirent dir_entry;
+        ilock_rd(ino);
+        int ret = dir_find(ino, token, strlen(token), &dir_entry);
+        iunlock(ino);
+        if (ret < 0) {
+            printf("Error: '%s' not found.\n", token);
+            return -1;
+        }
+
+        ino = dir_entry.ino;
+        if (ino >= MAX_INUM) {
+            return -1;
+        }
+        token = strtok_r(NULL, "/", &save);
+    }
+
+    ilock_rd(ino);
+    int ret = readi(ino, inode);
+    iunlock(ino);
+    if (ret < 0) {
+        printf("Error: Failed to read inode %d.\n", ino);
+        return -1;
+    }
+    return 0;
+}
+
+/* 
+ * Make file system
+ */
+int rufs_mkfs() {
+	// Call dev_init() to initialize (Create) Diskfile
+    dev_init(diskfile_path);
+    inode_cache_reset();
+
+	// write superblock information
+    sb.magic_num = MAGIC_NUM;
+    sb.max_inum = MAX_INUM;
+    sb.max_dnum = MAX_DNUM;
+    sb.i_bitmap_blk = 1;
+    sb.d_bitmap_blk = 2;
+    sb.i_start_blk = 3;
+    sb.j_start_blk = sb.i_start_blk + (MAX_INUM * sizeof(struct inode)) / BLOCK_SIZE;
+    sb.j_blks = JOURNAL_BLKS;
+    sb.j_tail = 0;
+    sb.j_seq = 1;
+    sb.state = SB_STATE_CLEAN;
+    sb.o_bitmap_blk = sb.j_start_blk + sb.j_blks;
+    sb.r_start_blk = sb.o_bitmap_blk + 1;
+    sb.g_start_blk = sb.r_start_blk + REF_BLKS;
+    sb.c_start_blk = sb.g_start_blk + GEN_BLKS;
+    sb.d_start_blk = sb.c_start_blk + SUM_BLKS;
+    sb.snap_blk = 0;
+    sb.snap_next_id = 1;
+    sb.gen = 0;
+
+    // Start from an all-sparse image: punched blocks read as zeros, the
+    // journal included, so nothing from an earlier image can be replayed
+    char buffer[BLOCK_SIZE] = {0};
+    if (bio_discard(0, (off_t)(sb.d_start_blk + sb.max_dnum) * BLOCK_SIZE) < 0) {
+        for (uint32_t i = 0; i < sb.j_blks; i++) {
+            bio_write(sb.j_start_blk + i, buffer);
+        }
+        for (uint32_t i = 0; i < REF_BLKS + GEN_BLKS + SUM_BLKS; i++) {
+            bio_write(sb.r_start_blk + i, buffer);
+        }
+    }
+    memset(blk_refs, 0, sizeof(blk_refs));
+    memset(blk_gen, 0, sizeof(blk_gen));
+    memset(blk_sum, 0, sizeof(blk_sum));
+    journal_reset();
+
+    memcpy(buffer, &sb, sizeof(sb));
+    bio_write(0, buffer);
+
+    memset(inode_bitmap, 0, BLOCK_SIZE);
+    memset(data_bitmap, 0, BLOCK_SIZE);
+    memset(orphan_bitmap, 0, BLOCK_SIZE);
+    bio_write(sb.i_bitmap_blk, inode_bitmap);
+    bio_write(sb.d_bitmap_blk, data_bitmap);
+    bio_write(sb.o_bitmap_blk, orphan_bitmap);
+
+    //initializing root directory inode
+    struct inode root_inode;
+    root_inode.ino = 0;
+    root_inode.valid = 1;
+    root_inode.size = 0;
+    root_inode.type = S_IFDIR;
+    root_inode.link = 2;
+    memset(root_inode.direct_ptr, 0, sizeof(root_inode.direct_ptr));
+    memset(root_inode.indirect_ptr, 0, sizeof(root_inode.indirect_ptr));
+    memset(&root_inode.vstat, 0, sizeof(root_inode.vstat));
+    inode_touch(&root_inode, RUFS_ATIME | RUFS_MTIME | RUFS_CTIME);
+
+    //mark inode 0
+    set_bitmap(inode_bitmap, 0);
+    bio_write(sb.i_bitmap_blk, inode_bitmap); // Update inode bitmap on disk
+    writei(0, &root_inode); // Write root inode to disk
+
+	return 0;
+}
+
+
+// Start and stop the background worker; defined after the work it does
+static void worker_start();
+static void worker_stop();
+
+// Load a snapshot's inode table and bitmap in place of the live ones; defined with the snapshots
+static int snap_mount(uint32_t id);
+
+/*
+ * Load the block checksums and have block.c keep them, before anything
+ * else is read. The table is trusted only after a clean unmount, and the
+ * blocks written after it at unmount, the superblock and the generation
+ * stamps, start without a sum, as does the journal, which is dead then.
+ */
+static int sum_start(int clean) {
+    if (sb.c_start_blk == 0) {
+        return 0;
+    }
+    memset(blk_sum, 0, sizeof(blk_sum));
+    if (clean && bio_read_range((off_t)sb.c_start_blk * BLOCK_SIZE, blk_sum, sizeof(blk_sum)) < 0) {
+        return -1;
+    }
+    blk_sum[0] = 0;
+    memset(&blk_sum[sb.j_start_blk], 0, sb.j_blks * sizeof(uint32_t));
+    memset(&blk_sum[sb.g_start_blk], 0, GEN_BLKS * sizeof(uint32_t));
+    memset(&blk_sum[sb.c_start_blk], 0, SUM_BLKS * sizeof(uint32_t));
+
+    bio_checksum(blk_sum, sb.d_start_blk + sb.max_dnum);
+    return 0;
+}
+
+static int mounted;					/* rufs_init() got all the way through */
+
+/*
+ * Init cannot fail the mount by returning, so it ends the session
+ * instead; a mount left up would serve whatever state init stopped in
+ */
+static void init_fail(const char *why) {
+    fprintf(stderr, "rufs: %s\n", why);
+    if (rufs_options.highlevel) {
+        struct fuse_context *ctx = fuse_get_context();
+        if (ctx != NULL && ctx->fuse != NULL) {
+            fuse_exit(ctx->fuse);
+        }
+    } else if (ll_chan != NULL) {
+        fuse_session_exit(fuse_chan_session(ll_chan));
+    }
+}
+
+/* 
+ * FUSE file operations
+ */
+static void *rufs_init(struct fuse_conn_info *conn) {
+
+	// Step 1a: If disk file is not found, call mkfs
+
+  // Step 1b: If disk file is found, just initialize in-memory data structures
+  // and read superblock from disk
+
+    // Bulk create is an ioctl on a directory
+    if (conn != NULL && (conn->capable & FUSE_CAP_IOCTL_DIR)) {
+        conn->want |= FUSE_CAP_IOCTL_DIR;
+    }
+
+    // Let file data be spliced between /dev/fuse and the disk image, and
+    // ask for requests as large as libfuse and the kernel will send
+    if (conn != NULL) {
+        conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+        conn->want |= conn->capable & (FUSE_CAP_BIG_WRITES | FUSE_CAP_ASYNC_READ);
+        conn->async_read = (conn->capable & FUSE_CAP_ASYNC_READ) != 0;
+        conn->max_write = RUFS_MAX_IO;
+        conn->max_readahead = RUFS_MAX_IO;
+    }
+
+#ifdef FUSE_CAP_WRITEBACK_CACHE
+    // Small writes then collect in the kernel page cache and arrive as large page-aligned flushes
+    if (conn != NULL && rufs_options.writeback && (conn->capable & FUSE_CAP_WRITEBACK_CACHE)) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+        writeback_cache = 1;
+    }
+#endif
+    // libfuse 2.x has no such capability, and older kernels do not offer it
+    if (conn != NULL && rufs_options.writeback && !writeback_cache) {
+        fprintf(stderr, "rufs: the kernel writeback cache is not available, -o writeback has no effect\n");
+    }
+
+    // Attempt to open the disk file
+    int clean = 1;
+    if (dev_open(diskfile_path) < 0) {
+        if (rufs_options.snapshot || rufs_mkfs() < 0 || sum_start(0) < 0) {
+            init_fail("Cannot create the disk image");
+            return NULL;
+        }
+    } else {
+        char buffer[BLOCK_SIZE];
+        if (bio_read(0, buffer) < 0) {
+            init_fail("Cannot read the superblock");
+            return NULL;
+        }
+        memcpy(&sb, buffer, sizeof(struct superblock));
+        inode_cache_reset();
+
+        if (sb.magic_num != MAGIC_NUM) {
+            init_fail("Not a rufs image");
+            return NULL;
+        }
+
+        // A snapshot is served as it was taken, leaving the live image, journal included, alone.
+        // Its blocks are never rewritten in place while it is held, so the sums of a clean image hold.
+        if (rufs_options.snapshot) {
+            read_only = 1;
+            if (sum_start(sb.state == SB_STATE_CLEAN) < 0) {
+                init_fail("Cannot read the block checksums");
+                return NULL;
+            }
+            memset(orphan_bitmap, 0, BLOCK_SIZE);
+            memset(blk_refs, 0, sizeof(blk_refs));
+            if (bio_read(sb.d_bitmap_blk, data_bitmap) < 0 || snap_mount(rufs_options.snapshot) < 0) {
+                char why[64];
+                snprintf(why, sizeof(why), "Cannot mount snapshot %u", rufs_options.snapshot);
+                init_fail(why);
+                return NULL;
+            }
+            mounted = 1;
+            return NULL;
+        }
+
+        // After a crash, finish the metadata updates that were logged but not written home
+        clean = sb.state == SB_STATE_CLEAN;
+        if (clean) {
+            journal_reset();
+        } else if (journal_replay() < 0) {
+            init_fail("Cannot replay the journal");
+            return NULL;
+        }
+        if (sum_start(clean) < 0) {
+            init_fail("Cannot read the block checksums");
+            return NULL;
+        }
+
+        // Load the bitmaps; they stay in memory while mounted. Inodes are read as they are used.
+        // Images made before the orphan bitmap keep orphans in memory only, and share no blocks.
+        memset(orphan_bitmap, 0, BLOCK_SIZE);
+        memset(blk_refs, 0, sizeof(blk_refs));
+        memset(blk_gen, 0, sizeof(blk_gen));
+        if (bio_read(sb.i_bitmap_blk, inode_bitmap) < 0 ||
+            bio_read(sb.d_bitmap_blk, data_bitmap) < 0 ||
+            (sb.o_bitmap_blk && bio_read(sb.o_bitmap_blk, orphan_bitmap) < 0) ||
+            (sb.r_start_blk && bio_read_range((off_t)sb.r_start_blk * BLOCK_SIZE, blk_refs, sizeof(blk_refs)) < 0) ||
+            (sb.g_start_blk && bio_read_range((off_t)sb.g_start_blk * BLOCK_SIZE, blk_gen, sizeof(blk_gen)) < 0)) {
+            init_fail("Cannot read the bitmaps");
+            return NULL;
+        }
+    }
+
+    // Each mount is a new generation; images made before the stamps are not tracked
+    if (sb.g_start_blk) {
+        sb.gen++;
+        for (uint32_t i = 0; !clean && i < GEN_BLKS * GENS_PER_BLOCK; i++) {
+            blk_gen[i] = sb.gen;
+        }
+        bio_track(blk_gen, sb.d_start_blk + sb.max_dnum, sb.gen);
+    }
+
+    if (sb_set_state(SB_STATE_IN_USE) < 0) {
+        init_fail("Cannot mark the image in use");
+        return NULL;
+    }
+    mounted = 1;
+    worker_start();
+    return NULL;
+}
+
+// Stop keeping the checksums and write them back; nothing written after this has a sum
+static int sum_flush() {
+    bio_checksum(NULL, 0);
+    return bio_write_range((off_t)sb.c_start_blk * BLOCK_SIZE, blk_sum, sizeof(blk_sum)) < 0 ? -1 : 0;
+}
+
+// Write back the generation stamps; the blocks holding the table's own stamps go last
+static int gen_flush() {
+    uint32_t first = sb.g_start_blk / GENS_PER_BLOCK;
+    uint32_t last = (sb.g_start_blk + GEN_BLKS - 1) / GENS_PER_BLOCK;
+
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        for (uint32_t k = 0; k < GEN_BLKS; k++) {
+            uint32_t *gens = &blk_gen[k * GENS_PER_BLOCK];
+            int dirty = 0;
+            for (uint32_t i = 0; i < GENS_PER_BLOCK && !dirty; i++) {
+                dirty = gens[i] == sb.gen;
+            }
+            if (dirty && (k >= first && k <= last) == pass && bio_write(sb.g_start_blk + k, gens) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void rufs_destroy(void *userdata) {
+    // A snapshot, or an image init gave up on, has nothing to write back
+    if (read_only || !mounted) {
+        read_only = 0;
+        mounted = 0;
+        bio_checksum(NULL, 0);
+        dev_close();
+        return;
+    }
+    mounted = 0;
+    worker_stop();
+    discard_run();
+
+    // Write back inodes whose last changes were waiting for a flush
+    for (int i = 0; i < MAX_INUM; i++) {
+        if (inode_wstate[i].dirty && writei(i, &inode_table[i]) == 0) {
+            inode_wstate[i].dirty = 0;
+        }
+    }
+
+    // A failed commit or a count no batch staged leaves disk behind the settled drops
+    struct meta_batch b;
+    batch_init(&b);
+    batch_stage(&b, sb.d_bitmap_blk, data_bitmap);
+    for (uint32_t n = 0; sb.r_start_blk && n < REF_BLKS; n++) {
+        batch_stage(&b, sb.r_start_blk + n, &blk_refs[n * REFS_PER_BLOCK]);
+    }
+    if (batch_commit(&b) < 0) {
+        fprintf(stderr, "rufs_destroy: Failed to write the data bitmap\n");
+    }
+
+    if (sb.c_start_blk && sum_flush() < 0) {
+        fprintf(stderr, "rufs_destroy: Failed to write the block checksums\n");
+    }
+    if (sb.g_start_blk && gen_flush() < 0) {
+        fprintf(stderr, "rufs_destroy: Failed to write the generation stamps\n");
+    }
+    if (sb_set_state(SB_STATE_CLEAN) < 0) {
+        fprintf(stderr, "rufs_destroy: Failed to mark the image clean\n");
+    }
+    bio_track(NULL, 0, 0);
+    dev_close();
+}
+
+static int rufs_getattr(const char *path, struct stat *stbuf) {
+    struct inode inode;
+
+    // Step 1: Call get_node_by_path() to get inode from path
+    if (get_node_by_path(path, 0, &inode) < 0) {
+        return -1;
+    }
+
+    // Step 2: Fill attributes of file into stbuf from inode
+    inode_to_stat(&inode, stbuf);
+
+    return 0;
+}
+
+
+static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
+    struct inode inode;
+
+    if (get_node_by_path(path, 0, &inode) < 0) {
+        return -1;
+    }
+
+    if ((inode.type & S_IFDIR) == 0) {
+        return -1;
+    }
+
+    // Remember the directory so readdir can resume without walking the path again
+    if (fi != NULL) {
+        fi->fh = inode.ino;
+    }
+
+    return 0;
+}
+
+
+// Emit the entries of a read-locked directory, starting at position offset
+static int dir_fill(uint16_t ino, void *buffer, fuse_fill_dir_t filler, off_t offset) {
+    struct inode dir_inode;
+    struct stat st;
+
+    if (readi(ino, &dir_inode) < 0) {
+        return -1;
+    }
+
+    if ((dir_inode.type & S_IFDIR) == 0) {
+        return -ENOTDIR;
+    }
+
+    if (offset < 1) {
+        inode_to_stat(&dir_inode, &st);
+        if (filler(buffer, ".", &st, 1)) {
+            return 0;
+        }
+    }
+    if (offset < 2) {
+        memset(&st, 0, sizeof(st));
+        st.st_mode = S_IFDIR;
+        if (filler(buffer, "..", &st, 2)) {
+            return 0;
+        }
+    }
+
+    // Step 2: Emit entries from the first slot not yet returned
+    off_t slot = offset > 2 ? offset - 2 : 0;
+    for (int i = slot / DIRENTS_PER_BLOCK; i < 16 && dir_inode.direct_ptr[i] != 0; i++) {
+        char block_buf[BLOCK_SIZE];
+        if (bio_read(dir_inode.direct_ptr[i], block_buf) < 0) {
+            return -1; 
+        }
+
+        struct dirent *entry = (struct dirent *)block_buf;
+
+        // Iterate through the directory entries in this block
+        for (int j = slot % DIRENTS_PER_BLOCK; j < DIRENTS_PER_BLOCK; j++, slot++) {
+            if (entry[j].valid != 1 || entry[j].ino >= MAX_INUM) {
+                continue;
+            }
+
+            // Attributes come from the inode cache, so ls -l needs no getattr per entry
+            struct inode child;
+            ilock_rd(entry[j].ino);
+            int ret = readi(entry[j].ino, &child);
+            iunlock(entry[j].ino);
+            if (ret < 0) {
+                return -1;
+            }
+            inode_to_stat(&child, &st);
+
+            if (filler(buffer, entry[j].name, &st, slot + 3)) {
+                return 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * readdir runs in offset mode: "." and ".." sit at positions 0 and 1 and
+ * directory slot n at position n + 2. The offset handed to filler is the
+ * position of the next entry, so a call that fills the buffer can be
+ * resumed from exactly where it stopped.
+ */
+static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    struct inode dir_inode;
+
+    // Step 1: Use the inode remembered by opendir, or resolve the path
+    uint16_t ino;
+    if (fi != NULL) {
+        ino = fi->fh;
+    } else if (get_node_by_path(path, 0, &dir_inode) < 0) {
+        return -1;
+    } else {
+        ino = dir_inode.ino;
+    }
+
+    ilock_rd(ino);
+    int ret = dir_fill(ino, buffer, filler, offset);
+    iunlock(ino);
+
+    return ret;
+}
+
+// Flags a new inode takes from its directory and the mount options
+static dev_t inode_new_flags(const struct inode *dir) {
+    return (dir->vstat.st_rdev & RUFS_FL_COMPRESS) | (rufs_options.compress ? RUFS_FL_COMPRESS : 0);
+}
+
+// Body of create_node(), called with the parent write-locked
+static int create_locked(struct inode *parent_inode, const char *base_name, uint32_t type, uint32_t link) {
+    if (readi(parent_inode->ino, parent_inode) < 0) {
+        return -EIO;
+    }
+    if ((parent_inode->type & S_IFDIR) == 0) {
+        return -ENOTDIR;
+    }
+
+    struct meta_batch b;
+    batch_init(&b);
+
+    int new_ino = batch_alloc(&b, sb.i_bitmap_blk, sb.max_inum);
+    if (new_ino < 0) {
+        return -ENOSPC;
+    }
+
+    int ret = dir_insert(&b, parent_inode, new_ino, base_name, strlen(base_name));
+    if (ret < 0) {
+        batch_abort(&b);
+        return ret;
+    }
+
+    struct inode new_inode;
+    memset(&new_inode, 0, sizeof(struct inode));
+    new_inode.ino = new_ino;
+    new_inode.valid = 1;
+    new_inode.size = 0;
+    new_inode.type = type;
+    new_inode.link = link;
+    new_inode.vstat.st_rdev = inode_new_flags(parent_inode);
+    inode_touch(&new_inode, RUFS_ATIME | RUFS_MTIME | RUFS_CTIME);
+
+    if (batch_put_inode(&b, &new_inode) < 0) {
+        batch_abort(&b);
+        return -EIO;
+    }
+
+    if (batch_commit(&b) < 0) {
+        return -EIO;
+    }
+
+    return new_ino;
+}
+
+// Create name in the directory parent and return the new inode number
+static int create_in(uint16_t parent, const char *name, uint32_t type, uint32_t link) {
+    struct inode parent_inode;
+
+    if (read_only) {
+        return -EROFS;
+    }
+
+    // Hold the parent for writing and work on its current contents
+    parent_inode.ino = parent;
+    ilock_wr(parent);
+    int ret = create_locked(&parent_inode, name, type, link);
+    iunlock(parent);
+
+    return ret;
+}
+
+/*
+ * Create a file or directory. The parent is resolved once, the name is
+ * checked and inserted in one directory scan, and the inode bitmap, dirent
+ * block, parent and child inodes go out as one batched update.
+ * Returns the new inode number.
+ */
+static int create_node(const char *path, uint32_t type, uint32_t link) {
+    char parent_path[PATH_MAX];
+    char base_path[PATH_MAX];
+    struct inode parent_inode;
+
+    strncpy(parent_path, path, PATH_MAX - 1);
+    parent_path[PATH_MAX - 1] = '\0';
+    strcpy(base_path, parent_path);
+    char *parent_dir = dirname(parent_path);
+    char *base_name = basename(base_path);
+
+    if (get_node_by_path(parent_dir, 0, &parent_inode) < 0) {
+        return -ENOENT;
+    }
+
+    if ((parent_inode.type & S_IFDIR) == 0) {
+        return -ENOTDIR;
+    }
+
+    return create_in(parent_inode.ino, base_name, type, link);
+}
+
+static int rufs_mkdir(const char *path, mode_t mode) {
+    int ret = create_node(path, S_IFDIR | mode, 2);
+    return ret < 0 ? ret : 0;
+}
+
+
+/*
+ * Create many regular files under one directory. The directory is read
+ * once and every name is checked up front; entries are then packed into
+ * directory blocks in order, so each directory block is written once,
+ * together with the bitmap and inode table blocks it pulled in.
+ * Returns the number of files created, or a negative errno if none was:
+ * when a batch fails after earlier ones were committed, the count is
+ * short and covers just the committed ones.
+ */
+static int bulk_flush(struct meta_batch *b, struct inode *dir_inode, int blk, char *blk_data) {
+    char *staged = batch_get(b, dir_inode->direct_ptr[blk], 0);
+    if (staged == NULL) {
+        return -EIO;
+    }
+    memcpy(staged, blk_data, BLOCK_SIZE);
+
+    inode_touch(dir_inode, RUFS_MTIME | RUFS_CTIME);
+    if (batch_put_inode(b, dir_inode) < 0) {
+        return -EIO;
+    }
+    if (batch_commit(b) < 0) {
+        return -EIO;
+    }
+    batch_init(b);
+    return 0;
+}
+
+static int create_bulk_in(uint16_t dir, const char *names[], int count, mode_t mode) {
+    struct inode dir_inode;
+
+    if (read_only) {
+        return -EROFS;
+    }
+
+    // Step 1: Read the whole directory once
+    char (*blks)[BLOCK_SIZE] = malloc(16 * BLOCK_SIZE);
+    if (blks == NULL) {
+        return -ENOMEM;
+    }
+
+    ilock_wr(dir);
+    if (readi(dir, &dir_inode) < 0 || (dir_inode.type & S_IFDIR) == 0) {
+        iunlock(dir);
+        free(blks);
+        return -ENOTDIR;
+    }
+
+    int nblks, free_slots = 0, ret = 0;
+    for (nblks = 0; nblks < 16 && dir_inode.direct_ptr[nblks] != 0; nblks++) {
+        if (bio_read(dir_inode.direct_ptr[nblks], blks[nblks]) < 0) {
+            ret = -EIO;
+            goto out;
+        }
+    }
+    free_slots = (16 - nblks) * DIRENTS_PER_BLOCK;
+
+    // Step 2: Check every name against the directory and the rest of the batch
+    for (int i = 0; i < count && ret == 0; i++) {
+        size_t len = strlen(names[i]);
+        if (len == 0 || len >= sizeof(((struct dirent *)0)->name) || strchr(names[i], '/') != NULL) {
+            ret = -EINVAL;
+            break;
+        }
+        for (int j = 0; j < i; j++) {
+            if (strcmp(names[i], names[j]) == 0) {
+                ret = -EEXIST;
+                break;
+            }
+        }
+        for (int k = 0; k < nblks && ret == 0; k++) {
+            struct dirent *entry = (struct dirent *)blks[k];
+            for (int j = 0; j < DIRENTS_PER_BLOCK; j++) {
+                if (i == 0 && !entry[j].valid) {
+                    free_slots++;
+                } else if (entry[j].valid && entry[j].len == len && strncmp(entry[j].name, names[i], len) == 0) {
+                    ret = -EEXIST;
+                    break;
+                }
+            }
+        }
+    }
+    if (ret == 0 && count > free_slots) {
+        ret = -ENOSPC;
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    // Step 3: Fill free slots block by block, allocating inodes as a run
+    struct meta_batch b;
+    batch_init(&b);
+
+    int blk = 0, slot = 0, blk_dirty = 0, created = 0, committed = 0;
+    while (created < count) {
+        if (blk == 16) {
+            ret = -ENOSPC;
+            break;
+        }
+        if (blk == nblks) {
+            int new_block = batch_alloc(&b, sb.d_bitmap_blk, sb.max_dnum);
+            if (new_block < 0) {
+                ret = -ENOSPC;
+                break;
+            }
+            memset(blks[blk], 0, BLOCK_SIZE);
+            dir_inode.direct_ptr[blk] = sb.d_start_blk + new_block;
+            dir_inode.size += BLOCK_SIZE;
+            seg_own(&dir_inode, dir_inode.direct_ptr[blk]);
+            nblks++;
+        }
+
+        struct dirent *entry = (struct dirent *)blks[blk];
+        while (slot < DIRENTS_PER_BLOCK && entry[slot].valid) {
+            slot++;
+        }
+        if (slot == DIRENTS_PER_BLOCK) {
+            // This block is full: write it out and move to the next one
+            if (blk_dirty) {
+                if ((ret = bulk_flush(&b, &dir_inode, blk, blks[blk])) < 0) {
+                    break;
+                }
+                committed = created;
+            }
+            blk_dirty = 0;
+            blk++;
+            slot = 0;
+            continue;
+        }
+
+        // Leave room for an inode block, the dirent block and the directory inode
+        if (b.nblks > BATCH_MAX_BLKS - 4 || b.nallocs > BATCH_MAX_ALLOCS - 2) {
+            if ((ret = bulk_flush(&b, &dir_inode, blk, blks[blk])) < 0) {
+                break;
+            }
+            committed = created;
+            blk_dirty = 0;
+        }
+
+        int new_ino = batch_alloc(&b, sb.i_bitmap_blk, sb.max_inum);
+        if (new_ino < 0) {
+            ret = -ENOSPC;
+            break;
+        }
+
+        struct inode new_inode;
+        memset(&new_inode, 0, sizeof(struct inode));
+        new_inode.ino = new_ino;
+        new_inode.valid = 1;
+        new_inode.type = S_IFREG | mode;
+        new_inode.link = 1;
+        new_inode.vstat.st_rdev = inode_new_flags(&dir_inode);
+        inode_touch(&new_inode, RUFS_ATIME | RUFS_MTIME | RUFS_CTIME);
+        if (batch_put_inode(&b, &new_inode) < 0) {
+            ret = -EIO;
+            break;
+        }
+
+        memset(&entry[slot], 0, sizeof(struct dirent));
+        entry[slot].ino = new_ino;
+        entry[slot].valid = 1;
+        entry[slot].len = strlen(names[created]);
+        memcpy(entry[slot].name, names[created], entry[slot].len);
+        blk_dirty = 1;
+        created++;
+    }
+
+    if (ret == 0 && blk_dirty) {
+        ret = bulk_flush(&b, &dir_inode, blk, blks[blk]);
+    }
+    if (ret == 0) {
+        ret = created;
+    } else {
+        batch_abort(&b);
+        if (committed > 0) {
+            ret = committed;
+        }
+    }
+
+out:
+    iunlock(dir);
+    free(blks);
+    return ret;
+}
+
+int rufs_create_bulk(const char *dir_path, const char *names[], int count, mode_t mode) {
+    struct inode dir_inode;
+
+    if (get_node_by_path(dir_path, 0, &dir_inode) < 0) {
+        return -ENOENT;
+    }
+
+    return create_bulk_in(dir_inode.ino, names, count, mode);
+}
+
+/*
+ * Remove name from the directory parent. Only the name goes here: the
+ * dirent, the child's link count and its orphan bit are one transaction,
+ * and the background worker frees the blocks and the inode later, once
+ * nothing holds the child. is_dir selects rmdir or unlink semantics.
+ */
+static int unlink_in(uint16_t parent, const char *name, int is_dir) {
+    if (read_only) {
+        return -EROFS;
+    }
+
+    struct inode *dir_inode = iget(parent);
+    if (dir_inode == NULL) {
+        return -ENOENT;
+    }
+
+    ilock_wr(parent);
+    struct dirent entry;
+    int ret = (dir_inode->type & S_IFDIR) == 0 ? -ENOTDIR : 0;
+    if (ret == 0 && dir_find(parent, name, strlen(name), &entry) < 0) {
+        ret = -ENOENT;
+    }
+    struct inode *inode = ret == 0 ? iget(entry.ino) : NULL;
+    if (ret < 0 || inode == NULL) {
+        iunlock(parent);
+        iput(dir_inode);
+        return ret < 0 ? ret : -EIO;
+    }
+
+    ilock_wr(inode->ino);
+    if (is_dir && (inode->type & S_IFDIR) == 0) {
+        ret = -ENOTDIR;
+    } else if (!is_dir && (inode->type & S_IFDIR)) {
+        ret = -EISDIR;
+    } else if (is_dir) {
+        ret = dir_empty(inode);
+        ret = ret < 0 ? ret : (ret ? 0 : -ENOTEMPTY);
+    }
+
+    struct meta_batch b;
+    batch_init(&b);
+    if (ret == 0) {
+        ret = dir_delete(&b, dir_inode, name, strlen(name));
+    }
+    if (ret >= 0) {
+        inode->link = is_dir || inode->link == 0 ? 0 : inode->link - 1;
+        inode_touch(inode, RUFS_CTIME);
+        if (inode->link == 0) {
+            pthread_mutex_lock(&ibitmap_lock);
+            set_bitmap(orphan_bitmap, inode->ino);
+            pthread_mutex_unlock(&ibitmap_lock);
+            if (sb.o_bitmap_blk) {
+                batch_stage(&b, sb.o_bitmap_blk, orphan_bitmap);
+            }
+        }
+        ret = batch_put_inode(&b, inode) < 0 || batch_commit(&b) < 0 ? -EIO : 0;
+        if (ret == 0) {
+            inode_wstate[inode->ino].dirty = 0;
+        }
+    } else {
+        batch_abort(&b);
+    }
+    iunlock(inode->ino);
+    iunlock(parent);
+
+    // The child's last pin wakes the worker if it is an orphan now
+    iput(inode);
+    iput(dir_inode);
+    return ret;
+}
+
+// Split path into parent and name and remove it
+static int unlink_node(const char *path, int is_dir) {
+    char parent_path[PATH_MAX];
+    char base_path[PATH_MAX];
+    struct inode parent_inode;
+
+    strncpy(parent_path, path, PATH_MAX - 1);
+    parent_path[PATH_MAX - 1] = '\0';
+    strcpy(base_path, parent_path);
+    char *parent_dir = dirname(parent_path);
+    char *base_name = basename(base_path);
+
+    if (get_node_by_path(parent_dir, 0, &parent_inode) < 0) {
+        return -ENOENT;
+    }
+    return unlink_in(parent_inode.ino, base_name, is_dir);
+}
+
+static int rufs_rmdir(const char *path) {
+    return unlink_node(path, 1);
+}
+static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {return 0;}
+
+/*
+ * Open file handles. open and create pin the file's inode and keep it in
+ * fi->fh, so read and write work on the cached inode without a lookup.
+ * Inode changes are written back on flush and release. The pin is what
+ * keeps an unlinked file, its inode and its blocks, until the last handle
+ * goes (see orphan_reclaim()); blocks the file itself drops, by truncate
+ * or by a write moving them, are guarded by the inode lock instead.
+ */
+struct rufs_fh {
+    struct inode *inode;			/* pinned inode in the inode cache */
+    pthread_mutex_t ra_lock;		/* guards the readahead state below */
+    off_t ra_next;					/* offset a sequential read would start at */
+    off_t ra_end;					/* readahead has been started up to here */
+    size_t ra_window;				/* current readahead size, 0 after random reads */
+};
+
+static int fh_open(uint16_t ino, struct rufs_fh *fh) {
+    fh->inode = iget(ino);
+    if (fh->inode == NULL) {
+        return -EIO;
+    }
+    pthread_mutex_init(&fh->ra_lock, NULL);
+    fh->ra_next = 0;
+    fh->ra_end = 0;
+    fh->ra_window = 0;
+    return 0;
+}
+
+static int fh_flush(struct rufs_fh *fh) {
+    struct inode_wstate *ws = &inode_wstate[fh->inode->ino];
+
+    if (ws->dirty) {
+        if (writei(fh->inode->ino, fh->inode) < 0) {
+            return -EIO;
+        }
+        ws->dirty = 0;
+    }
+    return 0;
+}
+
+// Drop the handle's pin; callers flush it first under the inode lock
+static void fh_close(struct rufs_fh *fh) {
+    pthread_mutex_destroy(&fh->ra_lock);
+    iput(fh->inode);
+}
+
+static int fh_store(struct fuse_file_info *fi, uint16_t ino) {
+    if (fi == NULL) {
+        return 0;
+    }
+
+    struct rufs_fh *fh = malloc(sizeof(struct rufs_fh));
+    if (fh == NULL) {
+        return -ENOMEM;
+    }
+    if (fh_open(ino, fh) < 0) {
+        free(fh);
+        return -EIO;
+    }
+    fi->fh = (uintptr_t)fh;
+    return 0;
+}
+
+/*
+ * Return the handle stored in fi, or open a temporary one on tmp when the
+ * caller has no handle (the in-process tests call read/write with NULL).
+ */
+static struct rufs_fh *fh_lookup(const char *path, struct fuse_file_info *fi, struct rufs_fh *tmp) {
+    if (fi != NULL && fi->fh != 0) {
+        return (struct rufs_fh *)(uintptr_t)fi->fh;
+    }
+
+    struct inode file_inode;
+    if (get_node_by_path(path, 0, &file_inode) < 0) {
+        fprintf(stderr, "Error: Invalid path %s\n", path);
+        return NULL;
+    }
+    if (fh_open(file_inode.ino, tmp) < 0) {
+        return NULL;
+    }
+    return tmp;
+}
+
+/*
+ * Note a read on the handle. The atime goes out with the inode on flush,
+ * or right away for a temporary handle.
+ */
+static void fh_accessed(struct rufs_fh *fh, int temporary) {
+    uint16_t ino = fh->inode->ino;
+
+    if (read_only || !atime_due(fh->inode)) {
+        return;
+    }
+    ilock_wr(ino);
+    if (atime_due(fh->inode)) {
+        inode_touch(fh->inode, RUFS_ATIME);
+        inode_wstate[ino].dirty |= INODE_DIRTY_TIMES;
+        if (temporary) {
+            fh_flush(fh);
+        }
+    }
+    iunlock(ino);
+}
+
+static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    int ino = create_node(path, S_IFREG | mode, 1);
+    if (ino < 0) {
+        return ino;
+    }
+
+    return fh_store(fi, ino);
+}
+
+static int rufs_open(const char *path, struct fuse_file_info *fi) {
+    struct inode file_inode;
+
+    // Step 1: Call get_node_by_path() to get inode from path
+    if (get_node_by_path(path, 0, &file_inode) < 0) {
+        return -1;
+    }
+
+    if ((file_inode.type & S_IFREG) == 0) {
+        return -1; 
+    }
+
+    // Step 2: Keep the inode pinned for the lifetime of the handle
+    if (fi != NULL) {
+        fi->keep_cache = rufs_options.keep_cache;
+    }
+    return fh_store(fi, file_inode.ino);
+}
+
+/*
+ * Log-structured mode (-o log). The data region is cut into segments of
+ * SEG_BLKS blocks. Data blocks are handed out in order from the segment
+ * at the log head, which moves on to the next completely free segment
+ * when it fills up, and an overwrite also goes to a fresh block at the
+ * head. Random writes thus reach the disk as one sequential stream.
+ * Metadata already goes out sequentially through the journal, and inode
+ * numbers name fixed slots of the inode table, which serves as the inode
+ * map; only indirect and directory blocks are updated in place.
+ *
+ * Overwrites leave holes in older segments. When fewer than LOG_CLEAN_LOW
+ * segments are free, the background worker takes the segment with the fewest
+ * live blocks, moves them to the log head and so frees the segment. The
+ * data bitmap doubles as the segment usage table.
+ */
+#define SEG_BLKS 64
+#define LOG_CLEAN_LOW 8				/* free segments below which the cleaner runs */
+#define LOG_CLEAN_HIGH 16			/* free segments it stops at */
+
+static int log_seg = -1;			/* segment at the log head, under dbitmap_lock */
+static int log_off;					/* next block of it to try */
+
+/*
+ * Segment summary: the inodes that may have blocks in each segment, so
+ * the cleaner only visits those. A bit is set wherever a file is given a
+ * block pointer and cleared when the cleaner takes the segment; one that
+ * is stale only costs a visit. The first clean after mount fills it in
+ * from the inode table.
+ */
+#define MAX_SEGS (MAX_DNUM / SEG_BLKS)
+
+static unsigned char seg_owners[MAX_SEGS][MAX_INUM / 8];
+static int seg_owners_built;		/* only touched by the worker */
+
+static void seg_own(const struct inode *inode, int blk) {
+    if (!rufs_options.log || blk < (int)sb.d_start_blk) {
+        return;
+    }
+    int seg = (blk - sb.d_start_blk) / SEG_BLKS;
+    __atomic_fetch_or(&seg_owners[seg][inode->ino / 8], 1 << (inode->ino % 8), __ATOMIC_RELAXED);
+}
+
+// Live blocks in a segment; caller holds dbitmap_lock
+static int seg_live(int seg) {
+    int live = 0;
+    for (int i = 0; i < SEG_BLKS / 8; i++) {
+        live += __builtin_popcount(data_bitmap[seg * (SEG_BLKS / 8) + i]);
+    }
+    return live;
+}
+
+// Caller holds dbitmap_lock
+static int seg_free_count() {
+    int nfree = 0;
+    for (int seg = 0; seg < sb.max_dnum / SEG_BLKS; seg++) {
+        nfree += seg_live(seg) == 0;
+    }
+    return nfree;
+}
+
+/*
+ * Take the next free block at the log head and return its bitmap index;
+ * caller holds dbitmap_lock. *low is set when the head moved on and free
+ * segments are running out. With no free segment left, holes anywhere
+ * are used until the cleaner catches up.
+ */
+static int log_alloc(int *low) {
+    int nsegs = sb.max_dnum / SEG_BLKS;
+
+    while (log_seg >= 0 && log_off < SEG_BLKS) {
+        int i = log_seg * SEG_BLKS + log_off++;
+        if (!get_bitmap(data_bitmap, i)) {
+            set_bitmap(data_bitmap, i);
+            return i;
+        }
+    }
+
+    *low = 1;
+    for (int n = 1; n <= nsegs; n++) {
+        int seg = (log_seg + n + nsegs) % nsegs;
+        if (seg_live(seg) == 0) {
+            *low = seg_free_count() <= LOG_CLEAN_LOW;
+            log_seg = seg;
+            log_off = 1;
+            set_bitmap(data_bitmap, seg * SEG_BLKS);
+            return seg * SEG_BLKS;
+        }
+    }
+    return bitmap_alloc(data_bitmap, sb.max_dnum);
+}
+
+/*
+ * File block map. The 16 direct pointers cover the first 64KB; each of the
+ * 8 indirect pointers names a block of PTRS_PER_BLOCK more pointers, which
+ * is enough to address the whole data region.
+ */
+#define PTRS_PER_BLOCK (BLOCK_SIZE / sizeof(int))
+#define MAX_FILE_BLKS (16 + 8 * PTRS_PER_BLOCK)
+
+/*
+ * The indirect block last used by bmap(), so a large request reads it once.
+ * Allocations and pointer blocks are staged in b and committed together.
+ */
+struct bmap_cursor {
+    int blk;
+    int dirty;
+    struct meta_batch *b;
+    int old;						/* block the last BMAP_RELOCATE moved away from */
+    int cow;						/* a shared block was moved, so commit the inode too */
+    int ptrs[PTRS_PER_BLOCK];
+    int err;						/* why file_map_cursor() stopped short, if it did */
+};
+
+// bmap() alloc mode that also moves an existing block to a fresh one
+#define BMAP_RELOCATE 2
+
+// Stage the cursor's pointer block
+static int bmap_stage(struct bmap_cursor *c) {
+    if (!c->dirty) {
+        return 0;
+    }
+
+    char *buf = batch_get(c->b, c->blk, 0);
+    if (buf == NULL) {
+        return -EIO;
+    }
+    memcpy(buf, c->ptrs, BLOCK_SIZE);
+    c->dirty = 0;
+    return 0;
+}
+
+static int alloc_data_blk(struct bmap_cursor *c) {
+    int low = 0;
+
+    pthread_mutex_lock(&dbitmap_lock);
+    int block_no = rufs_options.log ? log_alloc(&low) : bitmap_alloc(data_bitmap, sb.max_dnum);
+    pthread_mutex_unlock(&dbitmap_lock);
+
+    if (low) {
+        worker_wake(WORK_CLEAN);
+    }
+
+    if (block_no < 0) {
+        return -ENOSPC;
+    }
+
+    // Recorded in the batch, so an abort gives it back
+    struct meta_batch *b = c->b;
+    if (b->ndallocs == b->dallocs_cap) {
+        int cap = b->dallocs_cap ? 2 * b->dallocs_cap : 64;
+        uint32_t *dallocs = realloc(b->dallocs, cap * sizeof(uint32_t));
+        if (dallocs != NULL) {
+            b->dallocs = dallocs;
+            b->dallocs_cap = cap;
+        }
+    }
+    if (b->ndallocs == b->dallocs_cap || batch_stage(b, sb.d_bitmap_blk, data_bitmap) < 0) {
+        pthread_mutex_lock(&dbitmap_lock);
+        unset_bitmap(data_bitmap, block_no);
+        pthread_mutex_unlock(&dbitmap_lock);
+        return -EIO;
+    }
+    b->dallocs[b->ndallocs++] = block_no;
+    return block_no + sb.d_start_blk;
+}
+
+/*
+ * Stage the reference count block covering data block index i. A full
+ * batch fails the operation rather than being committed: the count must
+ * go out with the pointer change it belongs to.
+ */
+static int ref_stage(struct meta_batch *b, int i) {
+    uint32_t n = i / REFS_PER_BLOCK;
+
+    if (batch_stage(b, sb.r_start_blk + n, &blk_refs[n * REFS_PER_BLOCK]) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * 1 if a data block has more than one pointer to it. Otherwise the caller
+ * is about to write it in place, so it leaves the dedup index first.
+ */
+static int blk_shared(int block_no) {
+    int idx = block_no - sb.d_start_blk;
+
+    pthread_mutex_lock(&dbitmap_lock);
+    int shared = blk_refs[idx] > 0;
+    if (!shared) {
+        dedup_fps[idx] = 0;
+    }
+    pthread_mutex_unlock(&dbitmap_lock);
+    return shared;
+}
+
+/*
+ * Drop one pointer to each of the disk blocks in b: a shared block will
+ * lose a reference, any other will be cleared in the data bitmap, once b
+ * is committed. The bitmap and reference counts are staged in b; if they
+ * do not fit, -EIO says b must not be committed.
+ */
+static int release_blknos(struct meta_batch *b, const int *blks, int count) {
+    uint32_t ref_blks = 0;			/* reference count blocks changed, one bit each */
+    int ndropped = 0;
+
+    for (int i = 0; i < count; i++) {
+        // CLUSTER_PACKED marks a slot with no block of its own
+        if (blks[i] < (int)sb.d_start_blk) {
+            continue;
+        }
+        int idx = blks[i] - sb.d_start_blk;
+        if (batch_drop(b, idx) < 0) {
+            return -EIO;
+        }
+        ndropped++;
+
+        pthread_mutex_lock(&dbitmap_lock);
+        int shared = blk_refs[idx] > 0;
+        pthread_mutex_unlock(&dbitmap_lock);
+        if (shared) {
+            ref_blks |= 1u << (idx / REFS_PER_BLOCK);
+        }
+    }
+
+    for (uint32_t n = 0; n < REF_BLKS; n++) {
+        if ((ref_blks & (1u << n)) && ref_stage(b, n * REFS_PER_BLOCK) < 0) {
+            return -EIO;
+        }
+    }
+    if (ndropped > 0 && batch_stage(b, sb.d_bitmap_blk, data_bitmap) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Point *slot at the pointer to file block idx, or set it to NULL when
+ * its indirect block is missing and alloc is not set
+ */
+static int bmap_slot(struct inode *inode, uint32_t idx, int alloc, struct bmap_cursor *c, int **slot) {
+    *slot = NULL;
+    if (alloc && batch_save_inode(c->b, inode) < 0) {
+        return -EIO;
+    }
+    if (idx < 16) {
+        *slot = &inode->direct_ptr[idx];
+        return 0;
+    }
+    if (idx >= MAX_FILE_BLKS) {
+        return alloc ? -EFBIG : 0;
+    }
+
+    idx -= 16;
+    int *ind = &inode->indirect_ptr[idx / PTRS_PER_BLOCK];
+    if (*ind == 0) {
+        if (!alloc) {
+            return 0;
+        }
+        int blk = alloc_data_blk(c);
+        if (blk < 0) {
+            return blk;
+        }
+        inode_add_blocks(inode, 1);
+        if (bmap_stage(c) < 0) {
+            return -EIO;
+        }
+        memset(c->ptrs, 0, BLOCK_SIZE);
+        c->blk = blk;
+        c->dirty = 1;
+        *ind = blk;
+        seg_own(inode, blk);
+    } else if (c->blk != *ind) {
+        if (bmap_stage(c) < 0) {
+            return -EIO;
+        }
+        if (bio_read(*ind, c->ptrs) < 0) {
+            c->blk = 0;
+            return -EIO;
+        }
+        c->blk = *ind;
+    }
+    *slot = &c->ptrs[idx % PTRS_PER_BLOCK];
+    return 0;
+}
+
+/*
+ * Return the disk block holding file block idx, or 0 if there is none.
+ * With alloc set, missing data and indirect blocks are allocated, and a
+ * shared block is moved to a fresh one as with BMAP_RELOCATE.
+ */
+static int bmap(struct inode *inode, uint32_t idx, int alloc, struct bmap_cursor *c) {
+    int *slot;
+
+    int ret = bmap_slot(inode, idx, alloc, c, &slot);
+    if (ret < 0 || slot == NULL) {
+        return ret;
+    }
+
+    int shared = alloc && *slot != 0 && alloc != BMAP_RELOCATE && blk_shared(*slot);
+    if (alloc && (*slot == 0 || alloc == BMAP_RELOCATE || shared)) {
+        int blk = alloc_data_blk(c);
+        if (blk < 0) {
+            return blk;
+        }
+        c->old = *slot;
+        if (c->old == 0) {
+            inode_add_blocks(inode, 1);
+        }
+        *slot = blk;
+        seg_own(inode, blk);
+        c->dirty |= idx >= 16;
+        c->cow |= shared;
+    }
+    return *slot;
+}
+
+// Commit what bmap() allocated; the inode itself goes out with the next writei
+static int bmap_done(struct bmap_cursor *c) {
+    if (c->b == NULL) {
+        return 0;
+    }
+    if (bmap_stage(c) < 0) {
+        batch_abort(c->b);
+        return -EIO;
+    }
+    return batch_commit(c->b);
+}
+
+// Commit what bmap() staged in the same transaction as the inode itself
+static int bmap_done_inode(struct bmap_cursor *c, struct inode *inode) {
+    if (bmap_stage(c) < 0 || batch_put_inode(c->b, inode) < 0) {
+        batch_abort(c->b);
+        return -EIO;
+    }
+    if (batch_commit(c->b) < 0) {
+        return -EIO;
+    }
+    inode_wstate[inode->ino].dirty = 0;
+    return 0;
+}
+
+// Free the block bmap() relocated from, first copying it over if copy is set
+static int bmap_retire(struct bmap_cursor *c, int block_no, int copy) {
+    char buf[BLOCK_SIZE];
+
+    if (copy && (bio_read(c->old, buf) < 0 || bio_write(block_no, buf) < 0)) {
+        return -EIO;
+    }
+    int ret = release_blknos(c->b, &c->old, 1);
+    c->old = 0;
+    return ret;
+}
+
+/*
+ * Zero-copy data path. Instead of copying through block_buf, a request is
+ * described as byte ranges of the disk image, one fd buffer per run of
+ * physically contiguous blocks, and libfuse splices between /dev/fuse and
+ * DISKFILE directly.
+ */
+static const char zero_block[BLOCK_SIZE];
+
+/*
+ * Map [offset, offset + size) of a file onto the disk image. Reads are
+ * clamped to the file size, and a hole maps to memory buffers over
+ * zero_block, one per block, so it reads as zeros without I/O. Those are
+ * shared, so such a map must never be handed to libfuse to free: only
+ * rufs_ll_read() replies with one, and fuse_reply_data() just copies. With
+ * alloc set, missing blocks are allocated. With fill also set, a block the
+ * range only partly covers is made whole first: zeroed if it is fresh so
+ * no stale data shows through, or given its old contents if it moved.
+ * Returns a malloc'd bufvec, or NULL on failure. A mapping that stops
+ * short, for lack of space say, covers a prefix of the range and leaves
+ * the reason in cursor->err.
+ */
+static struct fuse_bufvec *file_map_cursor(struct inode *inode, size_t size, off_t offset, int alloc, int fill,
+                                          struct bmap_cursor *cursor) {
+    if (!alloc) {
+        if (offset >= inode->size) {
+            size = 0;
+        } else if (size > inode->size - offset) {
+            size = inode->size - offset;
+        }
+    }
+
+    size_t nblks = size ? (offset + size - 1) / BLOCK_SIZE - offset / BLOCK_SIZE + 1 : 0;
+    if (nblks > MAX_FILE_BLKS) {
+        nblks = MAX_FILE_BLKS;
+    }
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) + nblks * sizeof(struct fuse_buf));
+    if (bufv == NULL) {
+        return NULL;
+    }
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = 0;
+
+    off_t current_offset = offset;
+    size_t bytes_left = size;
+    for (uint32_t i = offset / BLOCK_SIZE; bytes_left > 0; i++) {
+        size_t block_offset = current_offset % BLOCK_SIZE;
+        size_t len = BLOCK_SIZE - block_offset;
+        if (len > bytes_left) {
+            len = bytes_left;
+        }
+
+        int fresh = alloc && bmap(inode, i, 0, cursor) == 0;
+        int block_no = bmap(inode, i, alloc, cursor);
+        if (block_no == 0 && !alloc) {
+            struct fuse_buf *hole = &bufv->buf[bufv->count++];
+            hole->flags = 0;
+            hole->fd = -1;
+            hole->pos = 0;
+            hole->size = len;
+            hole->mem = (void *)zero_block;
+            bytes_left -= len;
+            current_offset += len;
+            continue;
+        }
+        if (block_no <= 0) {
+            cursor->err = block_no < 0 ? block_no : -EIO;
+            break;
+        }
+        if (fill && fresh && len < BLOCK_SIZE && bio_write(block_no, zero_block) < 0) {
+            cursor->err = -EIO;
+            break;
+        }
+        if (!fresh && cursor->old != 0 && bmap_retire(cursor, block_no, fill && len < BLOCK_SIZE) < 0) {
+            cursor->err = -EIO;
+            break;
+        }
+
+        off_t pos = (off_t)block_no * BLOCK_SIZE + block_offset;
+        struct fuse_buf *last = bufv->count ? &bufv->buf[bufv->count - 1] : NULL;
+        if (last != NULL && (last->flags & FUSE_BUF_IS_FD) && last->pos + (off_t)last->size == pos) {
+            last->size += len;
+        } else {
+            last = &bufv->buf[bufv->count++];
+            last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+            last->fd = dev_fd();
+            last->pos = pos;
+            last->size = len;
+            last->mem = NULL;
+        }
+
+        bytes_left -= len;
+        current_offset += len;
+    }
+    return bufv;
+}
+
+// file_map_cursor() with its allocations committed right away
+static struct fuse_bufvec *file_map(struct inode *inode, size_t size, off_t offset, int alloc) {
+    struct meta_batch b;
+    struct bmap_cursor cursor = { 0, 0, alloc ? &b : NULL };
+
+    batch_init(&b);
+    struct fuse_bufvec *bufv = file_map_cursor(inode, size, offset, alloc, 1, &cursor);
+    if (bufv != NULL && (cursor.cow ? bmap_done_inode(&cursor, inode) : bmap_done(&cursor)) < 0) {
+        free(bufv);
+        return NULL;
+    }
+    return bufv;
+}
+
+/*
+ * Map the range a write is about to fill. In log mode every block of it
+ * moves to the log head, and so does a shared block in any mode; the
+ * blocks it leaves are released in the cursor's batch, so the inode has
+ * to be committed with the new pointers by file_write_done(). fill is as for
+ * file_map_cursor().
+ */
+static struct fuse_bufvec *file_map_write(struct inode *inode, size_t size, off_t offset, int fill,
+                                          struct bmap_cursor *c) {
+    return file_map_cursor(inode, size, offset, rufs_options.log ? BMAP_RELOCATE : 1, fill, c);
+}
+
+static int file_write_done(struct inode *inode, struct bmap_cursor *c) {
+    return rufs_options.log || c->cow ? bmap_done_inode(c, inode) : bmap_done(c);
+}
+
+/*
+ * Compressed files (see rufs.h). A cluster is read and written whole: a
+ * write loads each cluster it touches, patches it and stores it again in
+ * fresh blocks, releasing the old ones in the same transaction, so shared
+ * blocks are never written in place and need no copy-on-write of their
+ * own. Clusters line up with the direct pointers and with each pointer
+ * block, so one cursor serves a whole cluster.
+ */
+#define CLUSTER_SIZE (CLUSTER_BLKS * BLOCK_SIZE)
+
+static int inode_compressed(const struct inode *inode) {
+    return (inode->type & S_IFREG) && (inode->vstat.st_rdev & RUFS_FL_COMPRESS);
+}
+
+// Read runs of consecutive disk blocks into buf, one block per entry of blks; 0 entries read as zeros
+static int read_blks(const int *blks, int n, char *buf) {
+    for (int i = 0, j; i < n; i = j) {
+        for (j = i + 1; j < n && blks[i] != 0 && blks[j] == blks[i] + (j - i); j++) {
+        }
+        if (blks[i] == 0) {
+            memset(buf + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+        } else if (bio_read_range((off_t)blks[i] * BLOCK_SIZE, buf + (size_t)i * BLOCK_SIZE,
+                                  (size_t)(j - i) * BLOCK_SIZE) < 0) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Load cluster cl into buf, CLUSTER_SIZE bytes. A packed cluster is
+ * decompressed whole; of a plain one only the blocks overlapping
+ * [from, from + len) are read.
+ */
+static int cluster_load(struct inode *inode, uint32_t cl, struct bmap_cursor *c, char *buf, size_t from, size_t len) {
+    int blks[CLUSTER_BLKS];
+
+    for (int i = 0; i < CLUSTER_BLKS; i++) {
+        blks[i] = bmap(inode, cl * CLUSTER_BLKS + i, 0, c);
+        if (blks[i] < 0) {
+            return -EIO;
+        }
+    }
+    if (blks[CLUSTER_BLKS - 1] != CLUSTER_PACKED) {
+        int lo = from / BLOCK_SIZE, hi = (from + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        return read_blks(blks + lo, hi - lo, buf + (size_t)lo * BLOCK_SIZE);
+    }
+
+    int n = 0;
+    while (n < CLUSTER_BLKS && blks[n] != CLUSTER_PACKED) {
+        n++;
+    }
+    char *packed = n > 0 ? malloc((size_t)n * BLOCK_SIZE) : NULL;
+    if (n > 0 && packed == NULL) {
+        return -ENOMEM;
+    }
+    struct cluster_header *hdr = (struct cluster_header *)packed;
+    int ret = read_blks(blks, n, packed);
+    if (ret == 0 && (n == 0 || hdr->clen > n * BLOCK_SIZE - sizeof(*hdr) ||
+                     lz4_decompress(packed + sizeof(*hdr), hdr->clen, buf, CLUSTER_SIZE) != CLUSTER_SIZE)) {
+        fprintf(stderr, "Error: Bad compressed cluster %u of inode %u\n", cl, inode->ino);
+        ret = -EIO;
+    }
+    free(packed);
+    return ret;
+}
+
+/*
+ * Store buf, a whole cluster, as cluster cl: packed if that saves a block,
+ * otherwise as plain blocks, with all-zero blocks left as holes. The new
+ * blocks are allocated and written before any pointer changes, so a
+ * failure leaves the old cluster in place. Pointers are staged through c.
+ */
+static int cluster_store(struct inode *inode, uint32_t cl, const char *buf, struct bmap_cursor *c) {
+    int need[CLUSTER_BLKS], slots[CLUSTER_BLKS], fresh[CLUSTER_BLKS], old[CLUSTER_BLKS];
+    int nfresh = 0, nold = 0, ret = 0, zero = 1;
+
+    if (batch_save_inode(c->b, inode) < 0) {
+        return -EIO;
+    }
+    char *packed = malloc(CLUSTER_SIZE);
+    if (packed == NULL) {
+        return -ENOMEM;
+    }
+    for (int i = 0; i < CLUSTER_BLKS; i++) {
+        need[i] = memcmp(buf + (size_t)i * BLOCK_SIZE, zero_block, BLOCK_SIZE) != 0;
+        slots[i] = 0;
+        zero &= !need[i];
+    }
+
+    // Packing has to leave at least one block of the cluster unused
+    struct cluster_header *hdr = (struct cluster_header *)packed;
+    const char *src = buf;
+    int clen = zero ? 0 : lz4_compress(buf, CLUSTER_SIZE, packed + sizeof(*hdr),
+                                       CLUSTER_SIZE - BLOCK_SIZE - sizeof(*hdr));
+    if (clen > 0) {
+        int n = (sizeof(*hdr) + clen + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        hdr->clen = clen;
+        memset(packed + sizeof(*hdr) + clen, 0, (size_t)n * BLOCK_SIZE - sizeof(*hdr) - clen);
+        for (int i = 0; i < CLUSTER_BLKS; i++) {
+            need[i] = i < n;
+            slots[i] = i < n ? 0 : CLUSTER_PACKED;
+        }
+        src = packed;
+    }
+
+    for (int i = 0; i < CLUSTER_BLKS && ret == 0; i++) {
+        if (!need[i]) {
+            continue;
+        }
+        int blk = alloc_data_blk(c);
+        if (blk < 0) {
+            ret = blk;
+            break;
+        }
+        fresh[nfresh++] = blk;
+        slots[i] = blk;
+        if (bio_write(blk, src + (size_t)i * BLOCK_SIZE) < 0) {
+            ret = -EIO;
+        }
+    }
+    free(packed);
+
+    // Swap the pointers over; the cluster shares one pointer block, so only the first slot can fail
+    for (int i = 0; i < CLUSTER_BLKS && ret == 0; i++) {
+        int *slot;
+        ret = bmap_slot(inode, cl * CLUSTER_BLKS + i, nfresh > 0, c, &slot);
+        if (ret < 0 || slot == NULL) {
+            continue;
+        }
+        if (*slot >= (int)sb.d_start_blk) {
+            old[nold++] = *slot;
+        }
+        *slot = slots[i];
+        seg_own(inode, slots[i]);
+        c->dirty |= cl * CLUSTER_BLKS + i >= 16;
+    }
+    if (ret < 0) {
+        release_blknos(c->b, fresh, nfresh);
+        return ret;
+    }
+    inode_add_blocks(inode, nfresh - nold);
+    return release_blknos(c->b, old, nold);
+}
+
+// file_read() for a compressed file
+static int cluster_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+    struct bmap_cursor c = { 0, 0, NULL };
+
+    if (offset >= inode->size) {
+        return 0;
+    }
+    if (size > inode->size - offset) {
+        size = inode->size - offset;
+    }
+    char *buf = malloc(CLUSTER_SIZE);
+    if (buf == NULL) {
+        return -1;
+    }
+
+    size_t done = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t from = pos % CLUSTER_SIZE;
+        size_t len = CLUSTER_SIZE - from < size - done ? CLUSTER_SIZE - from : size - done;
+        if (cluster_load(inode, pos / CLUSTER_SIZE, &c, buf, from, len) < 0) {
+            free(buf);
+            return -1;
+        }
+        memcpy(buffer + done, buf + from, len);
+        done += len;
+    }
+    free(buf);
+    return done;
+}
+
+/*
+ * Zero a compressed file's cluster holding offset size from there on,
+ * before a truncate frees the clusters after it, so a later extension
+ * reads zeros. It is committed on its own.
+ */
+static int cluster_trim(struct inode *inode, off_t size) {
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    size_t keep = size % CLUSTER_SIZE;
+
+    char *buf = malloc(CLUSTER_SIZE);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+    batch_init(&b);
+    int ret = cluster_load(inode, size / CLUSTER_SIZE, &c, buf, 0, CLUSTER_SIZE);
+    if (ret == 0) {
+        memset(buf + keep, 0, CLUSTER_SIZE - keep);
+        ret = cluster_store(inode, size / CLUSTER_SIZE, buf, &c);
+    }
+    free(buf);
+    if (bmap_done_inode(&c, inode) < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
+/*
+ * Read a whole request with one read per run of contiguous blocks,
+ * straight into the caller's buffer.
+ */
+static int file_read(struct inode *inode, char *buffer, size_t size, off_t offset) {
+    if (inode_compressed(inode)) {
+        return cluster_read(inode, buffer, size, offset);
+    }
+
+    struct fuse_bufvec *bufv = file_map(inode, size, offset, 0);
+    if (bufv == NULL) {
+        return -1;
+    }
+
+    size_t bytes_read = 0;
+    for (size_t i = 0; i < bufv->count; i++) {
+        struct fuse_buf *seg = &bufv->buf[i];
+        if (!(seg->flags & FUSE_BUF_IS_FD)) {
+            memset(buffer + bytes_read, 0, seg->size);
+        } else if (bio_read_range(seg->pos, buffer + bytes_read, seg->size) < 0) {
+            fprintf(stderr, "Error: Failed to read %zu bytes at %lld\n", seg->size, (long long)seg->pos);
+            free(bufv);
+            return -1;
+        }
+        bytes_read += seg->size;
+    }
+
+    free(bufv);
+    return bytes_read;
+}
+
+// Whether reads of the file have to see its data rather than splice it: it is compressed or checked
+static int file_read_mem(const struct inode *inode) {
+    return inode_compressed(inode) || rufs_options.datasum;
+}
+
+// A bufvec over one malloc'd buffer holding what file_read() returns, for the reply paths
+static struct fuse_bufvec *file_map_mem(struct inode *inode, size_t size, off_t offset) {
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+    char *buf = malloc(size ? size : 1);
+    int ret = bufv == NULL || buf == NULL ? -1 : file_read(inode, buf, size, offset);
+
+    if (ret < 0) {
+        free(buf);
+        free(bufv);
+        return NULL;
+    }
+    *bufv = FUSE_BUFVEC_INIT(ret);
+    bufv->buf[0].mem = buf;
+    return bufv;
+}
+
+/*
+ * Readahead. Each handle watches whether reads continue where the last one
+ * ended. A sequential stream gets a window that starts at the request size
+ * (at least RA_MIN_BLKS) and doubles up to RA_MAX_BLKS each time more is
+ * started. When the reader gets
+ * within half a window of the readahead so far, the blocks behind it are
+ * handed to the host page cache to read in the background, so the next
+ * requests find them in memory. A read anywhere else drops the window.
+ */
+#define RA_MIN_BLKS 4
+#define RA_MAX_BLKS (2 * RUFS_MAX_IO / BLOCK_SIZE)
+
+// Caller holds the inode lock
+static void fh_readahead(struct rufs_fh *fh, off_t offset, size_t size) {
+    off_t end = offset + size, start = 0;
+    size_t len = 0;
+
+    pthread_mutex_lock(&fh->ra_lock);
+    if (offset != fh->ra_next) {
+        fh->ra_window = 0;
+        fh->ra_end = 0;
+    } else if (fh->ra_end < end + (off_t)fh->ra_window / 2) {
+        size_t window = fh->ra_window * 2 > size ? fh->ra_window * 2 : size;
+        if (window < RA_MIN_BLKS * BLOCK_SIZE) {
+            window = RA_MIN_BLKS * BLOCK_SIZE;
+        } else if (window > RA_MAX_BLKS * BLOCK_SIZE) {
+            window = RA_MAX_BLKS * BLOCK_SIZE;
+        }
+        start = fh->ra_end > end ? fh->ra_end : end;
+        fh->ra_window = window;
+        fh->ra_end = end + window;
+        len = fh->ra_end - start;
+    }
+    fh->ra_next = end;
+    pthread_mutex_unlock(&fh->ra_lock);
+
+    if (len == 0 || start >= fh->inode->size) {
+        return;
+    }
+    struct fuse_bufvec *bufv = file_map(fh->inode, len, start, 0);
+    if (bufv == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < bufv->count; i++) {
+        if (bufv->buf[i].flags & FUSE_BUF_IS_FD) {
+            bio_prefetch(bufv->buf[i].pos, bufv->buf[i].size);
+        }
+    }
+    free(bufv);
+}
+
+static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct rufs_fh tmp;
+
+    // Step 1: Use the open handle, or resolve the path if there is none
+    struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+    if (fh == NULL) {
+        return -1;
+    }
+
+    // Ensure the inode represents a regular file
+    if ((fh->inode->type & S_IFREG) == 0) {
+        fprintf(stderr, "Error: Path %s is not a regular file\n", path);
+        if (fh == &tmp) {
+            fh_close(&tmp);
+        }
+        return -1;
+    }
+
+    // Step 2: Based on size and offset, read its data blocks from disk
+    ilock_rd(fh->inode->ino);
+    int ret = file_read(fh->inode, buffer, size, offset);
+    if (ret > 0) {
+        fh_readahead(fh, offset, ret);
+    }
+    iunlock(fh->inode->ino);
+    fh_accessed(fh, fh == &tmp);
+
+    if (fh == &tmp) {
+        fh_close(&tmp);
+    }
+
+    // Step 3: Return the number of bytes read
+    return ret;
+}
+
+/*
+ * Account for len bytes written at offset: grow the file, stamp it, and
+ * note what flush and fsync will have to write out.
+ */
+static void file_written(struct inode *inode, const struct inode *before, off_t offset, size_t len) {
+    struct inode_wstate *ws = &inode_wstate[inode->ino];
+
+    if (len == 0) {
+        return;
+    }
+    if (offset + len > inode->size) {
+        inode->size = offset + len;
+    }
+    if (!writeback_cache) {
+        inode_touch(inode, RUFS_MTIME | RUFS_CTIME);
+    }
+
+    if (inode->size != before->size || memcmp(inode->direct_ptr, before->direct_ptr, sizeof(inode->direct_ptr)) ||
+        memcmp(inode->indirect_ptr, before->indirect_ptr, sizeof(inode->indirect_ptr))) {
+        ws->dirty |= INODE_DIRTY_META;
+    } else {
+        ws->dirty |= INODE_DIRTY_TIMES;
+    }
+    ws->unsynced = 1;
+}
+
+// Read file block idx as it is now; a missing block reads as zeros
+static int file_read_block(struct inode *inode, uint32_t idx, char *buf) {
+    struct bmap_cursor c = { 0, 0, NULL };
+
+    int blk = bmap(inode, idx, 0, &c);
+    if (blk <= 0) {
+        memset(buf, 0, BLOCK_SIZE);
+        return 0;
+    }
+    return bio_read(blk, buf) < 0 ? -1 : 0;
+}
+
+/*
+ * file_write() for a compressed file: every cluster the request touches
+ * is stored anew, and the lot is committed with the inode, which names
+ * the new blocks in place of the released ones.
+ */
+static int cluster_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    struct inode before = *inode;
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+
+    if (offset >= (off_t)MAX_FILE_BLKS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    if (size > (off_t)MAX_FILE_BLKS * BLOCK_SIZE - offset) {
+        size = (off_t)MAX_FILE_BLKS * BLOCK_SIZE - offset;
+    }
+    char *buf = malloc(CLUSTER_SIZE);
+    if (buf == NULL) {
+        return -ENOMEM;
+    }
+
+    batch_init(&b);
+    size_t done = 0;
+    int ret = 0;
+    while (done < size) {
+        off_t pos = offset + done;
+        size_t from = pos % CLUSTER_SIZE;
+        size_t len = CLUSTER_SIZE - from < size - done ? CLUSTER_SIZE - from : size - done;
+        if (len < CLUSTER_SIZE && (ret = cluster_load(inode, pos / CLUSTER_SIZE, &c, buf, 0, CLUSTER_SIZE)) < 0) {
+            break;
+        }
+        memcpy(buf + from, buffer + done, len);
+        if ((ret = cluster_store(inode, pos / CLUSTER_SIZE, buf, &c)) < 0) {
+            break;
+        }
+        done += len;
+    }
+    free(buf);
+
+    file_written(inode, &before, offset, done);
+    if (bmap_done_inode(&c, inode) < 0) {
+        return -EIO;
+    }
+    return done > 0 || ret == 0 ? (int)done : (ret == -1 ? -EIO : ret);
+}
+
+/*
+ * Write a request with one write per run of contiguous blocks, straight
+ * from the caller's buffer. Only a first or last block the request covers
+ * in part is read, before mapping can move or allocate it, and its kept
+ * bytes go out in the same write; whole blocks are never read. A write
+ * that runs out of space stops short; one that writes nothing returns
+ * the errno instead.
+ */
+static int file_write_range(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    struct inode before = *inode;
+    struct meta_batch b;
+    struct bmap_cursor cursor = { 0, 0, &b };
+    char edge[2][BLOCK_SIZE];
+
+    if (size == 0) {
+        return 0;
+    }
+    uint32_t first = offset / BLOCK_SIZE, last = (offset + size - 1) / BLOCK_SIZE;
+    size_t head = offset % BLOCK_SIZE, tail = (offset + size) % BLOCK_SIZE;
+    if ((head != 0 || (first == last && tail != 0)) && file_read_block(inode, first, edge[0]) < 0) {
+        return -EIO;
+    }
+    if (first != last && tail != 0 && file_read_block(inode, last, edge[1]) < 0) {
+        return -EIO;
+    }
+    char *tail_src = first == last ? edge[0] : edge[1];
+
+    batch_init(&b);
+    struct fuse_bufvec *bufv = file_map_write(inode, size, offset, 0, &cursor);
+    if (bufv == NULL) {
+        return -ENOMEM;
+    }
+
+    size_t bytes_written = 0;
+    for (size_t i = 0; i < bufv->count; i++) {
+        struct fuse_buf *seg = &bufv->buf[i];
+        size_t pre = seg->pos % BLOCK_SIZE;
+        size_t end = (seg->pos + seg->size) % BLOCK_SIZE;
+        struct iovec iov[3];
+        int n = 0;
+
+        if (pre != 0) {
+            iov[n].iov_base = edge[0];
+            iov[n++].iov_len = pre;
+        }
+        iov[n].iov_base = (char *)buffer + bytes_written;
+        iov[n++].iov_len = seg->size;
+        if (end != 0) {
+            iov[n].iov_base = tail_src + end;
+            iov[n++].iov_len = BLOCK_SIZE - end;
+        }
+
+        if (bio_writev((seg->pos - pre) / BLOCK_SIZE, iov, n) < 0) {
+            fprintf(stderr, "Error: Failed to write blocks at %lld\n", (long long)(seg->pos - pre));
+            break;
+        }
+        bytes_written += seg->size;
+    }
+    free(bufv);
+
+    file_written(inode, &before, offset, bytes_written);
+    if (file_write_done(inode, &cursor) < 0) {
+        return -EIO;
+    }
+    if (bytes_written == 0) {
+        return cursor.err < 0 ? cursor.err : -EIO;
+    }
+    return bytes_written;
+}
+
+/*
+ * Deduplication. A whole block about to be written whose bytes match an
+ * indexed block takes a reference to that block instead: with the
+ * "dedup" option inline in file_write(), and for blocks already written
+ * with RUFS_IOC_DEDUP. A fingerprint match is only a hint; the blocks are
+ * compared before one is shared.
+ */
+static uint64_t dedup_fp(const char *data) {
+    uint64_t h = 0x9E3779B97F4A7C15ull, w;
+
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(w)) {
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+        h ^= h >> 32;
+    }
+    return h ? h : 1;
+}
+
+// Indexed block with fingerprint fp, or -1; caller holds dbitmap_lock
+static int dedup_lookup(uint64_t fp) {
+    int idx = dedup_table[fp % DEDUP_SLOTS] - 1;
+    return idx >= 0 && dedup_fps[idx] == fp ? idx : -1;
+}
+
+// Index the data block block_no, which holds bytes with fingerprint fp
+static void dedup_insert(int block_no, uint64_t fp) {
+    int idx = block_no - sb.d_start_blk;
+
+    pthread_mutex_lock(&dbitmap_lock);
+    dedup_fps[idx] = fp;
+    dedup_table[fp % DEDUP_SLOTS] = idx + 1;
+    pthread_mutex_unlock(&dbitmap_lock);
+}
+
+/*
+ * Take a reference to an indexed block holding the same bytes as data,
+ * staging its count in b. Returns the block, or 0 if there is none. A
+ * block still indexed after the compare has not been written since, as
+ * writing or freeing it drops it from the index first.
+ */
+static int dedup_take(const char *data, uint64_t fp, struct meta_batch *b) {
+    char buf[BLOCK_SIZE];
+
+    pthread_mutex_lock(&dbitmap_lock);
+    int idx = dedup_lookup(fp);
+    pthread_mutex_unlock(&dbitmap_lock);
+    if (idx < 0 || bio_read(sb.d_start_blk + idx, buf) < 0 || memcmp(buf, data, BLOCK_SIZE) != 0) {
+        return 0;
+    }
+
+    if (ref_stage(b, idx) < 0) {
+        return -EIO;
+    }
+    pthread_mutex_lock(&dbitmap_lock);
+    int taken = dedup_lookup(fp) == idx ? batch_take_ref(b, idx) : 0;
+    pthread_mutex_unlock(&dbitmap_lock);
+    if (taken <= 0) {
+        return taken < 0 ? -EIO : 0;
+    }
+    return (int)sb.d_start_blk + idx;
+}
+
+// Point file block idx at blk, taken with dedup_take(), dropping what it pointed at
+static int dedup_share(struct inode *inode, uint32_t idx, int blk, struct bmap_cursor *c) {
+    int *slot;
+
+    int ret = bmap_slot(inode, idx, 1, c, &slot);
+    if (ret < 0) {
+        release_blknos(c->b, &blk, 1);
+        return ret;
+    }
+    int old = *slot;
+    *slot = blk;
+    seg_own(inode, blk);
+    c->dirty |= idx >= 16;
+    if (old != 0) {
+        return release_blknos(c->b, &old, 1);
+    }
+    inode_add_blocks(inode, 1);
+    return 0;
+}
+
+// Write [from, to) of a dedup_write() request as usual, then index the whole blocks of it
+static int dedup_write_run(struct inode *inode, const char *buffer, size_t from, size_t to, off_t offset) {
+    struct bmap_cursor c = { 0, 0, NULL };
+
+    int n = file_write_range(inode, buffer + from, to - from, offset + from);
+    if (n != (int)(to - from)) {
+        return n < 0 ? n : -ENOSPC;
+    }
+    for (size_t k = from; k < to; ) {
+        off_t pos = offset + k;
+        size_t len = BLOCK_SIZE - pos % BLOCK_SIZE;
+        if (len == BLOCK_SIZE && k + len <= to) {
+            int blk = bmap(inode, pos / BLOCK_SIZE, 0, &c);
+            if (blk > 0) {
+                dedup_insert(blk, dedup_fp(buffer + k));
+            }
+        }
+        k += len;
+    }
+    return 0;
+}
+
+/*
+ * file_write() with inline deduplication. Runs of blocks with no match
+ * are written by file_write_range(), which moves pointers itself, so the
+ * pointers staged for matches are put out before each run.
+ */
+static int dedup_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    struct inode before = *inode;
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    size_t done = 0, run = 0;		/* [run, done) is still to be written */
+    int staged = 0, ret = 0;
+
+    batch_init(&b);
+    while (done < size && ret == 0) {
+        off_t pos = offset + done;
+        size_t n = BLOCK_SIZE - pos % BLOCK_SIZE;
+        if (n > size - done) {
+            n = size - done;
+        }
+        int blk = n == BLOCK_SIZE ? dedup_take(buffer + done, dedup_fp(buffer + done), &b) : 0;
+        if (blk <= 0) {
+            ret = blk;
+            done += n;
+            continue;
+        }
+
+        if (run < done) {
+            if (staged) {
+                ret = bmap_done_inode(&c, inode) < 0 ? -EIO : 0;
+                c.blk = 0;
+                staged = 0;
+            }
+            ret = ret == 0 ? dedup_write_run(inode, buffer, run, done, offset) : ret;
+        }
+        if (ret < 0) {
+            release_blknos(&b, &blk, 1);
+            break;
+        }
+        ret = dedup_share(inode, pos / BLOCK_SIZE, blk, &c);
+        if (ret == 0) {
+            staged = 1;
+            file_written(inode, &before, pos, n);
+            done += n;
+            run = done;
+        }
+    }
+    if (ret == 0 && run < done) {
+        if (staged) {
+            ret = bmap_done_inode(&c, inode) < 0 ? -EIO : 0;
+            c.blk = 0;
+        }
+        ret = ret == 0 ? dedup_write_run(inode, buffer, run, done, offset) : ret;
+        if (ret == 0) {
+            run = done;
+        }
+    }
+
+    if (bmap_done_inode(&c, inode) < 0) {
+        return -EIO;
+    }
+    return run > 0 || ret == 0 ? (int)run : ret;
+}
+
+/*
+ * Offline deduplication of one file; caller holds its write lock. Each
+ * block either joins an indexed copy of itself or is indexed for the
+ * blocks after it.
+ */
+static int dedup_file(struct inode *inode, struct rufs_dedup *req) {
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    char buf[BLOCK_SIZE];
+    int ret = 0;
+
+    uint32_t nblks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    batch_init(&b);
+    for (uint32_t idx = 0; idx < nblks && idx < MAX_FILE_BLKS && ret == 0; idx++) {
+        if (idx >= 16 && inode->indirect_ptr[(idx - 16) / PTRS_PER_BLOCK] == 0) {
+            idx += PTRS_PER_BLOCK - 1 - (idx - 16) % PTRS_PER_BLOCK;
+            continue;
+        }
+        int blk = bmap(inode, idx, 0, &c);
+        if (blk <= 0) {
+            ret = blk;
+            continue;
+        }
+        if (bio_read(blk, buf) < 0) {
+            ret = -EIO;
+            break;
+        }
+        req->scanned++;
+
+        uint64_t fp = dedup_fp(buf);
+        int dup = dedup_take(buf, fp, &b);
+        if (dup == 0) {
+            dedup_insert(blk, fp);
+        } else if (dup == blk) {
+            // Already indexed as itself
+            ret = release_blknos(&b, &dup, 1);
+        } else if (dup > 0) {
+            ret = dedup_share(inode, idx, dup, &c);
+            req->merged += ret == 0;
+        } else {
+            ret = dup;
+        }
+    }
+
+    if (bmap_done_inode(&c, inode) < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
+// RUFS_IOC_DEDUP: deduplicate every regular file that is not compressed
+static int dedup_all(struct rufs_dedup *req) {
+    int ret = 0;
+
+    if (read_only) {
+        return -EROFS;
+    }
+    req->scanned = req->merged = 0;
+    for (uint16_t ino = 0; ino < sb.max_inum && ret == 0; ino++) {
+        pthread_mutex_lock(&ibitmap_lock);
+        int used = get_bitmap(inode_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+        if (!used) {
+            continue;
+        }
+
+        struct inode *inode = iget(ino);
+        if (inode == NULL) {
+            continue;
+        }
+        ilock_wr(ino);
+        if (inode->valid && (inode->type & S_IFREG) && !inode_compressed(inode)) {
+            ret = dedup_file(inode, req);
+        }
+        iunlock(ino);
+        iput(inode);
+    }
+    return ret;
+}
+
+static int file_write(struct inode *inode, const char *buffer, size_t size, off_t offset) {
+    if (read_only) {
+        return -EROFS;
+    }
+    if (inode_compressed(inode)) {
+        return cluster_write(inode, buffer, size, offset);
+    }
+    if (rufs_options.dedup) {
+        return dedup_write(inode, buffer, size, offset);
+    }
+    return file_write_range(inode, buffer, size, offset);
+}
+
+// file_write_buf() for data that has to be looked at before it is placed: copy it to memory first
+static ssize_t file_write_copy(struct inode *inode, struct fuse_bufvec *src, off_t offset) {
+    size_t size = fuse_buf_size(src);
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+
+    mem.buf[0].mem = malloc(size ? size : 1);
+    if (mem.buf[0].mem == NULL) {
+        return -ENOMEM;
+    }
+    ssize_t ret = fuse_buf_copy(&mem, src, 0);
+    if (ret > 0) {
+        ret = file_write(inode, mem.buf[0].mem, ret, offset);
+    }
+    free(mem.buf[0].mem);
+    return ret;
+}
+
+// Copy src into the file at offset through the disk image; caller holds the inode write lock
+static ssize_t file_write_buf(struct inode *inode, struct fuse_bufvec *src, off_t offset) {
+    struct inode before = *inode;
+    struct meta_batch b;
+    struct bmap_cursor cursor = { 0, 0, &b };
+
+    if (read_only) {
+        return -EROFS;
+    }
+    if (inode_compressed(inode) || rufs_options.dedup || rufs_options.datasum) {
+        return file_write_copy(inode, src, offset);
+    }
+    batch_init(&b);
+    struct fuse_bufvec *dst = file_map_write(inode, fuse_buf_size(src), offset, 1, &cursor);
+    if (dst == NULL) {
+        return -ENOMEM;
+    }
+
+    // The copy goes around block.c, so stamp the blocks here, and drop their checksums first
+    for (size_t i = 0; i < dst->count; i++) {
+        if (dst->buf[i].flags & FUSE_BUF_IS_FD) {
+            bio_mark(dst->buf[i].pos, dst->buf[i].size);
+        }
+    }
+    ssize_t ret = 0;
+    if (dst->count > 0) {
+        ret = fuse_buf_copy(dst, src, FUSE_BUF_SPLICE_NONBLOCK);
+    }
+    free(dst);
+
+    if (ret > 0) {
+        file_written(inode, &before, offset, ret);
+    }
+    if (file_write_done(inode, &cursor) < 0) {
+        return -EIO;
+    }
+    if (ret == 0 && cursor.err < 0) {
+        return cursor.err;
+    }
+    return ret;
+}
+
+// Write zeros over [offset, offset + len), allocating blocks as needed
+static int file_zero(struct inode *inode, off_t offset, size_t len) {
+    struct fuse_bufvec *bufv = file_map(inode, len, offset, 1);
+    if (bufv == NULL) {
+        return -ENOMEM;
+    }
+
+    int ret = 0;
+    size_t mapped = 0;
+    for (size_t i = 0; i < bufv->count && ret == 0; i++) {
+        struct fuse_buf *seg = &bufv->buf[i];
+        for (size_t done = 0; done < seg->size && ret == 0; done += BLOCK_SIZE) {
+            size_t n = seg->size - done < BLOCK_SIZE ? seg->size - done : BLOCK_SIZE;
+            ret = bio_write_range(seg->pos + done, zero_block, n) < 0 ? -EIO : 0;
+        }
+        mapped += seg->size;
+    }
+    free(bufv);
+    inode_wstate[inode->ino].unsynced |= mapped > 0;
+
+    return ret == 0 && mapped < len ? -ENOSPC : ret;
+}
+
+/*
+ * Free every block of the file from block index first onwards, staging
+ * the bitmap and any trimmed pointer block in b
+ */
+static int file_free_from(struct meta_batch *b, struct inode *inode, uint32_t first) {
+    int freed[PTRS_PER_BLOCK + 1];
+    int nfreed = 0;
+
+    if (batch_save_inode(b, inode) < 0) {
+        return -EIO;
+    }
+
+    // CLUSTER_PACKED slots are cleared too, but hold no block to free
+    for (uint32_t i = first; i < 16; i++) {
+        if (inode->direct_ptr[i] >= (int)sb.d_start_blk) {
+            freed[nfreed++] = inode->direct_ptr[i];
+        }
+        inode->direct_ptr[i] = 0;
+    }
+    inode_add_blocks(inode, -nfreed);
+    if (release_blknos(b, freed, nfreed) < 0) {
+        return -EIO;
+    }
+
+    int ptrs[PTRS_PER_BLOCK];
+    for (int i = 0; i < 8; i++) {
+        uint32_t base = 16 + i * PTRS_PER_BLOCK;
+        if (inode->indirect_ptr[i] == 0 || base + PTRS_PER_BLOCK <= first) {
+            continue;
+        }
+        if (bio_read(inode->indirect_ptr[i], ptrs) < 0) {
+            return -EIO;
+        }
+
+        nfreed = 0;
+        int trimmed = 0;
+        for (uint32_t j = base < first ? first - base : 0; j < PTRS_PER_BLOCK; j++) {
+            if (ptrs[j] >= (int)sb.d_start_blk) {
+                freed[nfreed++] = ptrs[j];
+            }
+            trimmed |= ptrs[j] != 0;
+            ptrs[j] = 0;
+        }
+        if (base >= first) {
+            // The whole pointer block goes too, and it may be in the journal
+            freed[nfreed++] = inode->indirect_ptr[i];
+            inode->indirect_ptr[i] = 0;
+            b->revoke = 1;
+        } else if (trimmed) {
+            char *buf = batch_get(b, inode->indirect_ptr[i], 0);
+            if (buf == NULL) {
+                return -EIO;
+            }
+            memcpy(buf, ptrs, BLOCK_SIZE);
+        }
+        inode_add_blocks(inode, -nfreed);
+        if (release_blknos(b, freed, nfreed) < 0) {
+            return -EIO;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Set the file size and write the inode; caller holds the inode write
+ * lock. Shrinking frees the blocks past the new end, in the same
+ * transaction as the inode, and zeroes the rest of the last block so a
+ * later extension reads zeros. Growing allocates nothing: the new range
+ * is a hole.
+ */
+static int file_truncate(struct inode *inode, off_t size) {
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, NULL };
+    int ret = 0;
+
+    if (read_only) {
+        return -EROFS;
+    }
+    if (size > (off_t)MAX_FILE_BLKS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+
+    batch_init(&b);
+    if (size < inode->size) {
+        uint32_t first = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (inode_compressed(inode)) {
+            // A compressed file keeps whole clusters
+            if (size % CLUSTER_SIZE != 0) {
+                ret = cluster_trim(inode, size);
+            }
+            first = (size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_BLKS;
+        } else if (size % BLOCK_SIZE != 0 && bmap(inode, size / BLOCK_SIZE, 0, &c) > 0) {
+            ret = file_zero(inode, size, BLOCK_SIZE - size % BLOCK_SIZE);
+        }
+        if (ret == 0) {
+            ret = file_free_from(&b, inode, first);
+        }
+    }
+    if (ret < 0) {
+        batch_abort(&b);
+        return ret;
+    }
+
+    inode->size = size;
+    if (!writeback_cache) {
+        inode_touch(inode, RUFS_MTIME | RUFS_CTIME);
+    }
+    if (batch_put_inode(&b, inode) < 0 || batch_commit(&b) < 0) {
+        return -EIO;
+    }
+    inode_wstate[inode->ino].dirty = 0;
+    return 0;
+}
+
+/*
+ * lseek's SEEK_DATA and SEEK_HOLE: the first data or hole at or after
+ * offset, or -ENXIO at or past the end. The end of the file counts as a
+ * hole. Caller holds the inode lock.
+ */
+static off_t file_seek(struct inode *inode, off_t offset, int whence) {
+    struct bmap_cursor c = { 0, 0, NULL };
+
+    if (offset < 0 || offset >= inode->size) {
+        return -ENXIO;
+    }
+    uint32_t end = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (uint32_t idx = offset / BLOCK_SIZE; idx < end; idx++) {
+        int data;
+        if (idx >= 16 && inode->indirect_ptr[(idx - 16) / PTRS_PER_BLOCK] == 0) {
+            // A missing pointer block is one long hole
+            data = 0;
+            if (whence == SEEK_DATA) {
+                idx += PTRS_PER_BLOCK - 1 - (idx - 16) % PTRS_PER_BLOCK;
+                continue;
+            }
+        } else {
+            int blk = bmap(inode, idx, 0, &c);
+            if (blk < 0) {
+                return blk;
+            }
+            data = blk > 0;
+        }
+        if (data == (whence == SEEK_DATA)) {
+            off_t found = (off_t)idx * BLOCK_SIZE;
+            return found > offset ? found : offset;
+        }
+    }
+    return whence == SEEK_DATA ? -ENXIO : inode->size;
+}
+
+/*
+ * Share src's block si as dst's block di; dst's write cursor stages the
+ * pointer. Returns 1 when done, 0 when the block has to be copied
+ * instead: dst already has a block there or the count is saturated.
+ */
+static int file_share_block(struct inode *dst, uint32_t di, struct inode *src, uint32_t si,
+                            struct bmap_cursor *sc, struct bmap_cursor *dc) {
+    int blk = bmap(src, si, 0, sc);
+    if (blk < 0) {
+        return blk;
+    }
+
+    int *slot;
+    int ret = bmap_slot(dst, di, blk != 0, dc, &slot);
+    if (ret < 0) {
+        return ret;
+    }
+    if (slot == NULL || *slot != 0) {
+        return slot == NULL;
+    }
+    if (blk == 0) {
+        return 1;
+    }
+
+    // The count goes out no later than the pointer, so a crash can only leak the block
+    int idx = blk - sb.d_start_blk;
+    if (ref_stage(dc->b, idx) < 0) {
+        return -EIO;
+    }
+    pthread_mutex_lock(&dbitmap_lock);
+    int taken = batch_take_ref(dc->b, idx);
+    pthread_mutex_unlock(&dbitmap_lock);
+    if (taken <= 0) {
+        return taken < 0 ? -EIO : 0;
+    }
+
+    *slot = blk;
+    seg_own(dst, blk);
+    dc->dirty |= di >= 16;
+    inode_add_blocks(dst, 1);
+    return 1;
+}
+
+/*
+ * copy_file_range within the image. Block-aligned whole blocks that land
+ * on a hole in dst are shared with src, which only costs pointers and
+ * reference counts; the rest is read from src and written to dst. Returns
+ * the bytes copied. Caller holds dst's write lock and src's read lock, or
+ * just the write lock if they are the same file.
+ */
+static ssize_t file_copy_range(struct inode *dst, struct inode *src, off_t src_off, off_t dst_off, size_t len) {
+    if (src_off < 0 || dst_off < 0) {
+        return -EINVAL;
+    }
+    if (src_off >= src->size) {
+        return 0;
+    }
+    if (len > src->size - src_off) {
+        len = src->size - src_off;
+    }
+    if (dst_off + len > (off_t)MAX_FILE_BLKS * BLOCK_SIZE) {
+        return -EFBIG;
+    }
+    if (dst == src && src_off < dst_off + (off_t)len && dst_off < src_off + (off_t)len) {
+        return -EINVAL;
+    }
+
+    struct meta_batch b;
+    struct bmap_cursor sc = { 0, 0, NULL };
+    struct bmap_cursor dc = { 0, 0, &b };
+    char buf[BLOCK_SIZE];
+    size_t done = 0;
+    int staged = 0;
+    ssize_t ret = 0;
+
+    // Compressed clusters are not block for block, so they are always copied
+    int share = !inode_compressed(src) && !inode_compressed(dst);
+
+    batch_init(&b);
+    while (done < len && ret == 0) {
+        off_t so = src_off + done, d = dst_off + done;
+        size_t n = BLOCK_SIZE - d % BLOCK_SIZE;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        if (share && so % BLOCK_SIZE == 0 && n == BLOCK_SIZE) {
+            int shared = file_share_block(dst, d / BLOCK_SIZE, src, so / BLOCK_SIZE, &sc, &dc);
+            if (shared < 0) {
+                ret = shared;
+                break;
+            }
+            if (shared) {
+                staged = 1;
+                done += n;
+                continue;
+            }
+        }
+
+        // file_write moves dst's pointers itself, so put out what dc holds first
+        if (staged) {
+            ret = bmap_done_inode(&dc, dst) < 0 ? -EIO : 0;
+            dc.blk = 0;
+            staged = 0;
+        }
+        if (ret == 0 && (file_read(src, buf, n, so) != (int)n || file_write(dst, buf, n, d) != (int)n)) {
+            ret = -EIO;
+        }
+        if (ret == 0) {
+            done += n;
+        }
+    }
+
+    if (done > 0 && dst_off + done > dst->size) {
+        dst->size = dst_off + done;
+    }
+    inode_touch(dst, RUFS_MTIME | RUFS_CTIME);
+    // A shared block may not be on disk yet either, so fsync on dst has to flush
+    inode_wstate[dst->ino].unsynced = 1;
+    if (bmap_done_inode(&dc, dst) < 0) {
+        return -EIO;
+    }
+    return done > 0 ? (ssize_t)done : ret;
+}
+
+// Copy between two open files by inode number, locking both in inode number order
+static ssize_t copy_range_ino(uint16_t src_ino, off_t src_off, uint16_t dst_ino, off_t dst_off, size_t len) {
+    struct inode *src = iget(src_ino);
+    struct inode *dst = iget(dst_ino);
+    ssize_t ret;
+
+    if (src == NULL || dst == NULL) {
+        ret = -EIO;
+    } else if ((src->type & S_IFREG) == 0 || (dst->type & S_IFREG) == 0) {
+        ret = -EISDIR;
+    } else if (src == dst) {
+        ilock_wr(dst_ino);
+        ret = file_copy_range(dst, src, src_off, dst_off, len);
+        iunlock(dst_ino);
+    } else {
+        if (src_ino < dst_ino) {
+            ilock_rd(src_ino);
+            ilock_wr(dst_ino);
+        } else {
+            ilock_wr(dst_ino);
+            ilock_rd(src_ino);
+        }
+        ret = file_copy_range(dst, src, src_off, dst_off, len);
+        iunlock(src_ino);
+        iunlock(dst_ino);
+    }
+
+    if (src != NULL) {
+        iput(src);
+    }
+    if (dst != NULL) {
+        iput(dst);
+    }
+    return ret;
+}
+
+ssize_t rufs_copy_range(const char *src_path, off_t src_off, const char *dst_path, off_t dst_off, size_t len) {
+    struct inode src, dst;
+
+    if (get_node_by_path(src_path, 0, &src) < 0 || get_node_by_path(dst_path, 0, &dst) < 0) {
+        return -ENOENT;
+    }
+    return copy_range_ino(src.ino, src_off, dst.ino, dst_off, len);
+}
+
+/*
+ * Snapshots
+ *
+ * Taking one read-locks every inode so no writer moves the tree, then copies
+ * the inode table and bitmap into data blocks. The directory and pointer
+ * blocks the copied inodes name are copied as well, so the live tree keeps
+ * updating its own in place; file data blocks only gain a reference and
+ * are copied by whichever side writes them next. The record goes into the
+ * chain last, so a crash before that only leaks blocks. Deleting unlinks
+ * the record first and then drops everything it held; a snapshot mounted
+ * elsewhere cannot be deleted.
+ */
+static pthread_mutex_t snap_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct inode snap_table[MAX_INUM];		/* inode table being copied, under snap_lock */
+
+/*
+ * Hold every inode lock for reading, which stops writers while reads go
+ * on. An operation may hold one inode lock while it waits for another, so
+ * on contention everything is let go and the attempt starts over once the
+ * busy lock has been free.
+ */
+static void freeze_all() {
+    for (;;) {
+        int i = 0;
+        while (i < MAX_INUM && pthread_rwlock_tryrdlock(&inode_locks[i]) == 0) {
+            i++;
+        }
+        if (i == MAX_INUM) {
+            return;
+        }
+        for (int k = 0; k < i; k++) {
+            iunlock(k);
+        }
+        ilock_rd(i);
+        iunlock(i);
+    }
+}
+
+static void thaw_all() {
+    for (int i = 0; i < MAX_INUM; i++) {
+        iunlock(i);
+    }
+}
+
+// Copy a block to a fresh data block and return the copy
+static int snap_copy_block(struct bmap_cursor *c, int blk) {
+    char buf[BLOCK_SIZE];
+
+    int copy = alloc_data_blk(c);
+    if (copy < 0) {
+        return copy;
+    }
+    if (bio_read(blk, buf) < 0 || bio_write(copy, buf) < 0) {
+        return -EIO;
+    }
+    return copy;
+}
+
+// Give a snapshot its own pointer to data block blk: blk itself with one more reference, or a copy once the count is saturated
+static int snap_share(struct bmap_cursor *c, int blk) {
+    int idx = blk - sb.d_start_blk;
+
+    if (blk == CLUSTER_PACKED) {
+        return blk;
+    }
+
+    if (ref_stage(c->b, idx) < 0) {
+        return -EIO;
+    }
+    pthread_mutex_lock(&dbitmap_lock);
+    int taken = batch_take_ref(c->b, idx);
+    pthread_mutex_unlock(&dbitmap_lock);
+    if (taken < 0) {
+        return -EIO;
+    }
+    return taken ? blk : snap_copy_block(c, blk);
+}
+
+/*
+ * Turn copy, a live inode copied into snap_table, into the snapshot's own.
+ * Its pointers are cleared first and filled in as each block is copied or
+ * shared, so after a failure it names exactly what it holds.
+ */
+static int snap_copy_inode(struct inode *copy, struct bmap_cursor *c) {
+    struct inode live = *copy;
+    int is_dir = (live.type & S_IFDIR) != 0;
+    int ptrs[PTRS_PER_BLOCK];
+
+    memset(copy->direct_ptr, 0, sizeof(copy->direct_ptr));
+    memset(copy->indirect_ptr, 0, sizeof(copy->indirect_ptr));
+    for (int i = 0; i < 16; i++) {
+        if (live.direct_ptr[i] == 0) {
+            continue;
+        }
+        int blk = is_dir ? snap_copy_block(c, live.direct_ptr[i]) : snap_share(c, live.direct_ptr[i]);
+        if (blk < 0) {
+            return blk;
+        }
+        copy->direct_ptr[i] = blk;
+    }
+
+    for (int i = 0; i < 8; i++) {
+        if (live.indirect_ptr[i] == 0) {
+            continue;
+        }
+        int ind = bio_read(live.indirect_ptr[i], ptrs) < 0 ? -EIO : alloc_data_blk(c);
+        if (ind < 0) {
+            return ind;
+        }
+        int ret = 0;
+        for (int k = 0; k < PTRS_PER_BLOCK; k++) {
+            if (ptrs[k] != 0) {
+                ptrs[k] = ret == 0 ? snap_share(c, ptrs[k]) : 0;
+            }
+            if (ptrs[k] < 0) {
+                ret = ptrs[k];
+                ptrs[k] = 0;
+            }
+        }
+        if (bio_write(ind, ptrs) < 0) {
+            return -EIO;
+        }
+        copy->indirect_ptr[i] = ind;
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+// Drop a snapshot inode's hold on its blocks; the undo of snap_copy_inode()
+static void snap_release_inode(struct meta_batch *b, struct inode *inode) {
+    int ptrs[PTRS_PER_BLOCK];
+
+    for (int i = 0; i < 8; i++) {
+        if (inode->indirect_ptr[i] == 0) {
+            continue;
+        }
+        // An unreadable pointer block leaks what it points at
+        if (bio_read(inode->indirect_ptr[i], ptrs) == BLOCK_SIZE) {
+            int n = 0;
+            for (int k = 0; k < PTRS_PER_BLOCK; k++) {
+                if (ptrs[k] != 0) {
+                    ptrs[n++] = ptrs[k];
+                }
+            }
+            release_blknos(b, ptrs, n);
+        }
+        release_blknos(b, &inode->indirect_ptr[i], 1);
+    }
+
+    int n = 0;
+    for (int i = 0; i < 16; i++) {
+        if (inode->direct_ptr[i] != 0) {
+            ptrs[n++] = inode->direct_ptr[i];
+        }
+    }
+    release_blknos(b, ptrs, n);
+}
+
+/*
+ * Find snapshot id in the chain: its record block in *blk, the record in
+ * *hdr, and the record of the next newer snapshot in *newer, 0 if it is
+ * the newest
+ */
+static int snap_find(uint32_t id, uint32_t *blk, struct snapshot *hdr, uint32_t *newer) {
+    char buf[BLOCK_SIZE];
+
+    *newer = 0;
+    *blk = sb.snap_blk;
+    for (uint32_t n = 0; *blk != 0 && n < sb.max_dnum; n++) {
+        if (bio_read(*blk, buf) < 0) {
+            return -EIO;
+        }
+        memcpy(hdr, buf, sizeof(struct snapshot));
+        if (hdr->magic != SNAP_MAGIC) {
+            return -EIO;
+        }
+        if (hdr->id == id) {
+            return 0;
+        }
+        *newer = *blk;
+        *blk = hdr->prev;
+    }
+    return -ENOENT;
+}
+
+/*
+ * A mounted snapshot holds a read lock on the byte at its id past the end
+ * of the image for as long as it is mounted, and deleting one takes the
+ * write lock there first, so a snapshot in use is refused instead of
+ * freed under its reader. fcntl locks belong to a process, which is what
+ * tells a snapshot mount apart from the live one. type is F_RDLCK,
+ * F_WRLCK or F_UNLCK; -1 if another process holds a conflicting lock.
+ */
+static int snap_hold(uint32_t id, short type) {
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = (off_t)(sb.d_start_blk + sb.max_dnum) * BLOCK_SIZE + id;
+    fl.l_len = 1;
+    return fcntl(dev_fd(), F_SETLK, &fl);
+}
+
+// Copy the frozen tree into a new snapshot and link it in; returns its id
+static int snap_take() {
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    unsigned char ibitmap[BLOCK_SIZE] = {0};
+    char buf[BLOCK_SIZE] = {0};
+    struct snapshot *hdr = (struct snapshot *)buf;
+    uint32_t ino = 0;
+    int ret = 0;
+
+    batch_init(&b);
+    memset(snap_table, 0, sizeof(snap_table));
+    for (ino = 0; ino < sb.max_inum && ret == 0; ino++) {
+        if (ino % INODES_PER_BLOCK == 0 && inode_cache_load(ino) < 0) {
+            ret = -EIO;
+            break;
+        }
+        // Orphans have no name left, so they are not part of the tree
+        pthread_mutex_lock(&ibitmap_lock);
+        int live = get_bitmap(inode_bitmap, ino) && !get_bitmap(orphan_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+        if (!live || !inode_table[ino].valid) {
+            continue;
+        }
+
+        memcpy(&snap_table[ino], &inode_table[ino], sizeof(struct inode));
+        set_bitmap(ibitmap, ino);
+        ret = snap_copy_inode(&snap_table[ino], &c);
+    }
+
+    // The record, the inode bitmap and the inode table copy
+    int blks[2 + SNAP_ITABLE_BLKS];
+    int nblks = 0;
+    while (ret == 0 && nblks < 2 + (int)INODE_TABLE_BLKS) {
+        int blk = alloc_data_blk(&c);
+        if (blk < 0) {
+            ret = blk;
+        } else {
+            blks[nblks++] = blk;
+        }
+    }
+    for (int k = 0; ret == 0 && k < (int)INODE_TABLE_BLKS; k++) {
+        hdr->i_blks[k] = blks[2 + k];
+        if (bio_write(blks[2 + k], &snap_table[k * INODES_PER_BLOCK]) < 0) {
+            ret = -EIO;
+        }
+    }
+    if (ret == 0) {
+        hdr->magic = SNAP_MAGIC;
+        hdr->id = sb.snap_next_id;
+        hdr->prev = sb.snap_blk;
+        hdr->i_bitmap_blk = blks[1];
+        hdr->time = time(NULL);
+        if (bio_write(blks[1], ibitmap) < 0 || bio_write(blks[0], buf) < 0) {
+            ret = -EIO;
+        }
+    }
+    if (ret == 0 && batch_commit(&b) < 0) {
+        ret = -EIO;
+    }
+
+    // Link it in once everything it names is durable
+    if (ret == 0) {
+        sb.snap_blk = blks[0];
+        sb.snap_next_id++;
+        if (sb_update() == 0) {
+            return hdr->id;
+        }
+        sb.snap_blk = hdr->prev;
+        sb.snap_next_id--;
+        ret = -EIO;
+    }
+
+    // Give back what the copies took
+    for (uint32_t i = 0; i < ino && i < sb.max_inum; i++) {
+        if (get_bitmap(ibitmap, i)) {
+            snap_release_inode(&b, &snap_table[i]);
+        }
+    }
+    release_blknos(&b, blks, nblks);
+    batch_commit(&b);
+    return ret;
+}
+
+int rufs_snapshot_create() {
+    if (read_only) {
+        return -EROFS;
+    }
+    if (INODE_TABLE_BLKS > SNAP_ITABLE_BLKS) {
+        return -ENOSPC;
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    freeze_all();
+    int ret = snap_take();
+    thaw_all();
+    pthread_mutex_unlock(&snap_lock);
+    return ret;
+}
+
+int rufs_snapshot_delete(uint32_t id) {
+    struct snapshot hdr;
+    struct meta_batch b;
+    uint32_t blk, newer;
+    char buf[BLOCK_SIZE];
+    unsigned char ibitmap[BLOCK_SIZE];
+
+    if (read_only) {
+        return -EROFS;
+    }
+
+    pthread_mutex_lock(&snap_lock);
+    if (snap_hold(id, F_WRLCK) < 0) {
+        pthread_mutex_unlock(&snap_lock);
+        return -EBUSY;
+    }
+    int ret = snap_find(id, &blk, &hdr, &newer);
+    if (ret == 0 && bio_read(hdr.i_bitmap_blk, ibitmap) < 0) {
+        ret = -EIO;
+    }
+
+    // Unlink first, so a crash part way through only leaks blocks
+    if (ret == 0 && newer != 0) {
+        struct snapshot *next = (struct snapshot *)buf;
+        if (bio_read(newer, buf) < 0) {
+            ret = -EIO;
+        } else {
+            next->prev = hdr.prev;
+            ret = bio_write(newer, buf) < 0 || dev_sync() < 0 ? -EIO : 0;
+        }
+    } else if (ret == 0) {
+        sb.snap_blk = hdr.prev;
+        if (sb_update() < 0) {
+            sb.snap_blk = blk;
+            ret = -EIO;
+        }
+    }
+    if (ret < 0) {
+        snap_hold(id, F_UNLCK);
+        pthread_mutex_unlock(&snap_lock);
+        return ret;
+    }
+
+    batch_init(&b);
+    for (int k = 0; k < (int)INODE_TABLE_BLKS; k++) {
+        struct inode *inodes = (struct inode *)buf;
+        if (bio_read(hdr.i_blks[k], buf) < 0) {
+            continue;
+        }
+        for (int i = 0; i < (int)INODES_PER_BLOCK; i++) {
+            if (get_bitmap(ibitmap, k * INODES_PER_BLOCK + i)) {
+                snap_release_inode(&b, &inodes[i]);
+            }
+        }
+        // One commit per table block, so the discards stay within what a batch keeps
+        batch_commit(&b);
+    }
+    release_blknos(&b, (int *)hdr.i_blks, INODE_TABLE_BLKS);
+    int meta[2] = { hdr.i_bitmap_blk, blk };
+    release_blknos(&b, meta, 2);
+    ret = batch_commit(&b) < 0 ? -EIO : 0;
+    snap_hold(id, F_UNLCK);
+    pthread_mutex_unlock(&snap_lock);
+    return ret;
+}
+
+// Fill req with the snapshot ids, newest first
+static int snap_list(struct rufs_snapshot *req) {
+    struct snapshot hdr;
+    char buf[BLOCK_SIZE];
+
+    pthread_mutex_lock(&snap_lock);
+    req->count = 0;
+    for (uint32_t blk = sb.snap_blk; blk != 0 && req->count < RUFS_SNAP_MAX; blk = hdr.prev) {
+        if (bio_read(blk, buf) < 0) {
+            pthread_mutex_unlock(&snap_lock);
+            return -EIO;
+        }
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (hdr.magic != SNAP_MAGIC) {
+            pthread_mutex_unlock(&snap_lock);
+            return -EIO;
+        }
+        req->ids[req->count++] = hdr.id;
+    }
+    pthread_mutex_unlock(&snap_lock);
+    return 0;
+}
+
+static int snap_mount(uint32_t id) {
+    struct snapshot hdr;
+    uint32_t blk, newer;
+
+    // Held while mounted; closing the image at unmount lets it go
+    if (snap_hold(id, F_RDLCK) < 0) {
+        return -EBUSY;
+    }
+    if (snap_find(id, &blk, &hdr, &newer) < 0 || bio_read(hdr.i_bitmap_blk, inode_bitmap) < 0) {
+        snap_hold(id, F_UNLCK);
+        return -ENOENT;
+    }
+    for (int k = 0; k < (int)INODE_TABLE_BLKS; k++) {
+        if (bio_read(hdr.i_blks[k], &inode_table[k * INODES_PER_BLOCK]) < 0) {
+            snap_hold(id, F_UNLCK);
+            return -EIO;
+        }
+        inode_blk_cached[k] = 1;
+    }
+    memcpy(inode_image, inode_table, sizeof(inode_image));
+    return 0;
+}
+
+/*
+ * Segment cleaner
+ */
+
+/*
+ * Move the blocks of a file that lie in disk blocks [lo, hi) to the log
+ * head; caller holds the inode write lock. Pointer blocks go first, so
+ * the data pass reads them from their new place. Freed pointer and
+ * directory blocks may be in the journal, hence the revoke.
+ */
+static int log_relocate(struct inode *inode, int lo, int hi) {
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    char buf[BLOCK_SIZE];
+    int ret = 0;
+
+    batch_init(&b);
+    if (batch_save_inode(&b, inode) < 0) {
+        return -EIO;
+    }
+    for (int k = 0; k < 8 && ret == 0; k++) {
+        int old = inode->indirect_ptr[k];
+        if (old < lo || old >= hi) {
+            continue;
+        }
+        int blk = alloc_data_blk(&c);
+        if (blk < 0) {
+            ret = blk;
+        } else if (bio_read(old, buf) < 0 || bio_write(blk, buf) < 0) {
+            ret = -EIO;
+        } else {
+            inode->indirect_ptr[k] = blk;
+            seg_own(inode, blk);
+            ret = release_blknos(&b, &old, 1);
+            b.revoke = 1;
+        }
+    }
+
+    for (uint32_t idx = 0; idx < MAX_FILE_BLKS && ret == 0; idx++) {
+        if (idx >= 16 && inode->indirect_ptr[(idx - 16) / PTRS_PER_BLOCK] == 0) {
+            idx += PTRS_PER_BLOCK - 1 - (idx - 16) % PTRS_PER_BLOCK;
+            continue;
+        }
+        int blk = bmap(inode, idx, 0, &c);
+        if (blk < lo || blk >= hi) {
+            continue;
+        }
+        int moved = bmap(inode, idx, BMAP_RELOCATE, &c);
+        if (moved < 0) {
+            ret = moved;
+        } else {
+            ret = bmap_retire(&c, moved, 1);
+            b.revoke |= (inode->type & S_IFDIR) != 0;
+        }
+    }
+
+    if (bmap_done_inode(&c, inode) < 0) {
+        return -EIO;
+    }
+    return ret;
+}
+
+// Fill in the segment summary from the pointers of every inode
+static void seg_owners_build() {
+    int ptrs[PTRS_PER_BLOCK];
+
+    for (uint16_t ino = 0; ino < sb.max_inum; ino++) {
+        pthread_mutex_lock(&ibitmap_lock);
+        int used = get_bitmap(inode_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+
+        struct inode *inode = used ? iget(ino) : NULL;
+        if (inode == NULL) {
+            continue;
+        }
+        ilock_rd(ino);
+        for (int i = 0; inode->valid && i < 16; i++) {
+            seg_own(inode, inode->direct_ptr[i]);
+        }
+        for (int i = 0; inode->valid && i < 8; i++) {
+            if (inode->indirect_ptr[i] == 0) {
+                continue;
+            }
+            seg_own(inode, inode->indirect_ptr[i]);
+            if (bio_read(inode->indirect_ptr[i], ptrs) < 0) {
+                continue;
+            }
+            for (int k = 0; k < (int)PTRS_PER_BLOCK; k++) {
+                seg_own(inode, ptrs[k]);
+            }
+        }
+        iunlock(ino);
+        iput_n(ino, 1);
+    }
+    seg_owners_built = 1;
+}
+
+// Empty the non-empty segment with the fewest live blocks; 1 if it is free now
+static int log_clean_one() {
+    int victim = -1, best = SEG_BLKS;
+
+    pthread_mutex_lock(&dbitmap_lock);
+    for (int seg = 0; seg < sb.max_dnum / SEG_BLKS; seg++) {
+        int live = seg_live(seg);
+        if (seg != log_seg && live > 0 && live < best) {
+            victim = seg;
+            best = live;
+        }
+    }
+    pthread_mutex_unlock(&dbitmap_lock);
+    if (victim < 0) {
+        return 0;
+    }
+
+    if (!seg_owners_built) {
+        seg_owners_build();
+    }
+
+    // Take the victim's owners; a file given a block there from now on marks itself again
+    unsigned char owners[MAX_INUM / 8];
+    for (int i = 0; i < MAX_INUM / 8; i++) {
+        owners[i] = __atomic_exchange_n(&seg_owners[victim][i], 0, __ATOMIC_RELAXED);
+    }
+
+    int lo = sb.d_start_blk + victim * SEG_BLKS;
+    for (uint16_t ino = 0; ino < sb.max_inum; ino++) {
+        if (!get_bitmap(owners, ino)) {
+            continue;
+        }
+        pthread_mutex_lock(&ibitmap_lock);
+        int used = get_bitmap(inode_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+
+        struct inode *inode = used ? iget(ino) : NULL;
+        if (inode == NULL) {
+            continue;
+        }
+        ilock_wr(ino);
+        int ret = inode->valid ? log_relocate(inode, lo, lo + SEG_BLKS) : 0;
+        iunlock(ino);
+        iput_n(ino, 1);
+        if (ret < 0) {
+            for (int i = 0; i < MAX_INUM / 8; i++) {
+                __atomic_fetch_or(&seg_owners[victim][i], owners[i], __ATOMIC_RELAXED);
+            }
+            return ret;
+        }
+    }
+
+    pthread_mutex_lock(&dbitmap_lock);
+    int live = seg_live(victim);
+    pthread_mutex_unlock(&dbitmap_lock);
+    return live == 0;
+}
+
+// Clean until LOG_CLEAN_HIGH segments are free or no progress is made
+static void log_clean() {
+    for (;;) {
+        pthread_mutex_lock(&dbitmap_lock);
+        int nfree = seg_free_count();
+        pthread_mutex_unlock(&dbitmap_lock);
+
+        if (nfree >= LOG_CLEAN_HIGH || log_clean_one() <= 0) {
+            return;
+        }
+    }
+}
+
+/*
+ * Free an orphan: its blocks, then the inode itself, in one transaction
+ * that also clears its orphan bit. Caller holds the inode write lock and
+ * the only pin.
+ */
+static int orphan_free(struct inode *inode) {
+    struct meta_batch b;
+    uint16_t ino = inode->ino;
+
+    batch_init(&b);
+    if (file_free_from(&b, inode, 0) < 0) {
+        batch_abort(&b);
+        return -EIO;
+    }
+    // Directory blocks went through the journal
+    if (inode->type & S_IFDIR) {
+        b.revoke = 1;
+    }
+
+    inode->valid = 0;
+    inode->size = 0;
+    inode->link = 0;
+    memset(&inode_wstate[ino], 0, sizeof(struct inode_wstate));
+    if (batch_put_inode(&b, inode) < 0) {
+        batch_abort(&b);
+        return -EIO;
+    }
+
+    pthread_mutex_lock(&ibitmap_lock);
+    unset_bitmap(inode_bitmap, ino);
+    unset_bitmap(orphan_bitmap, ino);
+    pthread_mutex_unlock(&ibitmap_lock);
+    batch_stage(&b, sb.i_bitmap_blk, inode_bitmap);
+    if (sb.o_bitmap_blk) {
+        batch_stage(&b, sb.o_bitmap_blk, orphan_bitmap);
+    }
+
+    return batch_commit(&b) < 0 ? -EIO : 0;
+}
+
+// Free every orphan nothing holds any more; those still open wait for their last iput
+static void orphan_reclaim() {
+    for (uint16_t ino = 0; ino < sb.max_inum; ino++) {
+        pthread_mutex_lock(&ibitmap_lock);
+        int orphan = get_bitmap(orphan_bitmap, ino);
+        pthread_mutex_unlock(&ibitmap_lock);
+
+        struct inode *inode = orphan ? iget(ino) : NULL;
+        if (inode == NULL) {
+            continue;
+        }
+        ilock_wr(ino);
+        pthread_mutex_lock(&icache_lock);
+        int held = inode_pins[ino] > 1;
+        pthread_mutex_unlock(&icache_lock);
+        if (!held && orphan_free(inode) < 0) {
+            fprintf(stderr, "orphan_reclaim: Failed to free inode %d\n", ino);
+        }
+        iunlock(ino);
+
+        // Our own pin, dropped without iput_n's orphan check
+        pthread_mutex_lock(&icache_lock);
+        inode_pins[ino]--;
+        pthread_mutex_unlock(&icache_lock);
+    }
+}
+
+/*
+ * Scrubbing. With scrub=<n> the worker wakes every SCRUB_TICK_MS and reads
+ * its share of n blocks a second, going round the blocks that have a
+ * checksum, so a block gone bad is found even if nothing reads it.
+ * bio_read() reports each one; scrub_bad counts them, and RUFS_IOC_SCRUB
+ * hands the counts out.
+ */
+#define SCRUB_TICK_MS 100
+
+static uint32_t scrub_next;
+static uint32_t scrub_scanned;
+static uint32_t scrub_bad;
+
+static void scrub_run() {
+    uint32_t nblks = sb.d_start_blk + sb.max_dnum;
+    uint64_t budget = (uint64_t)rufs_options.scrub * SCRUB_TICK_MS / 1000;
+    char buf[BLOCK_SIZE];
+
+    budget = budget ? budget : 1;
+    for (uint32_t seen = 0; seen < nblks && budget > 0; seen++) {
+        uint32_t blk = scrub_next;
+        scrub_next = (scrub_next + 1) % nblks;
+        if (__atomic_load_n(&blk_sum[blk], __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+        budget--;
+        __atomic_add_fetch(&scrub_scanned, 1, __ATOMIC_RELAXED);
+        if (bio_read(blk, buf) < 0) {
+            __atomic_add_fetch(&scrub_bad, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// RUFS_IOC_SCRUB, on any open file or directory
+static int scrub_ioctl(struct rufs_scrub *req) {
+    req->scanned = __atomic_load_n(&scrub_scanned, __ATOMIC_RELAXED);
+    req->bad = __atomic_load_n(&scrub_bad, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void *worker_main(void *arg) {
+    pthread_mutex_lock(&work_lock);
+    while (!work_stop) {
+        if (!work_pending && rufs_options.scrub && sb.c_start_blk) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += SCRUB_TICK_MS * 1000000L;
+            ts.tv_sec += ts.tv_nsec / 1000000000L;
+            ts.tv_nsec %= 1000000000L;
+            if (pthread_cond_timedwait(&work_cond, &work_lock, &ts) == ETIMEDOUT) {
+                work_pending |= WORK_SCRUB;
+            }
+            continue;
+        }
+        if (!work_pending) {
+            pthread_cond_wait(&work_cond, &work_lock);
+            continue;
+        }
+        int work = work_pending;
+        work_pending = 0;
+        pthread_mutex_unlock(&work_lock);
+
+        if (work & WORK_RECLAIM) {
+            orphan_reclaim();
+        }
+        if ((work & WORK_CLEAN) && rufs_options.log) {
+            log_clean();
+        }
+        if (work & WORK_DISCARD) {
+            discard_run();
+        }
+        if (work & WORK_SCRUB) {
+            scrub_run();
+        }
+        pthread_mutex_lock(&work_lock);
+    }
+    pthread_mutex_unlock(&work_lock);
+    return NULL;
+}
+
+/*
+ * Start the log head over and start the worker; once the bitmaps are
+ * loaded. Its first pass frees orphans left by a crash and, in log mode,
+ * cleans.
+ */
+static void worker_start() {
+    pthread_mutex_lock(&dbitmap_lock);
+    log_seg = -1;
+    log_off = 0;
+    pthread_mutex_unlock(&dbitmap_lock);
+
+    if (worker_running) {
+        return;
+    }
+    work_stop = 0;
+    work_pending = WORK_RECLAIM | WORK_CLEAN;
+    worker_running = pthread_create(&worker, NULL, worker_main, NULL) == 0;
+}
+
+static void worker_stop() {
+    if (!worker_running) {
+        return;
+    }
+    pthread_mutex_lock(&work_lock);
+    work_stop = 1;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_lock);
+    pthread_join(worker, NULL);
+    worker_running = 0;
+}
+
+/*
+ * Make one file durable; caller holds the inode write lock. The inode is
+ * committed if it changed, but datasync leaves out an inode whose only
+ * change is timestamps. The flush itself is one fdatasync of the disk
+ * image, the journal commit's, shared with concurrent committers; being
+ * of the one backing file, it writes back whatever else is dirty in the
+ * image too. A file with nothing new since its last fsync skips it, as
+ * everything committed through the journal is durable already.
+ */
+static int file_fsync(struct inode *inode, int datasync) {
+    struct inode_wstate *ws = &inode_wstate[inode->ino];
+
+    if ((ws->dirty & INODE_DIRTY_META) || (ws->dirty && !datasync)) {
+        if (writei(inode->ino, inode) < 0) {
+            return -EIO;
+        }
+        ws->dirty = 0;
+        if (sb.j_blks) {
+            ws->unsynced = 0;
+            return 0;
+        }
+    }
+    if (!ws->unsynced && sb.j_blks) {
+        return 0;
+    }
+    if (journal_sync() < 0) {
+        return -EIO;
+    }
+    ws->unsynced = 0;
+    return 0;
+}
+
+/*
+ * libfuse copies the bufvec out after we return, with the inode lock
+ * gone, and by then a block a map pointed at may have been freed and
+ * reused: by a truncate, a write moving it, the cleaner. So this path
+ * always reads into memory under the lock; rufs_ll_read() can splice, as
+ * it replies before unlocking.
+ */
+static int rufs_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct rufs_fh tmp;
+
+    struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+    if (fh == NULL) {
+        return -ENOENT;
+    }
+
+    ilock_rd(fh->inode->ino);
+    *bufp = file_map_mem(fh->inode, size, offset);
+    if (*bufp != NULL) {
+        fh_readahead(fh, offset, fuse_buf_size(*bufp));
+    }
+    iunlock(fh->inode->ino);
+    fh_accessed(fh, fh == &tmp);
+
+    if (fh == &tmp) {
+        fh_close(&tmp);
+    }
+    return *bufp != NULL ? 0 : -EIO;
+}
+
+static int rufs_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi) {
+    struct rufs_fh tmp;
+
+    struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+    if (fh == NULL) {
+        return -ENOENT;
+    }
+
+    ilock_wr(fh->inode->ino);
+    ssize_t ret = file_write_buf(fh->inode, buf, offset);
+    if (fh == &tmp && fh_flush(&tmp) < 0) {
+        ret = -EIO;
+    }
+    iunlock(fh->inode->ino);
+
+    if (fh == &tmp) {
+        fh_close(&tmp);
+    }
+    if (ret == 0 && fuse_buf_size(buf) > 0) {
+        return -ENOSPC;
+    }
+    return ret;
+}
+
+static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    struct rufs_fh tmp;
+
+    struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+    if (fh == NULL) {
+        return -1;
+    }
+
+    if ((fh->inode->type & S_IFREG) == 0) {
+        fprintf(stderr, "Error: Path %s is not a regular file\n", path);
+        if (fh == &tmp) {
+            fh_close(&tmp);
+        }
+        return -1;
+    }
+
+    ilock_wr(fh->inode->ino);
+    int ret = file_write(fh->inode, buffer, size, offset);
+
+    // Without an open handle the inode goes straight back to disk
+    if (fh == &tmp && fh_flush(&tmp) < 0) {
+        fprintf(stderr, "Error: Failed to write inode %d\n", tmp.inode->ino);
+        ret = -1;
+    }
+    iunlock(fh->inode->ino);
+
+    if (fh == &tmp) {
+        fh_close(&tmp);
+    }
+    return ret;
+}
+
+static int rufs_flush(const char *path, struct fuse_file_info *fi) {
+    if (fi == NULL || fi->fh == 0) {
+        return 0;
+    }
+
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi->fh;
+    ilock_wr(fh->inode->ino);
+    int ret = fh_flush(fh);
+    iunlock(fh->inode->ino);
+    return ret;
+}
+
+static int rufs_release(const char *path, struct fuse_file_info *fi) {
+    if (fi == NULL || fi->fh == 0) {
+        return 0;
+    }
+
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi->fh;
+    ilock_wr(fh->inode->ino);
+    int ret = fh_flush(fh);
+    iunlock(fh->inode->ino);
+
+    fh_close(fh);
+    free(fh);
+    fi->fh = 0;
+    return ret;
+}
+
+static int rufs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    struct rufs_fh tmp;
+
+    struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+    if (fh == NULL) {
+        return -ENOENT;
+    }
+
+    ilock_wr(fh->inode->ino);
+    int ret = file_fsync(fh->inode, datasync);
+    iunlock(fh->inode->ino);
+
+    if (fh == &tmp) {
+        fh_close(&tmp);
+    }
+    return ret;
+}
+
+static int rufs_unlink(const char *path) {
+    return unlink_node(path, 0);
+}
+
+static int rufs_truncate(const char *path, off_t size) {
+    struct inode inode;
+
+    if (get_node_by_path(path, 0, &inode) < 0) {
+        return -ENOENT;
+    }
+    if ((inode.type & S_IFREG) == 0) {
+        return -EISDIR;
+    }
+
+    struct inode *cached = iget(inode.ino);
+    if (cached == NULL) {
+        return -EIO;
+    }
+    ilock_wr(inode.ino);
+    int ret = file_truncate(cached, size);
+    iunlock(inode.ino);
+    iput(cached);
+
+    return ret;
+}
+
+/*
+ * Set the access and modification times of ino; NULL leaves one alone.
+ * The change time always moves to now.
+ */
+static int inode_set_times(uint16_t ino, const struct timespec *atime, const struct timespec *mtime) {
+    if (read_only) {
+        return -EROFS;
+    }
+
+    struct inode *inode = iget(ino);
+    if (inode == NULL) {
+        return -ENOENT;
+    }
+
+    ilock_wr(ino);
+    if (atime != NULL) {
+        inode->vstat.st_atim = *atime;
+    }
+    if (mtime != NULL) {
+        inode->vstat.st_mtim = *mtime;
+    }
+    inode_touch(inode, RUFS_CTIME);
+    int ret = writei(ino, inode) < 0 ? -EIO : 0;
+    if (ret == 0) {
+        inode_wstate[ino].dirty = 0;
+    }
+    iunlock(ino);
+
+    iput(inode);
+    return ret;
+}
+
+static int rufs_utimens(const char *path, const struct timespec tv[2]) {
+    struct inode inode;
+    struct timespec times[2];
+
+    if (get_node_by_path(path, 0, &inode) < 0) {
+        return -ENOENT;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        times[i] = tv[i];
+        if (tv[i].tv_nsec == UTIME_NOW) {
+            clock_gettime(CLOCK_REALTIME, &times[i]);
+        }
+    }
+    return inode_set_times(inode.ino, tv[0].tv_nsec == UTIME_OMIT ? NULL : &times[0],
+                           tv[1].tv_nsec == UTIME_OMIT ? NULL : &times[1]);
+}
+
+/*
+ * ioctl interface for FUSE clients, issued on an open directory
+ */
+static int bulk_ioctl(uint16_t dir, struct rufs_bulk_create *req) {
+    if (req->count > RUFS_BULK_MAX) {
+        return -EINVAL;
+    }
+
+    // Split the packed name buffer
+    const char *names[RUFS_BULK_MAX];
+    size_t pos = 0;
+    for (uint32_t i = 0; i < req->count; i++) {
+        size_t len = strnlen(req->names + pos, RUFS_BULK_NAMES_LEN - pos);
+        if (pos + len >= RUFS_BULK_NAMES_LEN) {
+            return -EINVAL;
+        }
+        names[i] = req->names + pos;
+        pos += len + 1;
+    }
+
+    int ret = create_bulk_in(dir, names, req->count, req->mode & 07777);
+    if (ret < 0) {
+        return ret;
+    }
+    req->count = ret;
+    return 0;
+}
+
+// RUFS_IOC_SEEK on an open file
+static int seek_ioctl(struct inode *inode, struct rufs_seek *req) {
+    if (req->whence != SEEK_DATA && req->whence != SEEK_HOLE) {
+        return -EINVAL;
+    }
+
+    ilock_rd(inode->ino);
+    off_t ret = file_seek(inode, req->offset, req->whence);
+    iunlock(inode->ino);
+    if (ret < 0) {
+        return ret;
+    }
+    req->offset = ret;
+    return 0;
+}
+
+// Copy a range into the file dst from the file the request names
+static int copy_ioctl(uint16_t dst, struct rufs_copy_range *req) {
+    struct inode src;
+
+    req->src[RUFS_COPY_PATH_LEN - 1] = '\0';
+    if (get_node_by_path(req->src, 0, &src) < 0) {
+        return -ENOENT;
+    }
+    ssize_t ret = copy_range_ino(src.ino, req->src_offset, dst, req->dst_offset, req->len);
+    if (ret < 0) {
+        return ret;
+    }
+    req->len = ret;
+    return 0;
+}
+
+// RUFS_IOC_SNAPSHOT, on any open file or directory
+static int snap_ioctl(struct rufs_snapshot *req) {
+    if (req->op == RUFS_SNAP_CREATE) {
+        int id = rufs_snapshot_create();
+        if (id < 0) {
+            return id;
+        }
+        req->id = id;
+        return 0;
+    }
+    if (req->op == RUFS_SNAP_DELETE) {
+        return rufs_snapshot_delete(req->id);
+    }
+    if (req->op == RUFS_SNAP_LIST) {
+        return snap_list(req);
+    }
+    return -EINVAL;
+}
+
+/*
+ * RUFS_IOC_COMPRESS, on an open file or directory. The cached inode is
+ * changed, so handles already open see the new setting.
+ */
+static int compress_ioctl(uint16_t ino, int32_t *on) {
+    struct inode *inode = iget(ino);
+    if (inode == NULL) {
+        return -ENOENT;
+    }
+
+    int ret = 0;
+    ilock_wr(ino);
+    int cur = (inode->vstat.st_rdev & RUFS_FL_COMPRESS) != 0;
+    if (*on >= 0 && !*on != !cur) {
+        if (read_only) {
+            ret = -EROFS;
+        } else if ((inode->type & S_IFREG) && (inode->size > 0 || inode->vstat.st_blocks > 0)) {
+            // Its blocks are laid out for the old setting
+            ret = -EBUSY;
+        } else {
+            inode->vstat.st_rdev ^= RUFS_FL_COMPRESS;
+            inode_touch(inode, RUFS_CTIME);
+            ret = writei(ino, inode) < 0 ? -EIO : 0;
+            if (ret == 0) {
+                inode_wstate[ino].dirty = 0;
+                cur = !cur;
+            }
+        }
+    }
+    iunlock(ino);
+    iput(inode);
+
+    *on = cur;
+    return ret;
+}
+
+static int rufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi, unsigned int flags, void *data) {
+    struct inode dir_inode;
+
+    if ((unsigned int)cmd == RUFS_IOC_SNAPSHOT) {
+        return snap_ioctl(data);
+    }
+    if ((unsigned int)cmd == RUFS_IOC_COMPRESS) {
+        if (get_node_by_path(path, 0, &dir_inode) < 0) {
+            return -ENOENT;
+        }
+        return compress_ioctl(dir_inode.ino, data);
+    }
+    if ((unsigned int)cmd == RUFS_IOC_DEDUP) {
+        return dedup_all(data);
+    }
+    if ((unsigned int)cmd == RUFS_IOC_SCRUB) {
+        return scrub_ioctl(data);
+    }
+    if ((unsigned int)cmd == RUFS_IOC_SEEK || (unsigned int)cmd == RUFS_IOC_COPY_RANGE) {
+        struct rufs_fh tmp;
+        struct rufs_fh *fh = fh_lookup(path, fi, &tmp);
+        if (fh == NULL) {
+            return -ENOENT;
+        }
+        int ret = (unsigned int)cmd == RUFS_IOC_SEEK ? seek_ioctl(fh->inode, data) : copy_ioctl(fh->inode->ino, data);
+        if (fh == &tmp) {
+            fh_close(&tmp);
         }
+        return ret;
+    }
+    if ((unsigned int)cmd != RUFS_IOC_BULK_CREATE) {
+        return -ENOTTY;
+    }
+    if (get_node_by_path(path, 0, &dir_inode) < 0) {
+        return -ENOENT;
     }
 
-    return NULL;
+    return bulk_ioctl(dir_inode.ino, data);
 }
 
-static void rufs_destroy(void *userdata) {
-    char buffer[BLOCK_SIZE];
-    struct inode inode_buffer;
+static struct fuse_operations rufs_ope = {
+	.init		= rufs_init,
+	.destroy	= rufs_destroy,
 
-    for (int i = 0; i < sb.max_inum; i++) {
-        uint32_t blk_num = sb.i_start_blk + (i * sizeof(struct inode)) / BLOCK_SIZE;
-        uint32_t offset = (i * sizeof(struct inode)) % BLOCK_SIZE;
+	.getattr	= rufs_getattr,
+	.readdir	= rufs_readdir,
+	.opendir	= rufs_opendir,
+	.releasedir	= rufs_releasedir,
+	.mkdir		= rufs_mkdir,
+	.rmdir		= rufs_rmdir,
 
-        if (bio_read(blk_num, buffer) < 0) {
-            continue;
-        }
+	.create		= rufs_create,
+	.open		= rufs_open,
+	.read 		= rufs_read,
+	.write		= rufs_write,
+	.read_buf	= rufs_read_buf,
+	.write_buf	= rufs_write_buf,
+	.unlink		= rufs_unlink,
 
-        memcpy(&inode_buffer, buffer + offset, sizeof(struct inode));
-        if (inode_buffer.valid) {
-            if (inode_buffer.indirect_ptr[0] != 0) {
-                char indirect_block_buf[BLOCK_SIZE];
-                if (bio_read(inode_buffer.indirect_ptr[0], indirect_block_buf) < 0) {
-                } else {
-                    memset(indirect_block_buf, 0, BLOCK_SIZE);
-                    bio_write(inode_buffer.indirect_ptr[0], indirect_block_buf); 
-                }
-            }
-        }
-    }
+	.truncate   = rufs_truncate,
+	.flush      = rufs_flush,
+	.fsync      = rufs_fsync,
+	.utimens    = rufs_utimens,
+	.release	= rufs_release,
 
-    if (bio_read(sb.d_bitmap_blk, buffer) < 0) {
-        fprintf(stderr, "rufs_destroy: Failed to read data block bitmap\n");
-    } else {
-        memset(buffer, 0, BLOCK_SIZE);
-        bio_write(sb.d_bitmap_blk, buffer);
-    }
+	.ioctl		= rufs_ioctl
+};
 
-    if (bio_read(sb.i_bitmap_blk, buffer) < 0) {
-        fprintf(stderr, "rufs_destroy: Failed to read inode bitmap\n");
-    } else {
-        memset(buffer, 0, BLOCK_SIZE);
-        bio_write(sb.i_bitmap_blk, buffer);
+/*
+ * Low-level FUSE frontend. The kernel passes node ids instead of paths, so
+ * no operation rebuilds or walks a path. A node id is the rufs inode
+ * number plus one, because FUSE reserves 1 for the root. Every entry
+ * handed to the kernel pins its inode until the matching forget.
+ */
+#define LL_INO(nodeid) ((uint16_t)((nodeid) - 1))
+#define LL_NODEID(ino) ((fuse_ino_t)(ino) + 1)
+
+static int ll_getinode(fuse_ino_t nodeid, struct inode *inode) {
+    uint16_t ino = LL_INO(nodeid);
+
+    if (ino >= MAX_INUM) {
+        return -ENOENT;
     }
+    ilock_rd(ino);
+    int ret = readi(ino, inode);
+    iunlock(ino);
+    return ret < 0 ? -EIO : 0;
+}
 
-    dev_close();
+static void ll_stat(const struct inode *inode, struct stat *st) {
+    inode_to_stat(inode, st);
+    st->st_ino = LL_NODEID(inode->ino);
 }
 
-static int rufs_getattr(const char *path, struct stat *stbuf) {
+// Fill an entry reply for ino and take the kernel's reference on it
+static int ll_entry(uint16_t ino, struct fuse_entry_param *e) {
     struct inode inode;
 
-    // Step 1: Call get_node_by_path() to get inode from path
-    if (get_node_by_path(path, 0, &inode) < 0) {
-        return -1;
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (ll_getinode(LL_NODEID(ino), &inode) < 0 || iget(ino) == NULL) {
+        return -EIO;
     }
 
-    // Step 2: Fill attributes of file into stbuf from inode
-    memset(stbuf, 0, sizeof(struct stat));
-    stbuf->st_ino = inode.ino;
-    stbuf->st_mode = inode.type;
-    stbuf->st_nlink = inode.link;
-    stbuf->st_size = inode.size;
-    stbuf->st_uid = getuid();
-    stbuf->st_gid = getgid();
-    stbuf->st_blksize = BLOCK_SIZE;
-    stbuf->st_blocks = (inode.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    stbuf->st_mtime = time(NULL);
-
+    e->ino = LL_NODEID(ino);
+    ll_stat(&inode, &e->attr);
+    e->attr_timeout = rufs_options.attr_timeout;
+    e->entry_timeout = rufs_options.entry_timeout;
     return 0;
 }
 
+static void rufs_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    rufs_init(conn);
+}
 
-static int rufs_opendir(const char *path, struct fuse_file_info *fi) {
-    struct inode inode;
+static void rufs_ll_destroy(void *userdata) {
+    rufs_destroy(userdata);
+}
 
-    if (get_node_by_path(path, 0, &inode) < 0) {
-        return -1;
+static void rufs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    struct fuse_entry_param e;
+    struct dirent entry;
+    uint16_t dir = LL_INO(parent);
+
+    ilock_rd(dir);
+    int ret = dir_find(dir, name, strlen(name), &entry);
+    iunlock(dir);
+    if (ret < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
 
-    if ((inode.type & S_IFDIR) == 0) {
-        return -1;
+    ret = ll_entry(entry.ino, &e);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_entry(req, &e);
     }
-
-    return 0;
 }
 
+static void rufs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    iput_n(LL_INO(ino), nlookup);
+    fuse_reply_none(req);
+}
 
-static int rufs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-    struct inode dir_inode;
-
-    // Step 1: Call get_node_by_path() to get inode from path
-    if (get_node_by_path(path, 0, &dir_inode) < 0) {
-        return -1;
-    }
-
-    if ((dir_inode.type & S_IFDIR) == 0) {
-        return -ENOTDIR;
+static void rufs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets) {
+    for (size_t i = 0; i < count; i++) {
+        iput_n(LL_INO(forgets[i].ino), forgets[i].nlookup);
     }
+    fuse_reply_none(req);
+}
 
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
-    for (int i = 0; i < 16 && dir_inode.direct_ptr[i] != 0; i++) {
-        char block_buf[BLOCK_SIZE];
-        if (bio_read(dir_inode.direct_ptr[i], block_buf) < 0) {
-            return -1; 
-        }
-
-        struct dirent *entry = (struct dirent *)block_buf;
-        int entries_per_block = BLOCK_SIZE / sizeof(struct dirent);
+static void rufs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct inode inode;
+    struct stat st;
 
-        // Iterate through the directory entries in this block
-        for (int j = 0; j < entries_per_block; j++) {
-            if (entry[j].valid == 1) {
-                filler(buffer, entry[j].name, NULL, 0);
-            }
-        }
+    if (ll_getinode(ino, &inode) < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
-
-    return 0;
+    ll_stat(&inode, &st);
+    fuse_reply_attr(req, &st, rufs_options.attr_timeout);
 }
 
-static int rufs_mkdir(const char *path, mode_t mode) {
-    char parent_path[PATH_MAX];
-    char dir_name[NAME_LEN];
-    struct inode parent_inode;
+/*
+ * Size and timestamps can be changed; other attribute changes are accepted
+ * but not applied. With the writeback cache this is also how the kernel
+ * hands back the size and mtime it has been keeping.
+ */
+static void rufs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    struct timespec now, *atime = NULL, *mtime = NULL;
+
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        uint16_t file = LL_INO(ino);
+        struct inode *inode = iget(file);
+        if (inode == NULL) {
+            fuse_reply_err(req, ENOENT);
+            return;
+        }
 
-    // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    strncpy(parent_path, path, PATH_MAX);
-    strncpy(dir_name, path, NAME_LEN);
-    char *parent_dir = dirname(parent_path);
-    char *base_name = basename(dir_name);
+        ilock_wr(file);
+        int ret = (inode->type & S_IFREG) ? file_truncate(inode, attr->st_size) : -EISDIR;
+        iunlock(file);
+        iput(inode);
 
-    if (get_node_by_path(parent_dir, 0, &parent_inode) < 0) {
-        return -1;
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
     }
 
-    if ((parent_inode.type & S_IFDIR) == 0) {
-        return -1;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (to_set & FUSE_SET_ATTR_ATIME) {
+        atime = (to_set & FUSE_SET_ATTR_ATIME_NOW) ? &now : &attr->st_atim;
     }
-
-    int new_ino = get_avail_ino();
-    if (new_ino < 0) {
-        return -1; 
+    if (to_set & FUSE_SET_ATTR_MTIME) {
+        mtime = (to_set & FUSE_SET_ATTR_MTIME_NOW) ? &now : &attr->st_mtim;
     }
 
-    if (dir_add(parent_inode, new_ino, base_name, strlen(base_name)) < 0) {
-        return -1;
+    if (atime != NULL || mtime != NULL) {
+        int ret = inode_set_times(LL_INO(ino), atime, mtime);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
     }
+    rufs_ll_getattr(req, ino, fi);
+}
 
-    struct inode new_dir_inode;
-    memset(&new_dir_inode, 0, sizeof(struct inode));
-    new_dir_inode.ino = new_ino;
-    new_dir_inode.valid = 1;
-    new_dir_inode.size = 0;
-    new_dir_inode.type = S_IFDIR | mode;
-    new_dir_inode.link = 2;
-    memset(new_dir_inode.direct_ptr, 0, sizeof(new_dir_inode.direct_ptr));
-    memset(new_dir_inode.indirect_ptr, 0, sizeof(new_dir_inode.indirect_ptr));
+static void rufs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct inode inode;
 
-    if (writei(new_ino, &new_dir_inode) < 0) {
-        return -1;
+    if (ll_getinode(ino, &inode) < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if ((inode.type & S_IFDIR) == 0) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
     }
 
-    return 0;
+    fi->fh = inode.ino;
+    fuse_reply_open(req, fi);
 }
 
+// Collects readdir entries into a reply buffer through the dir_fill() filler
+struct ll_dirbuf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+};
 
-//skip
-static int rufs_rmdir(const char *path) {return 0;}
-static int rufs_releasedir(const char *path, struct fuse_file_info *fi) {return 0;}
+static int ll_filler(void *buf, const char *name, const struct stat *st, off_t off) {
+    struct ll_dirbuf *d = buf;
+    struct stat entry_st = *st;
 
-static int rufs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    char parent_path[PATH_MAX];
-    char file_name[NAME_LEN];
-    struct inode parent_inode;
+    entry_st.st_ino = LL_NODEID(st->st_ino);
+    size_t len = fuse_add_direntry(d->req, d->buf + d->used, d->size - d->used, name, &entry_st, off);
+    if (len > d->size - d->used) {
+        return 1;
+    }
+    d->used += len;
+    return 0;
+}
 
-    strncpy(parent_path, path, PATH_MAX);
-    strncpy(file_name, path, NAME_LEN);
-    char *parent_dir = dirname(parent_path);
-    char *base_name = basename(file_name);
+static void rufs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct ll_dirbuf d = { req, malloc(size), size, 0 };
 
-    if (get_node_by_path(parent_dir, 0, &parent_inode) < 0) {
-        return -1;
+    if (d.buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    if ((parent_inode.type & S_IFDIR) == 0) {
-        return -1;
-    }
+    ilock_rd(fi->fh);
+    int ret = dir_fill(fi->fh, &d, ll_filler, off);
+    iunlock(fi->fh);
 
-    int new_ino = get_avail_ino();
-    if (new_ino < 0) {
-        return -1;
+    if (ret < 0) {
+        fuse_reply_err(req, ret == -1 ? EIO : -ret);
+    } else {
+        fuse_reply_buf(req, d.buf, d.used);
     }
+    free(d.buf);
+}
 
-    if (dir_add(parent_inode, new_ino, base_name, strlen(base_name)) < 0) {
-        return -1;
-    }
+static void rufs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, 0);
+}
 
-    // Step 5: Update inode for target file
-    struct inode new_file_inode;
-    memset(&new_file_inode, 0, sizeof(struct inode));
-    new_file_inode.ino = new_ino;
-    new_file_inode.valid = 1;
-    new_file_inode.size = 0;
-    new_file_inode.type = S_IFREG | mode;
-    new_file_inode.link = 1;
-    memset(new_file_inode.direct_ptr, 0, sizeof(new_file_inode.direct_ptr));
-    memset(new_file_inode.indirect_ptr, 0, sizeof(new_file_inode.indirect_ptr));
+static void rufs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    struct fuse_entry_param e;
 
-    if (writei(new_ino, &new_file_inode) < 0) {
-        return -1;
+    int ino = create_in(LL_INO(parent), name, S_IFDIR | mode, 2);
+    if (ino < 0) {
+        fuse_reply_err(req, -ino);
+        return;
     }
 
-    return 0;
+    int ret = ll_entry(ino, &e);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
 }
 
-static int rufs_open(const char *path, struct fuse_file_info *fi) {
-    struct inode file_inode;
+static void rufs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    struct fuse_entry_param e;
 
-    // Step 1: Call get_node_by_path() to get inode from path
-    if (get_node_by_path(path, 0, &file_inode) < 0) {
-        return -1;
+    int ino = create_in(LL_INO(parent), name, S_IFREG | mode, 1);
+    if (ino < 0) {
+        fuse_reply_err(req, -ino);
+        return;
     }
 
-    if ((file_inode.type & S_IFREG) == 0) {
-        return -1; 
+    int ret = ll_entry(ino, &e);
+    if (ret == 0) {
+        ret = fh_store(fi, ino);
+    }
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_create(req, &e, fi);
     }
-
-    return 0;
 }
 
-static int rufs_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    struct inode file_inode;
+static void rufs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    struct inode inode;
 
-    // Step 1: Call get_node_by_path() to get inode from path
-    if (get_node_by_path(path, 0, &file_inode) < 0) {
-        fprintf(stderr, "Error: Invalid path %s\n", path);
-        return -1;
+    if (ll_getinode(ino, &inode) < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
     }
-
-    fprintf(stderr, "[DEBUG] rufs_read: Inode info - ino: %d, size: %u, type: %x\n",
-            file_inode.ino, file_inode.size, file_inode.type);
-
-    // Ensure the inode represents a regular file
-    if ((file_inode.type & S_IFREG) == 0) {
-        fprintf(stderr, "Error: Path %s is not a regular file\n", path);
-        return -1;
+    if ((inode.type & S_IFREG) == 0) {
+        fuse_reply_err(req, EISDIR);
+        return;
     }
 
-    // Validate offset
-    if (offset >= file_inode.size) {
-        fprintf(stderr, "[DEBUG] rufs_read: Offset %lu beyond file size %u\n", offset, file_inode.size);
-        return 0; // No data to read
+    fi->keep_cache = rufs_options.keep_cache;
+    int ret = fh_store(fi, inode.ino);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_open(req, fi);
     }
+}
 
-    // Step 2: Based on size and offset, read its data blocks from disk
-    size_t bytes_read = 0;
-    size_t bytes_to_read = size;
-    off_t current_offset = offset;
-    char block_buf[BLOCK_SIZE];
+static void rufs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi->fh;
 
-    for (int i = 0; i < 16 && bytes_to_read > 0 && current_offset < file_inode.size; i++) {
-        if (file_inode.direct_ptr[i] == 0) {
-            fprintf(stderr, "[DEBUG] rufs_read: Direct pointer %d is 0, stopping read.\n", i);
-            break;
-        }
+    // The reply is spliced before the lock is dropped
+    ilock_rd(fh->inode->ino);
+    int mem = file_read_mem(fh->inode);
+    struct fuse_bufvec *bufv = mem ? file_map_mem(fh->inode, size, off) : file_map(fh->inode, size, off, 0);
+    if (bufv == NULL) {
+        fuse_reply_err(req, mem ? EIO : ENOMEM);
+    } else {
+        fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        fh_readahead(fh, off, fuse_buf_size(bufv));
+    }
+    iunlock(fh->inode->ino);
+    if (mem && bufv != NULL) {
+        free(bufv->buf[0].mem);
+    }
+    free(bufv);
+    fh_accessed(fh, 0);
+}
 
-        int block_no = file_inode.direct_ptr[i];
-        fprintf(stderr, "[DEBUG] rufs_read: Reading block %d for direct pointer %d\n", block_no, i);
+static void rufs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi->fh;
 
-        if (bio_read(block_no, block_buf) < 0) {
-            fprintf(stderr, "Error: Failed to read block %d\n", block_no);
-            return -1;
-        }
+    ilock_wr(fh->inode->ino);
+    int ret = file_write(fh->inode, buf, size, off);
+    iunlock(fh->inode->ino);
 
-        size_t block_offset = current_offset % BLOCK_SIZE;
-        size_t available_bytes = BLOCK_SIZE - block_offset;
-        size_t bytes_to_copy = (bytes_to_read < available_bytes) ? bytes_to_read : available_bytes;
+    if (ret < 0) {
+        fuse_reply_err(req, ret == -1 ? EIO : -ret);
+    } else if (ret == 0 && size > 0) {
+        fuse_reply_err(req, ENOSPC);
+    } else {
+        fuse_reply_write(req, ret);
+    }
+}
 
-        memcpy(buffer + bytes_read, block_buf + block_offset, bytes_to_copy);
+static void rufs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi) {
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi->fh;
 
-        fprintf(stderr, "[DEBUG] rufs_read: Copied %lu bytes from block %d at offset %lu\n",
-                bytes_to_copy, block_no, block_offset);
+    ilock_wr(fh->inode->ino);
+    ssize_t ret = file_write_buf(fh->inode, bufv, off);
+    iunlock(fh->inode->ino);
 
-        bytes_read += bytes_to_copy;
-        bytes_to_read -= bytes_to_copy;
-        current_offset += bytes_to_copy;
+    if (ret < 0) {
+        fuse_reply_err(req, ret == -1 ? EIO : -ret);
+    } else if (ret == 0 && fuse_buf_size(bufv) > 0) {
+        fuse_reply_err(req, ENOSPC);
+    } else {
+        fuse_reply_write(req, ret);
     }
-
-    // Step 3: Return the number of bytes read
-    fprintf(stderr, "[DEBUG] rufs_read: Total bytes read %lu\n", bytes_read);
-    return bytes_read;
 }
 
-static int rufs_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    struct inode file_inode;
-
-    if (get_node_by_path(path, 0, &file_inode) < 0) {
-        fprintf(stderr, "Error: Invalid path %s\n", path);
-        return -1;
-    }
+static void rufs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -rufs_flush(NULL, fi));
+}
 
-    fprintf(stderr, "[DEBUG] rufs_write: Inode info - ino: %d, size: %u, type: %x\n",
-            file_inode.ino, file_inode.size, file_inode.type);
+static void rufs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -rufs_fsync(NULL, datasync, fi));
+}
 
-    if ((file_inode.type & S_IFREG) == 0) {
-        fprintf(stderr, "Error: Path %s is not a regular file\n", path);
-        return -1;
-    }
+static void rufs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -rufs_release(NULL, fi));
+}
 
-    size_t bytes_written = 0;
-    size_t bytes_to_write = size;
-    off_t current_offset = offset;
-    char block_buf[BLOCK_SIZE];
+static void rufs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -unlink_in(LL_INO(parent), name, 0));
+}
 
-    for (int i = 0; i < 16 && bytes_to_write > 0; i++) {
-        int block_no;
+static void rufs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -unlink_in(LL_INO(parent), name, 1));
+}
 
-        if (current_offset >= BLOCK_SIZE) {
-            current_offset -= BLOCK_SIZE;
-            continue;
+static void rufs_ll_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd, void *arg, struct fuse_file_info *fi,
+                          unsigned flags, const void *in_buf, size_t in_bufsz, size_t out_bufsz) {
+    if ((unsigned int)cmd == RUFS_IOC_SNAPSHOT) {
+        struct rufs_snapshot snap;
+        if (in_bufsz < sizeof(snap) || out_bufsz < sizeof(snap)) {
+            fuse_reply_err(req, EINVAL);
+            return;
         }
+        memcpy(&snap, in_buf, sizeof(snap));
 
-        if (file_inode.direct_ptr[i] == 0) {
-            block_no = get_avail_blkno();
-            if (block_no < 0) {
-                fprintf(stderr, "Error: No available blocks for writing.\n");
-                return -1;
-            }
-            file_inode.direct_ptr[i] = block_no;
-            fprintf(stderr, "[DEBUG] rufs_write: Allocated new block %d for direct pointer %d\n", block_no, i);
+        int ret = snap_ioctl(&snap);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
         } else {
-            block_no = file_inode.direct_ptr[i];
+            fuse_reply_ioctl(req, 0, &snap, sizeof(snap));
         }
-
-        fprintf(stderr, "[DEBUG] rufs_write: Writing to block %d for direct pointer %d\n", block_no, i);
-
-        if (bio_read(block_no, block_buf) < 0) {
-            fprintf(stderr, "Error: Failed to read block %d before writing\n", block_no);
-            return -1;
+        return;
+    }
+    if ((unsigned int)cmd == RUFS_IOC_COMPRESS) {
+        int32_t on;
+        if (in_bufsz < sizeof(on) || out_bufsz < sizeof(on)) {
+            fuse_reply_err(req, EINVAL);
+            return;
         }
+        memcpy(&on, in_buf, sizeof(on));
 
-        size_t block_offset = current_offset % BLOCK_SIZE;
-        size_t available_space = BLOCK_SIZE - block_offset;
-        size_t bytes_to_copy = (bytes_to_write < available_space) ? bytes_to_write : available_space;
-
-        memcpy(block_buf + block_offset, buffer + bytes_written, bytes_to_copy);
-
-        fprintf(stderr, "[DEBUG] rufs_write: Copied %lu bytes to block %d at offset %lu\n",
-                bytes_to_copy, block_no, block_offset);
+        int ret = compress_ioctl(LL_INO(ino), &on);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            fuse_reply_ioctl(req, 0, &on, sizeof(on));
+        }
+        return;
+    }
+    if ((unsigned int)cmd == RUFS_IOC_DEDUP) {
+        struct rufs_dedup dedup;
+        if (out_bufsz < sizeof(dedup)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
 
-        if (bio_write(block_no, block_buf) < 0) {
-            fprintf(stderr, "Error: Failed to write block %d\n", block_no);
-            return -1;
+        int ret = dedup_all(&dedup);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            fuse_reply_ioctl(req, 0, &dedup, sizeof(dedup));
+        }
+        return;
+    }
+    if ((unsigned int)cmd == RUFS_IOC_SCRUB) {
+        struct rufs_scrub scrub;
+        if (out_bufsz < sizeof(scrub)) {
+            fuse_reply_err(req, EINVAL);
+            return;
         }
 
-        bytes_written += bytes_to_copy;
-        bytes_to_write -= bytes_to_copy;
-        current_offset += bytes_to_copy;
+        scrub_ioctl(&scrub);
+        fuse_reply_ioctl(req, 0, &scrub, sizeof(scrub));
+        return;
     }
+    if ((unsigned int)cmd == RUFS_IOC_SEEK) {
+        struct rufs_seek seek;
+        if (in_bufsz < sizeof(seek) || out_bufsz < sizeof(seek)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&seek, in_buf, sizeof(seek));
 
-    file_inode.size = (offset + bytes_written > file_inode.size) ? offset + bytes_written : file_inode.size;
+        int ret = seek_ioctl(((struct rufs_fh *)(uintptr_t)fi->fh)->inode, &seek);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            fuse_reply_ioctl(req, 0, &seek, sizeof(seek));
+        }
+        return;
+    }
+    if ((unsigned int)cmd == RUFS_IOC_COPY_RANGE) {
+        struct rufs_copy_range copy;
+        if (in_bufsz < sizeof(copy) || out_bufsz < sizeof(copy)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&copy, in_buf, sizeof(copy));
 
-    fprintf(stderr, "[DEBUG] rufs_write: Updated inode size to %u\n", file_inode.size);
+        int ret = copy_ioctl(LL_INO(ino), &copy);
+        if (ret < 0) {
+            fuse_reply_err(req, -ret);
+        } else {
+            fuse_reply_ioctl(req, 0, &copy, sizeof(copy));
+            // The file changed without the kernel seeing it
+            cache_invalidate(LL_INO(ino));
+        }
+        return;
+    }
+    if ((unsigned int)cmd != RUFS_IOC_BULK_CREATE) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+    if (in_bufsz < sizeof(struct rufs_bulk_create) || out_bufsz < sizeof(struct rufs_bulk_create)) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
 
-    if (writei(file_inode.ino, &file_inode) < 0) {
-        fprintf(stderr, "Error: Failed to write inode %d\n", file_inode.ino);
-        return -1;
+    struct rufs_bulk_create *bulk = malloc(sizeof(struct rufs_bulk_create));
+    if (bulk == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
+    memcpy(bulk, in_buf, sizeof(struct rufs_bulk_create));
 
-    fprintf(stderr, "[DEBUG] rufs_write: Total bytes written %lu\n", bytes_written);
-    return bytes_written;
+    int ret = bulk_ioctl(LL_INO(ino), bulk);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_ioctl(req, 0, bulk, sizeof(struct rufs_bulk_create));
+        // The directory grew without the kernel seeing it
+        cache_invalidate(LL_INO(ino));
+    }
+    free(bulk);
 }
 
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+	.init		= rufs_ll_init,
+	.destroy	= rufs_ll_destroy,
+
+	.lookup		= rufs_ll_lookup,
+	.forget		= rufs_ll_forget,
+	.forget_multi	= rufs_ll_forget_multi,
+	.getattr	= rufs_ll_getattr,
+	.setattr	= rufs_ll_setattr,
+
+	.opendir	= rufs_ll_opendir,
+	.readdir	= rufs_ll_readdir,
+	.releasedir	= rufs_ll_releasedir,
+	.mkdir		= rufs_ll_mkdir,
+	.rmdir		= rufs_ll_rmdir,
+
+	.create		= rufs_ll_create,
+	.open		= rufs_ll_open,
+	.read		= rufs_ll_read,
+	.write		= rufs_ll_write,
+	.write_buf	= rufs_ll_write_buf,
+	.flush		= rufs_ll_flush,
+	.fsync		= rufs_ll_fsync,
+	.release	= rufs_ll_release,
+	.unlink		= rufs_ll_unlink,
+
+	.ioctl		= rufs_ll_ioctl
+};
 
-//skip
-static int rufs_unlink(const char *path) {return 0;}
-static int rufs_truncate(const char *path, off_t size) {return 0;}
-static int rufs_release(const char *path, struct fuse_file_info *fi) {return 0;}
-static int rufs_flush(const char * path, struct fuse_file_info * fi) {return 0;}
-static int rufs_utimens(const char *path, const struct timespec tv[2]) {return 0;}
+// Mount and serve requests with the low-level API
+static int rufs_ll_main(struct fuse_args *args) {
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded, foreground;
+    int err = -1;
 
-static struct fuse_operations rufs_ope = {
-	.init		= rufs_init,
-	.destroy	= rufs_destroy,
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
 
-	.getattr	= rufs_getattr,
-	.readdir	= rufs_readdir,
-	.opendir	= rufs_opendir,
-	.releasedir	= rufs_releasedir,
-	.mkdir		= rufs_mkdir,
-	.rmdir		= rufs_rmdir,
+    if ((ch = fuse_mount(mountpoint, args)) != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                ll_chan = ch;
+                err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                ll_chan = NULL;
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
 
-	.create		= rufs_create,
-	.open		= rufs_open,
-	.read 		= rufs_read,
-	.write		= rufs_write,
-	.unlink		= rufs_unlink,
+    return err ? 1 : 0;
+}
 
-	.truncate   = rufs_truncate,
-	.flush      = rufs_flush,
-	.utimens    = rufs_utimens,
-	.release	= rufs_release
+// The mount options described with struct rufs_options
+static struct fuse_opt rufs_opts[] = {
+    { "highlevel", offsetof(struct rufs_options, highlevel), 1 },
+    { "entry_timeout=%lf", offsetof(struct rufs_options, entry_timeout), 0 },
+    { "attr_timeout=%lf", offsetof(struct rufs_options, attr_timeout), 0 },
+    { "keep_cache", offsetof(struct rufs_options, keep_cache), 1 },
+    { "writeback", offsetof(struct rufs_options, writeback), 1 },
+    { "log", offsetof(struct rufs_options, log), 1 },
+    { "snapshot=%u", offsetof(struct rufs_options, snapshot), 0 },
+    { "compress", offsetof(struct rufs_options, compress), 1 },
+    { "dedup", offsetof(struct rufs_options, dedup), 1 },
+    { "datasum", offsetof(struct rufs_options, datasum), 1 },
+    { "scrub=%u", offsetof(struct rufs_options, scrub), 0 },
+    FUSE_OPT_END
 };
 
 //testing
@@ -858,19 +6022,61 @@ int main() {
     //test_rufs_open();
     //test_rufs_read_write(); 
     //test_rufs_readdir_multiple_entries();
+    //test_rufs_readdir_offset();
+    //test_rufs_create_bulk();
+    //test_rufs_read_write_large();
+    //test_rufs_utimens();
+    //test_rufs_truncate();
+    //test_journal_replay();
+    //test_rufs_fsync();
+    //test_log_overwrite();
+    //test_rufs_readahead();
+    //test_rufs_sparse();
+    //test_rufs_unlink();
+    //test_rufs_discard();
+    //test_rufs_copy_range();
+    //test_rufs_snapshot();
+    //test_rufs_generation();
+    //test_rufs_compress();
+    //test_rufs_dedup();
+    //test_rufs_checksum();
+    //test_rufs_delta_roundtrip();
+    //test_batch_abort();
 
     return 0;
 }
 #else
 //when running benchmarks, just do make 
 int main(int argc, char *argv[]) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     int fuse_stat;
 
     getcwd(diskfile_path, PATH_MAX);
     strcat(diskfile_path, "/DISKFILE");
 
-    fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+    if (fuse_opt_parse(&args, &rufs_options, rufs_opts, NULL) == -1) {
+        return 1;
+    }
+
+    // Snapshots never change, so the kernel may as well refuse writes itself
+    if (rufs_options.snapshot) {
+        fuse_opt_add_arg(&args, "-oro");
+    }
+
+    if (rufs_options.highlevel) {
+        // The path API applies the cache timeouts itself
+        char timeouts[64];
+        snprintf(timeouts, sizeof(timeouts), "-oentry_timeout=%g,attr_timeout=%g",
+                 rufs_options.entry_timeout, rufs_options.attr_timeout);
+        fuse_opt_add_arg(&args, timeouts);
+        // Without rename libfuse cannot hide an unlinked open file, so let the unlink go through
+        fuse_opt_add_arg(&args, "-ohard_remove");
+        fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
+    } else {
+        fuse_stat = rufs_ll_main(&args);
+    }
 
+    fuse_opt_free_args(&args);
     return fuse_stat;
 }
 #endif
\ No newline at end of file
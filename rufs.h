@@ -10,7 +10,9 @@
 // Tested on iLab: kill
 
 #include <linux/limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <unistd.h>
 
 #ifndef _TFS_H
@@ -20,6 +22,9 @@
 #define MAX_INUM 1024
 #define MAX_DNUM 16384
 
+// Superblock state: an image found in use at mount was not unmounted cleanly
+#define SB_STATE_CLEAN 1
+#define SB_STATE_IN_USE 2
 
 struct superblock {
 	uint32_t	magic_num;			/* magic number */
@@ -29,6 +34,19 @@ struct superblock {
 	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
 	uint32_t	i_start_blk;		/* start block of inode region */
 	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	j_start_blk;		/* start block of the metadata journal */
+	uint32_t	j_blks;				/* journal length in blocks, 0 if none */
+	uint32_t	j_tail;				/* journal offset of the oldest live transaction */
+	uint32_t	j_seq;				/* sequence number of the transaction at j_tail */
+	uint32_t	state;				/* SB_STATE_CLEAN or SB_STATE_IN_USE */
+	uint32_t	o_bitmap_blk;		/* bitmap of unlinked inodes not yet freed, 0 if none */
+	uint32_t	r_start_blk;		/* start block of data block reference counts, 0 if none */
+	uint32_t	snap_blk;			/* record of the newest snapshot, 0 if none */
+	uint32_t	snap_next_id;		/* id the next snapshot gets */
+	uint32_t	g_start_blk;		/* start block of block generation stamps, 0 if none */
+	uint32_t	gen;				/* generation of this mount */
+	uint32_t	applied_gen;		/* generation rufs_delta last brought this copy to */
+	uint32_t	c_start_blk;		/* start block of block checksums, 0 if none */
 };
 
 struct inode {
@@ -49,9 +67,207 @@ struct dirent {
 	uint16_t len;					/* length of name */
 };
 
+/*
+ * A journal transaction is a JOURNAL_DESC block naming the home blocks,
+ * a copy of each of them, and a JOURNAL_COMMIT block whose sum covers the
+ * descriptor and the copies. Both use this header.
+ */
+#define JOURNAL_MAGIC 0x4A524E4C
+#define JOURNAL_DESC 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_MAX_BLKS 32
+
+struct journal_header {
+	uint32_t	magic;				/* JOURNAL_MAGIC */
+	uint32_t	type;				/* JOURNAL_DESC or JOURNAL_COMMIT */
+	uint32_t	seq;				/* transaction sequence number */
+	uint32_t	nblks;				/* number of blocks logged */
+	uint32_t	sum;				/* commit: checksum of the transaction */
+	uint32_t	revoke;				/* transaction freed journaled blocks */
+	uint32_t	blk_num[JOURNAL_MAX_BLKS];	/* desc: home block of each copy */
+};
+
+/*
+ * A snapshot is a read-only copy of the whole tree at one point in time.
+ * Its record names copies of the inode table and inode bitmap; directory
+ * and pointer blocks are copied as well, while file data blocks are
+ * shared with the live tree through their reference counts. Records are
+ * chained from sb.snap_blk, newest first.
+ */
+#define SNAP_MAGIC 0x534E4150
+#define SNAP_ITABLE_BLKS 64
+
+struct snapshot {
+	uint32_t	magic;				/* SNAP_MAGIC */
+	uint32_t	id;					/* snapshot number, from 1 */
+	uint32_t	prev;				/* record of the next older snapshot, 0 if none */
+	uint32_t	i_bitmap_blk;		/* copy of the inode bitmap */
+	int64_t		time;				/* when it was taken */
+	uint32_t	i_blks[SNAP_ITABLE_BLKS];	/* copy of each inode table block */
+};
+
+/*
+ * Changed-block tracking. Every mount starts a new generation, sb.gen, and
+ * each block of the image is stamped with the generation it was last
+ * written in; the stamps are on disk from sb.g_start_blk. rufs_delta
+ * exports the blocks stamped after a given generation as a stream of
+ * delta records, and applies such a stream to a copy of the image.
+ */
+#define GENS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define GEN_BLKS 17					/* enough for d_start_blk + MAX_DNUM blocks */
+
+#define DELTA_MAGIC 0x52444C54
+
+struct delta_header {
+	uint32_t	magic;				/* DELTA_MAGIC */
+	uint32_t	since;				/* generation the copy must be at, 0 for a full copy */
+	uint32_t	gen;				/* generation it is at afterwards */
+	uint32_t	nblks;				/* blocks in the image */
+};
+
+// A run of len blocks from blk, followed by their contents unless zero is set; len 0 ends the stream
+struct delta_record {
+	uint32_t	blk;
+	uint32_t	len;
+	uint32_t	zero;
+};
+
+/*
+ * Block checksums. Every block of the image has a CRC-32C on disk from
+ * sb.c_start_blk, 0 where none is known, which reads are checked against.
+ * Metadata always has one; file data has one when it was written through
+ * memory, which the "datasum" mount option makes sure of.
+ */
+#define SUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+#define SUM_BLKS 17					/* as many as GEN_BLKS */
+
+/*
+ * Compressed files. A regular file with RUFS_FL_COMPRESS set in
+ * vstat.st_rdev keeps its data in clusters of CLUSTER_BLKS file blocks.
+ * A cluster that LZ4 shrinks by at least a block is packed: its leading
+ * slots hold a cluster_header and the compressed bytes, and every slot
+ * after them holds CLUSTER_PACKED, which is never a data block. Any other
+ * cluster is stored as plain blocks. Directories carry the flag only to
+ * pass it on to what is created in them.
+ */
+#define RUFS_FL_COMPRESS 1
+#define CLUSTER_BLKS 16
+#define CLUSTER_PACKED 1
+
+struct cluster_header {
+	uint32_t	clen;				/* bytes of LZ4 data that follow */
+};
+
+/*
+ * Bulk create request for RUFS_IOC_BULK_CREATE, issued on an open
+ * directory. names holds count NUL-terminated names back to back; on
+ * return count is the number of files created. Those are the first
+ * count names, fewer than asked if the request failed partway.
+ */
+#define RUFS_BULK_NAMES_LEN 8192
+#define RUFS_BULK_MAX 1024
+
+struct rufs_bulk_create {
+	uint32_t count;					/* number of names */
+	uint32_t mode;					/* permission bits for every file */
+	char names[RUFS_BULK_NAMES_LEN];	/* packed file names */
+};
+
+#define RUFS_IOC_BULK_CREATE _IOWR('R', 1, struct rufs_bulk_create)
+
+/*
+ * RUFS_IOC_SEEK, issued on an open file, does lseek's SEEK_DATA and
+ * SEEK_HOLE: offset goes in, and comes back as the start of the next data
+ * or hole at or after it. Fails with ENXIO at or past the end of the file.
+ */
+#ifndef SEEK_DATA
+#define SEEK_DATA 3
+#define SEEK_HOLE 4
+#endif
+
+struct rufs_seek {
+	int64_t offset;					/* where to start, then the result */
+	uint32_t whence;				/* SEEK_DATA or SEEK_HOLE */
+};
+
+#define RUFS_IOC_SEEK _IOWR('R', 2, struct rufs_seek)
+
+/*
+ * RUFS_IOC_COPY_RANGE, issued on the open destination file, does
+ * copy_file_range from the file at src, a path from the root of the
+ * mount. Whole blocks are shared copy-on-write rather than copied. On
+ * return len is the number of bytes copied, short at the end of src.
+ */
+#define RUFS_COPY_PATH_LEN 1024
+
+struct rufs_copy_range {
+	char src[RUFS_COPY_PATH_LEN];	/* source file */
+	int64_t src_offset;				/* where to copy from */
+	int64_t dst_offset;				/* where to copy to */
+	uint64_t len;					/* bytes to copy, then bytes copied */
+};
+
+#define RUFS_IOC_COPY_RANGE _IOWR('R', 3, struct rufs_copy_range)
+
+/*
+ * RUFS_IOC_SNAPSHOT, issued on any open file or directory, takes a
+ * snapshot, deletes one, or lists them newest first. A snapshot is
+ * mounted read-only with -o snapshot=<id>; deleting one that is mounted
+ * fails with EBUSY.
+ */
+#define RUFS_SNAP_CREATE 1
+#define RUFS_SNAP_DELETE 2
+#define RUFS_SNAP_LIST 3
+#define RUFS_SNAP_MAX 128
+
+struct rufs_snapshot {
+	uint32_t op;					/* RUFS_SNAP_CREATE, _DELETE or _LIST */
+	uint32_t id;					/* create: the new snapshot; delete: which one */
+	uint32_t count;					/* list: number of ids */
+	uint32_t ids[RUFS_SNAP_MAX];	/* list: snapshot ids */
+};
+
+#define RUFS_IOC_SNAPSHOT _IOWR('R', 4, struct rufs_snapshot)
+
+/*
+ * RUFS_IOC_COMPRESS, issued on an open file or directory, turns
+ * compression on (1) or off (0), or leaves it as it is (-1), and returns
+ * the setting. A regular file can only change it while it is empty.
+ */
+#define RUFS_IOC_COMPRESS _IOWR('R', 5, int32_t)
+
+/*
+ * RUFS_IOC_DEDUP, issued on any open file or directory, shares every data
+ * block of a regular file with an identical block seen before it, copy on
+ * write as with RUFS_IOC_COPY_RANGE. Compressed files are left alone.
+ */
+struct rufs_dedup {
+	uint32_t scanned;				/* data blocks read */
+	uint32_t merged;				/* blocks now shared instead of stored */
+};
+
+#define RUFS_IOC_DEDUP _IOWR('R', 6, struct rufs_dedup)
+
+/*
+ * RUFS_IOC_SCRUB, issued on any open file or directory, reports how many
+ * blocks the scrubber has read so far and how many of them were bad.
+ */
+struct rufs_scrub {
+	uint32_t scanned;				/* blocks read */
+	uint32_t bad;					/* blocks that failed their checksum */
+};
+
+#define RUFS_IOC_SCRUB _IOR('R', 7, struct rufs_scrub)
+
 extern char diskfile_path[PATH_MAX];
+extern unsigned char inode_bitmap[];
+extern unsigned char data_bitmap[];
 //declarations
 int rufs_mkfs();
+int rufs_create_bulk(const char *dir_path, const char *names[], int count, mode_t mode);
+ssize_t rufs_copy_range(const char *src_path, off_t src_off, const char *dst_path, off_t dst_off, size_t len);
+int rufs_snapshot_create();
+int rufs_snapshot_delete(uint32_t id);
 
 /*
  * bitmap operations 
@@ -0,0 +1,254 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *
+ *	File:	rufs_delta.c
+ *
+ *	Incremental backup of an unmounted rufs image:
+ *
+ *	rufs_delta gen <image>             print the image's generation
+ *	rufs_delta export <image> <since>  write the blocks changed after
+ *	                                   generation since to stdout; since
+ *	                                   0 writes the whole image
+ *	rufs_delta apply <image>           apply a stream from stdin to a copy
+ *	                                   of the image; a full stream (since
+ *	                                   0) creates or overwrites it
+ *
+ *	A copy is at the generation of the stream last applied to it, so the
+ *	next export starts from what "rufs_delta gen" says about the copy.
+ *	Mounting a copy starts a generation of its own, after which streams
+ *	from the original no longer apply to it.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "block.h"
+#include "rufs.h"
+
+// Blocks per data record
+#define DELTA_RUN 256
+
+static struct superblock sb;
+static uint32_t blk_gen[GEN_BLKS * GENS_PER_BLOCK];
+static char run[DELTA_RUN][BLOCK_SIZE];
+static const char zero_block[BLOCK_SIZE];
+
+static int read_all(void *buf, size_t len) {
+    return fread(buf, 1, len, stdin) == len ? 0 : -1;
+}
+
+static int write_all(const void *buf, size_t len) {
+    return fwrite(buf, 1, len, stdout) == len ? 0 : -1;
+}
+
+static int sb_load(const char *image) {
+    char buffer[BLOCK_SIZE];
+
+    if (dev_open(image) < 0) {
+        return -1;
+    }
+    if (bio_read(0, buffer) < 0) {
+        return -1;
+    }
+    memcpy(&sb, buffer, sizeof(sb));
+    if (sb.magic_num != MAGIC_NUM) {
+        fprintf(stderr, "%s: not a rufs image\n", image);
+        return -1;
+    }
+    if (sb.g_start_blk == 0) {
+        fprintf(stderr, "%s: made before generation tracking, back it up whole\n", image);
+        return -1;
+    }
+    if (sb.state != SB_STATE_CLEAN) {
+        fprintf(stderr, "%s: in use or not unmounted cleanly; mount and unmount it first\n", image);
+        return -1;
+    }
+    return 0;
+}
+
+static int delta_flush(uint32_t blk, uint32_t len, int zero) {
+    struct delta_record rec = { blk, len, zero };
+
+    if (len == 0) {
+        return 0;
+    }
+    if (write_all(&rec, sizeof(rec)) < 0) {
+        return -1;
+    }
+    return zero ? 0 : write_all(run, (size_t)len * BLOCK_SIZE);
+}
+
+/*
+ * Write every block stamped after since, as runs of consecutive blocks.
+ * Since 0 sends every block, as mkfs writes before stamping starts and
+ * leaves its blocks at generation 0. All-zero blocks, punched holes among
+ * them, are sent without contents. The journal of a clean image is dead,
+ * so it is left out.
+ */
+static int delta_export(const char *image, uint32_t since) {
+    if (sb_load(image) < 0) {
+        return -1;
+    }
+    if (since > sb.gen) {
+        fprintf(stderr, "%s: at generation %u, before %u\n", image, sb.gen, since);
+        return -1;
+    }
+    if (bio_read_range((off_t)sb.g_start_blk * BLOCK_SIZE, blk_gen, sizeof(blk_gen)) < 0) {
+        return -1;
+    }
+
+    struct delta_header hdr = { DELTA_MAGIC, since, sb.gen, sb.d_start_blk + sb.max_dnum };
+    if (write_all(&hdr, sizeof(hdr)) < 0) {
+        return -1;
+    }
+
+    uint32_t start = 0, len = 0, nblks = 0, nzero = 0;
+    int zero = 0;
+    char buf[BLOCK_SIZE];
+    for (uint32_t blk = 0; blk < hdr.nblks; blk++) {
+        int journal = blk >= sb.j_start_blk && blk < sb.j_start_blk + sb.j_blks;
+        if (journal || (since > 0 && blk_gen[blk] <= since)) {
+            continue;
+        }
+        if (bio_read(blk, buf) < 0) {
+            return -1;
+        }
+        int is_zero = memcmp(buf, zero_block, BLOCK_SIZE) == 0;
+
+        // Start a new record unless this block extends the current one
+        if (len > 0 && (blk != start + len || is_zero != zero || (!zero && len == DELTA_RUN))) {
+            if (delta_flush(start, len, zero) < 0) {
+                return -1;
+            }
+            len = 0;
+        }
+        if (len == 0) {
+            start = blk;
+            zero = is_zero;
+        }
+        if (!zero) {
+            memcpy(run[len], buf, BLOCK_SIZE);
+        }
+        len++;
+        nblks++;
+        nzero += is_zero;
+    }
+    if (delta_flush(start, len, zero) < 0) {
+        return -1;
+    }
+
+    struct delta_record end = { 0, 0, 0 };
+    if (write_all(&end, sizeof(end)) < 0 || fflush(stdout) != 0) {
+        return -1;
+    }
+    fprintf(stderr, "rufs_delta: %u blocks (%u zero) from generation %u to %u\n", nblks, nzero, since, sb.gen);
+    return 0;
+}
+
+/*
+ * Write the stream's blocks into the copy. A full stream starts from an
+ * empty file, so nothing of an older image, its journal included, is left
+ * behind. The superblock, which names the generation, goes last, after
+ * everything else is durable, so a copy cut off part way is still at the
+ * old generation and the stream can be applied again.
+ */
+static int delta_apply(const char *image) {
+    struct delta_header hdr;
+    char sb_block[BLOCK_SIZE];
+    int have_sb = 0;
+
+    if (read_all(&hdr, sizeof(hdr)) < 0 || hdr.magic != DELTA_MAGIC) {
+        fprintf(stderr, "rufs_delta: not a delta stream\n");
+        return -1;
+    }
+    if (hdr.since == 0) {
+        if (truncate(image, 0) < 0 && errno != ENOENT) {
+            perror(image);
+            return -1;
+        }
+        dev_init(image);
+    } else if (sb_load(image) < 0) {
+        return -1;
+    } else if (sb.gen != hdr.since) {
+        fprintf(stderr, "%s: at generation %u, the stream starts from %u\n", image, sb.gen, hdr.since);
+        return -1;
+    } else if (sb.applied_gen != sb.gen) {
+        fprintf(stderr, "%s: mounted since the last apply\n", image);
+        return -1;
+    }
+
+    for (;;) {
+        struct delta_record rec;
+        if (read_all(&rec, sizeof(rec)) < 0) {
+            fprintf(stderr, "rufs_delta: stream cut short\n");
+            return -1;
+        }
+        if (rec.len == 0) {
+            break;
+        }
+        if ((!rec.zero && rec.len > DELTA_RUN) || rec.blk + rec.len > hdr.nblks) {
+            fprintf(stderr, "rufs_delta: bad record at block %u\n", rec.blk);
+            return -1;
+        }
+
+        if (rec.zero) {
+            if (bio_discard((off_t)rec.blk * BLOCK_SIZE, (size_t)rec.len * BLOCK_SIZE) < 0) {
+                for (uint32_t i = 0; i < rec.len; i++) {
+                    if (bio_write(rec.blk + i, zero_block) < 0) {
+                        return -1;
+                    }
+                }
+            }
+            continue;
+        }
+
+        if (read_all(run, (size_t)rec.len * BLOCK_SIZE) < 0) {
+            fprintf(stderr, "rufs_delta: stream cut short\n");
+            return -1;
+        }
+        uint32_t first = 0;
+        if (rec.blk == 0) {
+            memcpy(sb_block, run[0], BLOCK_SIZE);
+            ((struct superblock *)sb_block)->applied_gen = hdr.gen;
+            have_sb = 1;
+            first = 1;
+        }
+        if (rec.len > first &&
+            bio_write_range((off_t)(rec.blk + first) * BLOCK_SIZE, run[first], (size_t)(rec.len - first) * BLOCK_SIZE) < 0) {
+            return -1;
+        }
+    }
+
+    if (dev_sync() < 0 || (have_sb && (bio_write(0, sb_block) < 0 || dev_sync() < 0))) {
+        return -1;
+    }
+    fprintf(stderr, "rufs_delta: %s is at generation %u\n", image, hdr.gen);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    int ret = -1;
+
+    if (argc == 3 && strcmp(argv[1], "gen") == 0) {
+        if (sb_load(argv[2]) == 0) {
+            printf("%u\n", sb.gen);
+            ret = 0;
+        }
+    } else if (argc == 4 && strcmp(argv[1], "export") == 0) {
+        ret = delta_export(argv[2], strtoul(argv[3], NULL, 10));
+    } else if (argc == 3 && strcmp(argv[1], "apply") == 0) {
+        ret = delta_apply(argv[2]);
+    } else {
+        fprintf(stderr, "usage: %s gen <image>\n"
+                        "       %s export <image> <since> > delta\n"
+                        "       %s apply <image> < delta\n", argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    dev_close();
+    return ret < 0 ? 1 : 0;
+}
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdint.h>
 #include "block.h"
+#include "crc32c.h"
 #include "rufs.h"
 
 //testing fucntions stored here after use
@@ -166,6 +167,7 @@ void test_get_avail_ino_advanced() {
     char buf[BLOCK_SIZE];
     bio_read(sb.i_bitmap_blk, buf); // Read the inode bitmap
     clear_bitmap((bitmap_t)buf, inodes[2]); // Clear inode 3 (index 2 in the array)
+    clear_bitmap(inode_bitmap, inodes[2]); // The in-memory bitmap is authoritative while mounted
     bio_write(sb.i_bitmap_blk, buf); // Write updated bitmap back to disk
     printf("Deallocated inode 3\n");
 
@@ -221,6 +223,7 @@ void test_get_avail_blkno() {
 
     // Deallocate one block
     clear_bitmap((bitmap_t)buf, blkno2); // Clear the second block
+    clear_bitmap(data_bitmap, blkno2);
     bio_write(sb.d_bitmap_blk, buf);
     printf("Deallocated block: %d\n", blkno2);
 
@@ -284,6 +287,8 @@ void test_get_avail_blkno_advanced() {
     printf("Deallocating 2 Blocks...\n");
     clear_bitmap((bitmap_t)buf, allocated_blocks[3]);
     clear_bitmap((bitmap_t)buf, allocated_blocks[7]);
+    clear_bitmap(data_bitmap, allocated_blocks[3]);
+    clear_bitmap(data_bitmap, allocated_blocks[7]);
     bio_write(sb.d_bitmap_blk, buf);
 
     printf("Bitmap After Deallocation: %02x\n", buf[0]);
@@ -867,8 +872,8 @@ void test_rufs_destroy() {
     initialize_test_fs();
 
     // Simulate operations
-    struct inode test_inode;
-    if (get_avail_ino() < 0) {
+    int ino = get_avail_ino();
+    if (ino < 0) {
         fprintf(stderr, "Test failed: Unable to allocate inode.\n");
         return;
     }
@@ -876,24 +881,30 @@ void test_rufs_destroy() {
     // Call rufs_destroy
     rufs_destroy(NULL);
 
-    // Check if bitmaps are cleared
+    // The image must be marked clean with the allocation still in place
     char buf[BLOCK_SIZE];
+    struct superblock disk_sb;
+    dev_open(diskfile_path);
+    bio_read(0, buf);
+    memcpy(&disk_sb, buf, sizeof(disk_sb));
+    if (disk_sb.state != SB_STATE_CLEAN) {
+        fprintf(stderr, "Test failed: Superblock not marked clean.\n");
+        return;
+    }
     bio_read(sb.i_bitmap_blk, buf);
-    for (int i = 0; i < MAX_INUM / 8; i++) {
-        if (buf[i] != 0) {
-            fprintf(stderr, "Test failed: Inode bitmap not cleared.\n");
-            return;
-        }
+    if (!get_bitmap((bitmap_t)buf, ino)) {
+        fprintf(stderr, "Test failed: Inode bitmap lost across unmount.\n");
+        return;
     }
-    bio_read(sb.d_bitmap_blk, buf);
-    for (int i = 0; i < MAX_DNUM / 8; i++) {
-        if (buf[i] != 0) {
-            fprintf(stderr, "Test failed: Data block bitmap not cleared.\n");
-            return;
-        }
+
+    // Remounting takes the clean path and sees the same allocation
+    rufs_init(NULL);
+    if (sb.state != SB_STATE_IN_USE || !get_bitmap(inode_bitmap, ino)) {
+        fprintf(stderr, "Test failed: Remount did not restore the allocation state.\n");
+        return;
     }
 
-    printf("Test passed: rufs_destroy cleared resources successfully.\n");
+    printf("Test passed: rufs_destroy left a clean image that remounts intact.\n");
 }
 
 void test_rufs_getattr() {
@@ -1026,3 +1037,983 @@ void test_rufs_read_write() {
     printf("Test passed: rufs_read and rufs_write worked successfully.\n");
 }
 
+
+//helper for testing resumable readdir: stops after a few entries
+static int resume_seen = 0;
+static int resume_limit = 0;
+static off_t resume_next = 0;
+
+int test_filler_limited(void *buf, const char *name, const struct stat *st, off_t off) {
+    if (resume_limit-- <= 0) {
+        return 1; // buffer full
+    }
+    if (st == NULL || (st->st_mode & S_IFMT) == 0) {
+        printf("Missing attributes for %s\n", name);
+    }
+    resume_seen++;
+    resume_next = off;
+    return 0;
+}
+
+void test_rufs_readdir_offset() {
+    printf("Testing rufs_readdir with offsets...\n");
+
+    initialize_test_fs();
+
+    char path[64];
+    for (int i = 0; i < 40; i++) {
+        sprintf(path, "/dir%d", i);
+        if (rufs_mkdir(path, 0755) < 0) {
+            fprintf(stderr, "Test failed: Unable to create %s.\n", path);
+            return;
+        }
+    }
+
+    struct fuse_file_info fi = {0};
+    if (rufs_opendir("/", &fi) < 0) {
+        fprintf(stderr, "Test failed: Unable to open root directory.\n");
+        return;
+    }
+
+    // Read the directory 5 entries at a time, resuming from the last offset
+    off_t offset = 0;
+    int before;
+    resume_seen = 0;
+    do {
+        before = resume_seen;
+        resume_limit = 5;
+        if (rufs_readdir("/", NULL, test_filler_limited, offset, &fi) < 0) {
+            fprintf(stderr, "Test failed: rufs_readdir returned an error.\n");
+            return;
+        }
+        offset = resume_next;
+    } while (resume_seen != before);
+
+    if (resume_seen != 42) { // 40 dirs plus . and ..
+        fprintf(stderr, "Test failed: Expected 42 entries, got %d.\n", resume_seen);
+        return;
+    }
+
+    printf("Test passed: rufs_readdir resumed from offsets correctly.\n");
+}
+
+void test_rufs_create_bulk() {
+    printf("Testing rufs_create_bulk...\n");
+
+    initialize_test_fs();
+
+    char name_buf[100][16];
+    const char *names[100];
+    for (int i = 0; i < 100; i++) {
+        sprintf(name_buf[i], "file%d", i);
+        names[i] = name_buf[i];
+    }
+
+    int created = rufs_create_bulk("/", names, 100, 0644);
+    if (created != 100) {
+        fprintf(stderr, "Test failed: Expected 100 files, created %d.\n", created);
+        return;
+    }
+
+    // A batch with a name that already exists must not create anything
+    if (rufs_create_bulk("/", names + 99, 1, 0644) >= 0) {
+        fprintf(stderr, "Test failed: Duplicate name was accepted.\n");
+        return;
+    }
+
+    struct inode file_inode;
+    if (get_node_by_path("/file99", 0, &file_inode) < 0 || (file_inode.type & S_IFREG) == 0) {
+        fprintf(stderr, "Test failed: /file99 not found after bulk create.\n");
+        return;
+    }
+
+    printf("Test passed: rufs_create_bulk created all files.\n");
+}
+
+void test_rufs_read_write_large() {
+    printf("Testing 1MB rufs_read and rufs_write requests...\n");
+
+    initialize_test_fs();
+
+    if (rufs_create("/bigfile", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /bigfile.\n");
+        return;
+    }
+
+    // Two 1MB requests, past the 16 direct blocks and into the indirect ones
+    size_t size = 1 << 20;
+    char *data = malloc(size);
+    char *buffer = malloc(size);
+    for (size_t i = 0; i < size; i++) {
+        data[i] = (char)(i % 251);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (rufs_write("/bigfile", data, size, i * size, NULL) != (int)size) {
+            fprintf(stderr, "Test failed: Short write at request %d.\n", i);
+            goto out;
+        }
+    }
+
+    // Read back across the second request, unaligned
+    if (rufs_read("/bigfile", buffer, size, size + 100, NULL) != (int)(size - 100)) {
+        fprintf(stderr, "Test failed: Short read near the end of /bigfile.\n");
+        goto out;
+    }
+    if (memcmp(buffer, data + 100, size - 100) != 0) {
+        fprintf(stderr, "Test failed: Data mismatch in large read.\n");
+        goto out;
+    }
+
+    printf("Test passed: Large requests read back correctly.\n");
+out:
+    free(data);
+    free(buffer);
+}
+
+void test_rufs_utimens() {
+    printf("Testing rufs_utimens and stable timestamps...\n");
+
+    initialize_test_fs();
+
+    if (rufs_create("/timed", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /timed.\n");
+        return;
+    }
+
+    struct timespec tv[2] = { { 1000, 0 }, { 2000, 0 } };
+    if (rufs_utimens("/timed", tv) < 0) {
+        fprintf(stderr, "Test failed: rufs_utimens returned an error.\n");
+        return;
+    }
+
+    // getattr must report the stored times, not the current time
+    struct stat st;
+    if (rufs_getattr("/timed", &st) < 0 || st.st_atime != 1000 || st.st_mtime != 2000) {
+        fprintf(stderr, "Test failed: Expected atime 1000 and mtime 2000.\n");
+        return;
+    }
+
+    // A write moves mtime forward
+    if (rufs_write("/timed", "x", 1, 0, NULL) < 0 || rufs_getattr("/timed", &st) < 0 || st.st_mtime <= 2000) {
+        fprintf(stderr, "Test failed: Write did not update mtime.\n");
+        return;
+    }
+
+    printf("Test passed: Timestamps are stored and updated.\n");
+}
+
+void test_rufs_truncate() {
+    printf("Testing rufs_truncate...\n");
+
+    initialize_test_fs();
+
+    if (rufs_create("/shrink", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /shrink.\n");
+        return;
+    }
+
+    char data[3 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    if (rufs_write("/shrink", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write to /shrink.\n");
+        return;
+    }
+
+    // Cut into the first block, then grow again: the old bytes must not come back
+    if (rufs_truncate("/shrink", 10) < 0 || rufs_truncate("/shrink", 2 * BLOCK_SIZE) < 0) {
+        fprintf(stderr, "Test failed: rufs_truncate returned an error.\n");
+        return;
+    }
+
+    char buffer[3 * BLOCK_SIZE];
+    if (rufs_read("/shrink", buffer, sizeof(buffer), 0, NULL) != 2 * BLOCK_SIZE) {
+        fprintf(stderr, "Test failed: Expected %d bytes after truncate.\n", 2 * BLOCK_SIZE);
+        return;
+    }
+    for (int i = 10; i < 2 * BLOCK_SIZE; i++) {
+        if (buffer[i] != 0) {
+            fprintf(stderr, "Test failed: Byte %d is not zero after extending.\n", i);
+            return;
+        }
+    }
+
+    printf("Test passed: rufs_truncate shrinks and extends correctly.\n");
+}
+
+void test_journal_replay() {
+    printf("Testing journal replay after lost metadata writes...\n");
+
+    initialize_test_fs();
+
+    if (rufs_mkdir("/logged", 0755) < 0 || rufs_create("/logged/file", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /logged/file.\n");
+        return;
+    }
+
+    // Lose the home copies of the inode bitmap and the first inode table block
+    char zero[BLOCK_SIZE] = {0};
+    bio_write(sb.i_bitmap_blk, zero);
+    bio_write(sb.i_start_blk, zero);
+
+    // Remount: the journal puts them back
+    char buffer[BLOCK_SIZE];
+    bio_read(0, buffer);
+    memcpy(&sb, buffer, sizeof(struct superblock));
+    inode_cache_reset();
+    if (journal_replay() < 0 || bio_read(sb.i_bitmap_blk, inode_bitmap) < 0) {
+        fprintf(stderr, "Test failed: journal_replay returned an error.\n");
+        return;
+    }
+
+    struct inode inode;
+    if (get_node_by_path("/logged/file", 0, &inode) < 0 || !get_bitmap(inode_bitmap, inode.ino)) {
+        fprintf(stderr, "Test failed: /logged/file was not recovered.\n");
+        return;
+    }
+
+    printf("Test passed: Journal replay restored the lost metadata.\n");
+}
+
+void test_rufs_fsync() {
+    printf("Testing rufs_fsync...\n");
+
+    initialize_test_fs();
+
+    struct fuse_file_info fi = {0};
+    if (rufs_create("/synced", 0644, &fi) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /synced.\n");
+        return;
+    }
+
+    char data[2 * BLOCK_SIZE];
+    memset(data, 's', sizeof(data));
+    if (rufs_write("/synced", data, sizeof(data), 0, &fi) != sizeof(data) ||
+        rufs_fsync("/synced", 1, &fi) < 0) {
+        fprintf(stderr, "Test failed: Unable to write and fdatasync /synced.\n");
+        return;
+    }
+
+    // fdatasync must carry the new size to disk even though the handle is still open;
+    // the cache already has it, so look at the inode table block itself
+    struct inode inode;
+    char buf[BLOCK_SIZE];
+    if (get_node_by_path("/synced", 0, &inode) < 0 ||
+        bio_read(sb.i_start_blk + inode.ino / INODES_PER_BLOCK, buf) < 0) {
+        fprintf(stderr, "Test failed: Unable to read the inode of /synced from disk.\n");
+        return;
+    }
+    struct inode *disk = (struct inode *)buf + inode.ino % INODES_PER_BLOCK;
+    if (disk->ino != inode.ino || disk->size != sizeof(data) || disk->type != (S_IFREG | 0644)) {
+        fprintf(stderr, "Test failed: Size or mode not on disk after fdatasync.\n");
+        return;
+    }
+
+    rufs_release("/synced", &fi);
+    printf("Test passed: rufs_fsync wrote back data and size.\n");
+}
+
+void test_log_overwrite() {
+    printf("Testing log-structured overwrites...\n");
+
+    initialize_test_fs();
+    rufs_options.log = 1;
+
+    char data[4 * BLOCK_SIZE];
+    memset(data, 'o', sizeof(data));
+    if (rufs_create("/logfile", 0644, NULL) < 0 ||
+        rufs_write("/logfile", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /logfile.\n");
+        rufs_options.log = 0;
+        return;
+    }
+
+    struct inode inode;
+    get_node_by_path("/logfile", 0, &inode);
+    int old_blk = inode.direct_ptr[1];
+
+    // Patch part of the second block: it must move, keeping the bytes around the patch
+    memset(data + BLOCK_SIZE + 100, 'n', 200);
+    if (rufs_write("/logfile", data + BLOCK_SIZE + 100, 200, BLOCK_SIZE + 100, NULL) != 200) {
+        fprintf(stderr, "Test failed: Unable to overwrite /logfile.\n");
+        rufs_options.log = 0;
+        return;
+    }
+    rufs_options.log = 0;
+
+    get_node_by_path("/logfile", 0, &inode);
+    if (inode.direct_ptr[1] == old_blk || get_bitmap(data_bitmap, old_blk - sb.d_start_blk)) {
+        fprintf(stderr, "Test failed: Overwritten block was not moved and freed.\n");
+        return;
+    }
+
+    char buffer[4 * BLOCK_SIZE];
+    if (rufs_read("/logfile", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) ||
+        memcmp(buffer, data, sizeof(buffer)) != 0) {
+        fprintf(stderr, "Test failed: /logfile content is wrong after the overwrite.\n");
+        return;
+    }
+
+    printf("Test passed: Overwrites go to fresh blocks and keep the data intact.\n");
+}
+
+void test_rufs_readahead() {
+    printf("Testing readahead window...\n");
+
+    initialize_test_fs();
+
+    struct fuse_file_info fi = {0};
+    char buffer[8 * BLOCK_SIZE] = {0};
+    if (rufs_create("/stream", 0644, &fi) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /stream.\n");
+        return;
+    }
+    for (int i = 0; i < 16; i++) {
+        rufs_write("/stream", buffer, sizeof(buffer), (off_t)i * sizeof(buffer), &fi);
+    }
+
+    // Sequential reads open the window and keep it growing
+    struct rufs_fh *fh = (struct rufs_fh *)(uintptr_t)fi.fh;
+    size_t first = 0;
+    for (int i = 0; i < 8; i++) {
+        rufs_read("/stream", buffer, sizeof(buffer), (off_t)i * sizeof(buffer), &fi);
+        if (i == 0) {
+            first = fh->ra_window;
+        }
+    }
+    if (first == 0 || fh->ra_window <= first) {
+        fprintf(stderr, "Test failed: Readahead window did not grow on sequential reads.\n");
+        return;
+    }
+
+    // A jump collapses it
+    rufs_read("/stream", buffer, BLOCK_SIZE, 3 * BLOCK_SIZE, &fi);
+    if (fh->ra_window != 0) {
+        fprintf(stderr, "Test failed: Readahead window kept after a random read.\n");
+        return;
+    }
+
+    rufs_release("/stream", &fi);
+    printf("Test passed: Readahead follows the access pattern.\n");
+}
+
+void test_rufs_sparse() {
+    printf("Testing sparse files...\n");
+
+    initialize_test_fs();
+
+    // Write one block 1MB into an empty file
+    char data[BLOCK_SIZE];
+    memset(data, 'd', sizeof(data));
+    off_t data_off = 1 << 20;
+    if (rufs_create("/sparse", 0644, NULL) < 0 ||
+        rufs_write("/sparse", data, sizeof(data), data_off, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /sparse.\n");
+        return;
+    }
+
+    // Only the written block and its pointer block are allocated
+    struct stat stbuf;
+    if (rufs_getattr("/sparse", &stbuf) < 0 || stbuf.st_size != data_off + BLOCK_SIZE ||
+        stbuf.st_blocks != 2 * (BLOCK_SIZE / 512)) {
+        fprintf(stderr, "Test failed: The hole was allocated.\n");
+        return;
+    }
+
+    char buffer[2 * BLOCK_SIZE];
+    if (rufs_read("/sparse", buffer, sizeof(buffer), data_off - BLOCK_SIZE, NULL) != sizeof(buffer)) {
+        fprintf(stderr, "Test failed: Unable to read across the hole.\n");
+        return;
+    }
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (buffer[i] != 0 || buffer[BLOCK_SIZE + i] != 'd') {
+            fprintf(stderr, "Test failed: Wrong byte %d around the hole.\n", i);
+            return;
+        }
+    }
+
+    // libfuse frees every memory buffer read_buf hands it, so none may be zero_block
+    struct fuse_bufvec *bufv;
+    if (rufs_read_buf("/sparse", &bufv, sizeof(buffer), data_off - BLOCK_SIZE, NULL) < 0 ||
+        fuse_buf_size(bufv) != sizeof(buffer)) {
+        fprintf(stderr, "Test failed: Unable to read_buf across the hole.\n");
+        return;
+    }
+    size_t pos = 0;
+    for (size_t i = 0; i < bufv->count; i++) {
+        struct fuse_buf *seg = &bufv->buf[i];
+        if ((seg->flags & FUSE_BUF_IS_FD) || seg->mem == zero_block ||
+            memcmp(seg->mem, buffer + pos, seg->size) != 0) {
+            fprintf(stderr, "Test failed: read_buf segment %zu is not a private copy of the data.\n", i);
+            return;
+        }
+        pos += seg->size;
+        free(seg->mem);
+    }
+    free(bufv);
+
+    struct rufs_seek seek = { 0, SEEK_DATA };
+    if (rufs_ioctl("/sparse", RUFS_IOC_SEEK, NULL, NULL, 0, &seek) < 0 || seek.offset != data_off) {
+        fprintf(stderr, "Test failed: SEEK_DATA did not find the data.\n");
+        return;
+    }
+    seek.whence = SEEK_HOLE;
+    if (rufs_ioctl("/sparse", RUFS_IOC_SEEK, NULL, NULL, 0, &seek) < 0 || seek.offset != stbuf.st_size) {
+        fprintf(stderr, "Test failed: SEEK_HOLE did not find the end of the file.\n");
+        return;
+    }
+
+    printf("Test passed: Holes take no space and read as zeros.\n");
+}
+
+void test_rufs_unlink() {
+    printf("Testing unlink and rmdir...\n");
+
+    initialize_test_fs();
+
+    char data[4 * BLOCK_SIZE];
+    memset(data, 'u', sizeof(data));
+    if (rufs_mkdir("/gone", 0755) < 0 || rufs_create("/gone/file", 0644, NULL) < 0 ||
+        rufs_write("/gone/file", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to set up /gone/file.\n");
+        return;
+    }
+    struct inode inode;
+    if (get_node_by_path("/gone/file", 0, &inode) < 0) {
+        fprintf(stderr, "Test failed: Unable to find /gone/file.\n");
+        return;
+    }
+
+    if (rufs_rmdir("/gone") != -ENOTEMPTY) {
+        fprintf(stderr, "Test failed: rmdir removed a directory with entries.\n");
+        return;
+    }
+
+    // Unlink only removes the name; the blocks go when the orphan is reclaimed
+    if (rufs_unlink("/gone/file") < 0 || get_node_by_path("/gone/file", 0, &inode) == 0) {
+        fprintf(stderr, "Test failed: /gone/file is still there.\n");
+        return;
+    }
+    orphan_reclaim();
+    if (get_bitmap(inode_bitmap, inode.ino) || get_bitmap(data_bitmap, inode.direct_ptr[0] - sb.d_start_blk)) {
+        fprintf(stderr, "Test failed: The inode or its blocks were not freed.\n");
+        return;
+    }
+
+    if (rufs_rmdir("/gone") < 0) {
+        fprintf(stderr, "Test failed: Unable to remove the empty directory.\n");
+        return;
+    }
+
+    printf("Test passed: Unlinked files and directories give their space back.\n");
+}
+
+void test_rufs_discard() {
+    printf("Testing discard of freed blocks...\n");
+
+    initialize_test_fs();
+
+    static char data[256 * BLOCK_SIZE];
+    memset(data, 'p', sizeof(data));
+    struct inode inode;
+    if (rufs_create("/punch", 0644, NULL) < 0 ||
+        rufs_write("/punch", data, sizeof(data), 0, NULL) != sizeof(data) ||
+        get_node_by_path("/punch", 0, &inode) < 0) {
+        fprintf(stderr, "Test failed: Unable to write /punch.\n");
+        return;
+    }
+
+    if (rufs_unlink("/punch") < 0) {
+        fprintf(stderr, "Test failed: Unable to unlink /punch.\n");
+        return;
+    }
+    orphan_reclaim();
+    discard_run();
+
+    // The file's blocks should be holes in the image now
+    off_t first = (off_t)inode.direct_ptr[0] * BLOCK_SIZE;
+    off_t next = lseek(dev_fd(), first, SEEK_DATA);
+    if (next >= 0 && next < first + (off_t)sizeof(data)) {
+        fprintf(stderr, "Test failed: The image still holds the freed blocks.\n");
+        return;
+    }
+
+    printf("Test passed: Freed blocks are punched out of the image.\n");
+}
+
+void test_rufs_copy_range() {
+    printf("Testing rufs_copy_range...\n");
+
+    initialize_test_fs();
+
+    static char data[64 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = (char)(i % 251);
+    }
+    if (rufs_create("/orig", 0644, NULL) < 0 || rufs_create("/copy", 0644, NULL) < 0 ||
+        rufs_write("/orig", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /orig.\n");
+        return;
+    }
+
+    // Whole blocks are shared, so the copy allocates nothing but its pointer block
+    int used = 0;
+    for (int i = 0; i < MAX_DNUM; i++) {
+        used -= get_bitmap(data_bitmap, i);
+    }
+    if (rufs_copy_range("/orig", 0, "/copy", 0, sizeof(data)) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Short copy.\n");
+        return;
+    }
+    for (int i = 0; i < MAX_DNUM; i++) {
+        used += get_bitmap(data_bitmap, i);
+    }
+    if (used > 1) {
+        fprintf(stderr, "Test failed: The copy took %d blocks.\n", used);
+        return;
+    }
+
+    // Writing the copy must leave the original alone
+    char patch[16];
+    memset(patch, 'x', sizeof(patch));
+    static char buffer[64 * BLOCK_SIZE];
+    if (rufs_write("/copy", patch, sizeof(patch), BLOCK_SIZE, NULL) != sizeof(patch) ||
+        rufs_read("/orig", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) ||
+        memcmp(buffer, data, sizeof(data)) != 0) {
+        fprintf(stderr, "Test failed: Writing the copy changed the original.\n");
+        return;
+    }
+    memcpy(data + BLOCK_SIZE, patch, sizeof(patch));
+    if (rufs_read("/copy", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) ||
+        memcmp(buffer, data, sizeof(data)) != 0) {
+        fprintf(stderr, "Test failed: The copy reads back wrong.\n");
+        return;
+    }
+
+    printf("Test passed: Copies share blocks until written.\n");
+}
+
+void test_rufs_snapshot() {
+    printf("Testing snapshots...\n");
+
+    initialize_test_fs();
+
+    static char data[32 * BLOCK_SIZE];
+    memset(data, 'a', sizeof(data));
+    if (rufs_create("/file", 0644, NULL) < 0 ||
+        rufs_write("/file", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /file.\n");
+        return;
+    }
+
+    int id = rufs_snapshot_create();
+    if (id < 0) {
+        fprintf(stderr, "Test failed: rufs_snapshot_create returned %d.\n", id);
+        return;
+    }
+
+    // Change the live tree after the snapshot
+    char patch[BLOCK_SIZE];
+    memset(patch, 'b', sizeof(patch));
+    if (rufs_write("/file", patch, sizeof(patch), 0, NULL) != sizeof(patch) ||
+        rufs_create("/later", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to change the live tree.\n");
+        return;
+    }
+    rufs_destroy(NULL);
+
+    // The snapshot still has the old contents and takes no writes
+    static char buffer[32 * BLOCK_SIZE];
+    struct inode inode;
+    rufs_options.snapshot = id;
+    rufs_init(NULL);
+    int ok = rufs_read("/file", buffer, sizeof(buffer), 0, NULL) == sizeof(buffer) &&
+             memcmp(buffer, data, sizeof(data)) == 0 && get_node_by_path("/later", 0, &inode) < 0 &&
+             rufs_write("/file", patch, sizeof(patch), 0, NULL) == -EROFS;
+    rufs_destroy(NULL);
+    rufs_options.snapshot = 0;
+    if (!ok) {
+        fprintf(stderr, "Test failed: The snapshot does not show the tree as it was.\n");
+        return;
+    }
+
+    // The live tree kept its changes, and deleting the snapshot frees its copies
+    rufs_init(NULL);
+    memcpy(data, patch, sizeof(patch));
+    if (rufs_read("/file", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) ||
+        memcmp(buffer, data, sizeof(data)) != 0) {
+        fprintf(stderr, "Test failed: The live tree lost its changes.\n");
+        return;
+    }
+    if (rufs_snapshot_delete(id) < 0 || rufs_snapshot_delete(id) != -ENOENT) {
+        fprintf(stderr, "Test failed: Unable to delete the snapshot.\n");
+        return;
+    }
+    for (int i = 0; i < MAX_DNUM; i++) {
+        if (blk_refs[i] > 0) {
+            fprintf(stderr, "Test failed: Block %d still shared.\n", i);
+            return;
+        }
+    }
+
+    printf("Test passed: Snapshots keep the tree as it was.\n");
+}
+
+void test_rufs_generation() {
+    printf("Testing block generation stamps...\n");
+
+    initialize_test_fs();
+    rufs_init(NULL);
+
+    char data[BLOCK_SIZE];
+    memset(data, 'g', sizeof(data));
+    if (rufs_create("/old", 0644, NULL) < 0 || rufs_write("/old", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /old.\n");
+        return;
+    }
+    struct inode old_inode;
+    get_node_by_path("/old", 0, &old_inode);
+    uint32_t first = sb.gen;
+    rufs_destroy(NULL);
+
+    // A new mount is a new generation, and only what it writes is stamped with it
+    rufs_init(NULL);
+    if (sb.gen != first + 1) {
+        fprintf(stderr, "Test failed: Generation %u after %u.\n", sb.gen, first);
+        return;
+    }
+    if (rufs_create("/new", 0644, NULL) < 0 || rufs_write("/new", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /new.\n");
+        return;
+    }
+    struct inode new_inode;
+    get_node_by_path("/new", 0, &new_inode);
+    if (blk_gen[old_inode.direct_ptr[0]] != first || blk_gen[new_inode.direct_ptr[0]] != sb.gen) {
+        fprintf(stderr, "Test failed: Stamps %u and %u.\n",
+                blk_gen[old_inode.direct_ptr[0]], blk_gen[new_inode.direct_ptr[0]]);
+        return;
+    }
+    rufs_destroy(NULL);
+
+    printf("Test passed: Blocks carry the generation they were written in.\n");
+}
+
+void test_batch_abort() {
+    printf("Testing aborted batches...\n");
+
+    initialize_test_fs();
+    rufs_init(NULL);
+
+    if (rufs_create("/aborted", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to create /aborted.\n");
+        return;
+    }
+    struct inode node;
+    get_node_by_path("/aborted", 0, &node);
+    struct inode *inode = iget(node.ino);
+
+    // Map a direct and an indirect block, which allocates a pointer block too, then give up
+    struct meta_batch b;
+    struct bmap_cursor c = { 0, 0, &b };
+    batch_init(&b);
+    int direct = bmap(inode, 0, 1, &c);
+    int indirect = bmap(inode, 20, 1, &c);
+    int pointers = inode->indirect_ptr[0];
+    if (direct <= 0 || indirect <= 0 || pointers <= 0) {
+        fprintf(stderr, "Test failed: Unable to map blocks.\n");
+        return;
+    }
+    batch_abort(&b);
+
+    // The blocks are free again and the cached inode has no pointers to them
+    int leaked = get_bitmap(data_bitmap, direct - sb.d_start_blk) ||
+                 get_bitmap(data_bitmap, indirect - sb.d_start_blk) ||
+                 get_bitmap(data_bitmap, pointers - sb.d_start_blk);
+    if (leaked || inode->direct_ptr[0] != 0 || inode->indirect_ptr[0] != 0 || inode->vstat.st_blocks != 0) {
+        fprintf(stderr, "Test failed: The aborted batch left its blocks behind.\n");
+        return;
+    }
+    iput(inode);
+
+    rufs_destroy(NULL);
+
+    printf("Test passed: Aborting a batch gives back what it allocated.\n");
+}
+
+// Whether ./COPY holds the same blocks as ./DISKFILE, leaving out the dead
+// journal and the generation the copy was last applied at
+static int delta_copy_matches() {
+    int a = open("./DISKFILE", O_RDONLY), b = open("./COPY", O_RDONLY);
+    int same = a >= 0 && b >= 0;
+    char x[BLOCK_SIZE], y[BLOCK_SIZE];
+
+    for (uint32_t blk = 0; same && blk < sb.d_start_blk + sb.max_dnum; blk++) {
+        if (blk >= sb.j_start_blk && blk < sb.j_start_blk + sb.j_blks) {
+            continue;
+        }
+        // The data region runs past DISK_SIZE, and past the end reads as zero
+        memset(x, 0, BLOCK_SIZE);
+        memset(y, 0, BLOCK_SIZE);
+        if (pread(a, x, BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) < 0 ||
+            pread(b, y, BLOCK_SIZE, (off_t)blk * BLOCK_SIZE) < 0) {
+            same = 0;
+            break;
+        }
+        if (blk == 0) {
+            ((struct superblock *)x)->applied_gen = ((struct superblock *)y)->applied_gen;
+        }
+        if (memcmp(x, y, BLOCK_SIZE) != 0) {
+            fprintf(stderr, "Block %u differs.\n", blk);
+            same = 0;
+        }
+    }
+    close(a);
+    close(b);
+    return same;
+}
+
+void test_rufs_delta_roundtrip() {
+    printf("Testing delta export and apply...\n");
+
+    initialize_test_fs();
+    rufs_init(NULL);
+
+    char data[3 * BLOCK_SIZE];
+    memset(data, 'd', sizeof(data));
+    if (rufs_mkdir("/dir", 0755) < 0 || rufs_create("/dir/first", 0644, NULL) < 0 ||
+        rufs_write("/dir/first", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /dir/first.\n");
+        return;
+    }
+    uint32_t first = sb.gen;
+    rufs_destroy(NULL);
+
+    // A full stream rebuilds the image over a copy holding stale blocks
+    FILE *stale = fopen("./COPY", "w");
+    memset(data, 'x', sizeof(data));
+    if (stale == NULL || fseek(stale, (long)(sb.d_start_blk + 10) * BLOCK_SIZE, SEEK_SET) != 0 ||
+        fwrite(data, 1, sizeof(data), stale) != sizeof(data) || fclose(stale) != 0) {
+        fprintf(stderr, "Test failed: Unable to write a stale copy.\n");
+        return;
+    }
+    if (system("./rufs_delta export ./DISKFILE 0 > ./full.delta") != 0 ||
+        system("./rufs_delta apply ./COPY < ./full.delta") != 0) {
+        fprintf(stderr, "Test failed: The full stream did not export and apply.\n");
+        return;
+    }
+    if (!delta_copy_matches()) {
+        fprintf(stderr, "Test failed: The copy differs after the full stream.\n");
+        return;
+    }
+
+    // An incremental stream from the copy's generation brings it up to date
+    rufs_init(NULL);
+    memset(data, 'e', sizeof(data));
+    if (rufs_create("/dir/second", 0644, NULL) < 0 ||
+        rufs_write("/dir/second", data, sizeof(data), 0, NULL) != sizeof(data) ||
+        rufs_write("/dir/first", data, BLOCK_SIZE, BLOCK_SIZE, NULL) != BLOCK_SIZE ||
+        rufs_truncate("/dir/first", BLOCK_SIZE) < 0) {
+        fprintf(stderr, "Test failed: Unable to change the image.\n");
+        return;
+    }
+    rufs_destroy(NULL);
+
+    char cmd[128];
+    snprintf(cmd, sizeof(cmd), "./rufs_delta export ./DISKFILE %u > ./incr.delta", first);
+    if (system(cmd) != 0 || system("./rufs_delta apply ./COPY < ./incr.delta") != 0) {
+        fprintf(stderr, "Test failed: The incremental stream did not export and apply.\n");
+        return;
+    }
+    if (!delta_copy_matches()) {
+        fprintf(stderr, "Test failed: The copy differs after the incremental stream.\n");
+        return;
+    }
+
+    unlink("./full.delta");
+    unlink("./incr.delta");
+    unlink("./COPY");
+
+    printf("Test passed: Streams bring a copy to the same blocks as the image.\n");
+}
+
+void test_rufs_compress() {
+    printf("Testing compressed files...\n");
+
+    initialize_test_fs();
+
+    // Files created in a compressed directory are compressed
+    int32_t on = 1;
+    if (rufs_mkdir("/logs", 0755) < 0 || rufs_ioctl("/logs", RUFS_IOC_COMPRESS, NULL, NULL, 0, &on) < 0 ||
+        rufs_create("/logs/app.log", 0644, NULL) < 0) {
+        fprintf(stderr, "Test failed: Unable to set up /logs.\n");
+        return;
+    }
+
+    static char data[64 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = "INFO request served\n"[i % 20];
+    }
+    if (rufs_write("/logs/app.log", data, sizeof(data), 100, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /logs/app.log.\n");
+        return;
+    }
+    struct stat st;
+    rufs_getattr("/logs/app.log", &st);
+    if (st.st_blocks * 512 >= (blkcnt_t)sizeof(data) / 4) {
+        fprintf(stderr, "Test failed: %ld sectors stored for %zu bytes.\n", (long)st.st_blocks, sizeof(data));
+        return;
+    }
+
+    // Read back across cluster edges, then shrink into a cluster and grow again
+    static char buffer[64 * BLOCK_SIZE + 100];
+    if (rufs_read("/logs/app.log", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) ||
+        memcmp(buffer + 100, data, sizeof(data)) != 0) {
+        fprintf(stderr, "Test failed: The file reads back wrong.\n");
+        return;
+    }
+    if (rufs_truncate("/logs/app.log", 5000) < 0 || rufs_truncate("/logs/app.log", 9000) < 0 ||
+        rufs_read("/logs/app.log", buffer, 9000, 0, NULL) != 9000 ||
+        memcmp(buffer + 100, data, 4900) != 0 || buffer[5000] != 0 || buffer[8999] != 0) {
+        fprintf(stderr, "Test failed: Truncate left stale data.\n");
+        return;
+    }
+
+    printf("Test passed: Compressed files read back what was written.\n");
+}
+
+void test_rufs_dedup() {
+    printf("Testing deduplication...\n");
+
+    initialize_test_fs();
+
+    static char data[32 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand();
+    }
+
+    // Two copies written before dedup is on share their blocks once the ioctl runs
+    struct rufs_dedup req;
+    if (rufs_create("/one", 0644, NULL) < 0 || rufs_write("/one", data, sizeof(data), 0, NULL) != sizeof(data) ||
+        rufs_create("/two", 0644, NULL) < 0 || rufs_write("/two", data, sizeof(data), 0, NULL) != sizeof(data) ||
+        rufs_ioctl("/", RUFS_IOC_DEDUP, NULL, NULL, 0, &req) < 0) {
+        fprintf(stderr, "Test failed: Unable to deduplicate /one and /two.\n");
+        return;
+    }
+    if (req.merged != 32) {
+        fprintf(stderr, "Test failed: %u of 32 blocks merged.\n", req.merged);
+        return;
+    }
+
+    // With the option set, a third copy allocates nothing but its pointer block
+    rufs_options.dedup = 1;
+    int used = 0;
+    for (int i = 0; i < MAX_DNUM; i++) {
+        used -= get_bitmap(data_bitmap, i);
+    }
+    if (rufs_create("/three", 0644, NULL) < 0 || rufs_write("/three", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /three.\n");
+        rufs_options.dedup = 0;
+        return;
+    }
+    for (int i = 0; i < MAX_DNUM; i++) {
+        used += get_bitmap(data_bitmap, i);
+    }
+    if (used > 1) {
+        fprintf(stderr, "Test failed: /three took %d blocks.\n", used);
+        rufs_options.dedup = 0;
+        return;
+    }
+
+    // Writing one copy leaves the others as they were
+    static char buffer[32 * BLOCK_SIZE];
+    if (rufs_write("/two", "changed", 7, 5000, NULL) != 7 ||
+        rufs_read("/one", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) || memcmp(buffer, data, sizeof(data)) != 0 ||
+        rufs_read("/three", buffer, sizeof(buffer), 0, NULL) != sizeof(buffer) || memcmp(buffer, data, sizeof(data)) != 0) {
+        fprintf(stderr, "Test failed: A write showed through a shared block.\n");
+        rufs_options.dedup = 0;
+        return;
+    }
+    rufs_options.dedup = 0;
+
+    printf("Test passed: Identical blocks are stored once.\n");
+}
+
+void test_rufs_checksum() {
+    printf("Testing block checksums...\n");
+
+    initialize_test_fs();
+    rufs_init(NULL);
+
+    static char data[8 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(data); i++) {
+        data[i] = rand();
+    }
+    if (crc32c(0, "123456789", 9) != 0xE3069283) {
+        fprintf(stderr, "Test failed: crc32c gives the wrong check value.\n");
+        return;
+    }
+    if (rufs_create("/summed", 0644, NULL) < 0 || rufs_write("/summed", data, sizeof(data), 0, NULL) != sizeof(data)) {
+        fprintf(stderr, "Test failed: Unable to write /summed.\n");
+        return;
+    }
+
+    // Flip a byte of the third block behind block.c's back
+    struct inode inode;
+    get_node_by_path("/summed", 0, &inode);
+    char flipped = data[2 * BLOCK_SIZE + 10] ^ 1;
+    if (pwrite(dev_fd(), &flipped, 1, (off_t)inode.direct_ptr[2] * BLOCK_SIZE + 10) != 1) {
+        fprintf(stderr, "Test failed: Unable to damage the image.\n");
+        return;
+    }
+
+    // Reads of that block fail, reads of the others do not, and the scrubber finds it
+    char buffer[BLOCK_SIZE];
+    if (rufs_read("/summed", buffer, 100, 2 * BLOCK_SIZE + 50, NULL) >= 0) {
+        fprintf(stderr, "Test failed: A damaged block read back.\n");
+        return;
+    }
+    if (rufs_read("/summed", buffer, BLOCK_SIZE, 3 * BLOCK_SIZE, NULL) != BLOCK_SIZE) {
+        fprintf(stderr, "Test failed: An intact block failed to read.\n");
+        return;
+    }
+    struct rufs_scrub before, after;
+    rufs_ioctl("/", RUFS_IOC_SCRUB, NULL, NULL, 0, &before);
+    rufs_options.scrub = 1000000;
+    scrub_run();
+    rufs_options.scrub = 0;
+    rufs_ioctl("/", RUFS_IOC_SCRUB, NULL, NULL, 0, &after);
+    if (after.bad - before.bad != 1 || after.scanned == before.scanned) {
+        fprintf(stderr, "Test failed: The scrubber found %u bad blocks.\n", after.bad - before.bad);
+        return;
+    }
+
+    // Writing the block again gives it a sum that matches
+    if (rufs_write("/summed", data + 2 * BLOCK_SIZE, BLOCK_SIZE, 2 * BLOCK_SIZE, NULL) != BLOCK_SIZE ||
+        rufs_read("/summed", buffer, BLOCK_SIZE, 2 * BLOCK_SIZE, NULL) != BLOCK_SIZE ||
+        memcmp(buffer, data + 2 * BLOCK_SIZE, BLOCK_SIZE) != 0) {
+        fprintf(stderr, "Test failed: The rewritten block reads back wrong.\n");
+        return;
+    }
+
+    // A snapshot mount checks the blocks it reads too
+    int id = rufs_snapshot_create();
+    rufs_destroy(NULL);
+    int fd = open(diskfile_path, O_WRONLY);
+    flipped = data[4 * BLOCK_SIZE + 10] ^ 1;
+    if (id < 0 || fd < 0 || pwrite(fd, &flipped, 1, (off_t)inode.direct_ptr[4] * BLOCK_SIZE + 10) != 1) {
+        fprintf(stderr, "Test failed: Unable to damage a snapshot block.\n");
+        return;
+    }
+    close(fd);
+    rufs_options.snapshot = id;
+    rufs_init(NULL);
+    int caught = rufs_read("/summed", buffer, 100, 4 * BLOCK_SIZE + 50, NULL) < 0;
+    rufs_destroy(NULL);
+    rufs_options.snapshot = 0;
+    if (!caught) {
+        fprintf(stderr, "Test failed: A damaged snapshot block read back.\n");
+        return;
+    }
+
+    printf("Test passed: Damaged blocks are caught on read and by the scrubber.\n");
+}